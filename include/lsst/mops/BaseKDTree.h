@@ -249,7 +249,6 @@ void BaseKDTree<T, TreeNodeClass>::buildFromData(
         std::vector <std::vector<double> > pointsByDimension;
         std::vector <double> pointsUBounds, pointsLBounds;
         double tmpMax, tmpMin;
-        std::vector <PointAndValue <T> > pointsAndValuesCopy;
         std::vector <std::vector<double>*> allocatedDoubleVecs;
 
         /* sanity check */
@@ -303,18 +302,24 @@ void BaseKDTree<T, TreeNodeClass>::buildFromData(
         myUBounds = pointsUBounds;
         myLBounds = pointsLBounds;
   
-        /* make a copy of the pointsAndValues we were given; it will be
-           edited destructively.
-        */
-
-        pointsAndValuesCopy = pointsAndValues;
-  
         /* create the root of the tree (and the rest of the tree
-         * recursively), save it to private var. */
+         * recursively), save it to private var. If we have enough
+         * data, the nodes build their subtrees as OpenMP tasks, which
+         * need a parallel region to run in. */
         unsigned int idCounter = 0;
-        myRoot = new TreeNodeClass(
-            pointsAndValuesCopy, k, maxLeafSize, 0,
-            pointsUBounds, pointsLBounds, idCounter);
+#ifdef _OPENMP
+#pragma omp parallel if(pointsAndValues.size() >= KDTREE_PARALLEL_BUILD_CUTOFF)
+#endif
+        {
+#ifdef _OPENMP
+#pragma omp single
+#endif
+            {
+                myRoot = new TreeNodeClass(
+                    pointsAndValues, k, maxLeafSize, 0,
+                    pointsUBounds, pointsLBounds, idCounter);
+            }
+        }
         // don't set hasData until now, when the tree is actually built.
         mySize = idCounter;
         hasData = true;
@@ -5,6 +5,7 @@
 #define BASE_LSST_KDTREE_NODE_H
 
 #include <iostream>
+#include <algorithm>
 
 #include "lsst/mops/common.h"
 #include "lsst/mops/PointAndValue.h"
@@ -25,9 +26,103 @@
 
 static unsigned int lastId_NULL = 0;
 
+/*
+ * tree construction is task-parallel when built with OpenMP
+ * (-fopenmp); without it the pragmas are compiled out and everything
+ * below is serial. Nodes with at least this many points build their two
+ * subtrees as concurrent tasks and partition their points in parallel
+ * chunks; smaller subtrees are built serially by whichever thread
+ * gets them.
+ *
+ * Construction is deterministic: the partitions preserve input order
+ * and node ids are fixed up to match a serial (preorder) build, so
+ * the tree is the same regardless of thread count.
+ */
+#define KDTREE_PARALLEL_BUILD_CUTOFF 10000
+#define KDTREE_PARALLEL_PARTITION_CHUNKS 8
+
 namespace lsst {
 namespace mops {
 
+
+    /* 
+     * split points into those with point[axis] < pivot (or <= pivot,
+     * if tiesGoLeft) and the rest, preserving the input order in
+     * each. Big inputs are classified in chunks which run as OpenMP
+     * tasks; call from inside a parallel region to make use of that.
+     */
+    template <class T>
+    void partitionPointsByAxis(const std::vector<PointAndValue <T> > &points,
+                               unsigned int axis, double pivot, bool tiesGoLeft,
+                               std::vector<PointAndValue <T> > &left,
+                               std::vector<PointAndValue <T> > &right)
+    {
+        unsigned int nChunks = 1;
+        if (points.size() >= KDTREE_PARALLEL_BUILD_CUTOFF) {
+            nChunks = KDTREE_PARALLEL_PARTITION_CHUNKS;
+        }
+        unsigned int chunkSize = (points.size() + nChunks - 1) / nChunks;
+        std::vector<unsigned int> nLeft(nChunks, 0);
+        std::vector<unsigned char> goesLeft(points.size());
+        
+        // first pass: classify each point and count per chunk.
+        for (unsigned int c = 0; c < nChunks; c++) {
+#ifdef _OPENMP
+#pragma omp task shared(points, nLeft, goesLeft) firstprivate(c) if(nChunks > 1)
+#endif
+            {
+                unsigned int end = std::min((unsigned int) points.size(), 
+                                            (c + 1) * chunkSize);
+                for (unsigned int i = c * chunkSize; i < end; i++) {
+                    double val = points[i].getPoint()[axis];
+                    goesLeft[i] = (val < pivot) || (tiesGoLeft && (val == pivot));
+                    nLeft[c] += goesLeft[i];
+                }
+            }
+        }
+#ifdef _OPENMP
+#pragma omp taskwait
+#endif
+
+        // second pass: copy each chunk to its (now known) offsets.
+        std::vector<unsigned int> leftOffset(nChunks, 0);
+        std::vector<unsigned int> rightOffset(nChunks, 0);
+        for (unsigned int c = 1; c < nChunks; c++) {
+            unsigned int prevSize = std::min((unsigned int) points.size(), 
+                                             c * chunkSize) 
+                - std::min((unsigned int) points.size(), (c - 1) * chunkSize);
+            leftOffset[c] = leftOffset[c - 1] + nLeft[c - 1];
+            rightOffset[c] = rightOffset[c - 1] + prevSize - nLeft[c - 1];
+        }
+        unsigned int totalLeft = leftOffset[nChunks - 1] + nLeft[nChunks - 1];
+        left.resize(totalLeft);
+        right.resize(points.size() - totalLeft);
+
+        for (unsigned int c = 0; c < nChunks; c++) {
+#ifdef _OPENMP
+#pragma omp task shared(points, goesLeft, left, right, leftOffset, rightOffset) firstprivate(c) if(nChunks > 1)
+#endif
+            {
+                unsigned int end = std::min((unsigned int) points.size(), 
+                                            (c + 1) * chunkSize);
+                unsigned int l = leftOffset[c];
+                unsigned int r = rightOffset[c];
+                for (unsigned int i = c * chunkSize; i < end; i++) {
+                    if (goesLeft[i]) {
+                        left[l++] = points[i];
+                    }
+                    else {
+                        right[r++] = points[i];
+                    }
+                }
+            }
+        }
+#ifdef _OPENMP
+#pragma omp taskwait
+#endif
+    }
+
+
     
     template <class T, class RecursiveT>
     class BaseKDTreeNode {
@@ -73,10 +168,10 @@ namespace mops {
          *
          * ASSUMES all points have size > axis 
         */
-        double getMedianByAxis(std::vector<PointAndValue<T> > pointsAndValues,
+        double getMedianByAxis(const std::vector<PointAndValue<T> > &pointsAndValues,
                                unsigned int axis);
 
-        double maxByAxis(std::vector<PointAndValue<T> > pointsAndValues,
+        double maxByAxis(const std::vector<PointAndValue<T> > &pointsAndValues,
                          unsigned int axis);
 
 
@@ -84,8 +179,31 @@ namespace mops {
         const std::vector<double> *getLBounds() const;
 
         
+        /* 
+         * used while building the tree: exchange everything with
+         * other (an O(1) operation, unlike copying a subtree), and
+         * add offset to the ids of this node and all its
+         * descendants.
+         */
+        void swapContents(BaseKDTreeNode<T, RecursiveT> &other);
+
+        void shiftIds(unsigned int offset);
+
     protected:
-        BaseKDTreeNode() {};
+        BaseKDTreeNode() : myRefCount(0), myK(0), id(0) {};
+
+        /* build our two children from the already-partitioned
+         * points. Large subtrees are built as concurrent tasks. */
+        void buildChildren(
+            const std::vector<PointAndValue <T> > &leftPointsAndValues,
+            const std::vector<double> &leftChildUBounds,
+            const std::vector<double> &leftChildLBounds,
+            const std::vector<PointAndValue <T> > &rightPointsAndValues,
+            const std::vector<double> &rightChildUBounds,
+            const std::vector<double> &rightChildLBounds,
+            unsigned int maxLeafSize, unsigned int nextAxis,
+            unsigned int &lastId);
+
         std::vector <RecursiveT > myChildren;        
         unsigned int myRefCount;
         unsigned int myK;
@@ -250,38 +368,97 @@ than dimensions of data\n");
         leftChildLBounds = LBounds;
     
         //partition data for children
-        for (unsigned int i = 0; i < pointsAndValues.size(); i++) {
-
-            tmpPointAndValue = pointsAndValues[i];
-
-            if (tmpPointAndValue.getPoint()[myAxisToSplit] <= tmpMedian) { 
-                leftPointsAndValues.push_back(tmpPointAndValue);
-            }
-            else {
-                rightPointsAndValues.push_back(tmpPointAndValue);
-            }
-      
-            /* it would be really nice to delete
-             * pointsAndValues[i] at this point, but since it
-             * holds statically allocated data that's not really
-             * possible... this calls for a possible redesign
-             * (ugh)
-             */
-        }
+        partitionPointsByAxis(pointsAndValues, myAxisToSplit, tmpMedian, true,
+                              leftPointsAndValues, rightPointsAndValues);
     
         nextAxis = (myAxisToSplit + 1) % (myK);
-    
-        RecursiveT leftChild(leftPointsAndValues, k, maxLeafSize,
+
+        buildChildren(leftPointsAndValues, leftChildUBounds, leftChildLBounds,
+                      rightPointsAndValues, rightChildUBounds, rightChildLBounds,
+                      maxLeafSize, nextAxis, lastId);
+    }
+}
+
+
+
+
+template <class T, class RecursiveT>
+void BaseKDTreeNode<T, RecursiveT>::buildChildren(
+    const std::vector<PointAndValue <T> > &leftPointsAndValues,
+    const std::vector<double> &leftChildUBounds,
+    const std::vector<double> &leftChildLBounds,
+    const std::vector<PointAndValue <T> > &rightPointsAndValues,
+    const std::vector<double> &rightChildUBounds,
+    const std::vector<double> &rightChildLBounds,
+    unsigned int maxLeafSize, unsigned int nextAxis,
+    unsigned int &lastId)
+{
+    /* children are built in temporaries and swapped into place, so we
+     * never copy a whole subtree. */
+    myChildren.resize(2);
+    unsigned int nPoints = leftPointsAndValues.size() + rightPointsAndValues.size();
+
+    if (nPoints < KDTREE_PARALLEL_BUILD_CUTOFF) {
+        RecursiveT leftChild(leftPointsAndValues, myK, maxLeafSize,
                              nextAxis, 
                              leftChildUBounds, leftChildLBounds, lastId);
-    
-        myChildren.push_back(leftChild);
-    
-        RecursiveT rightChild(rightPointsAndValues, k, maxLeafSize,
+        myChildren[0].swapContents(leftChild);
+        
+        RecursiveT rightChild(rightPointsAndValues, myK, maxLeafSize,
                               nextAxis, rightChildUBounds, 
                               rightChildLBounds, lastId);
+        myChildren[1].swapContents(rightChild);
+    }
+    else {
+        /* the left subtree takes the next ids, as in a serial build;
+         * the right subtree counts from 0 and is shifted afterward. */
+        unsigned int rightIds = 0;
+        unsigned int k = myK;
+#ifdef _OPENMP
+#pragma omp task shared(leftPointsAndValues, leftChildUBounds, leftChildLBounds, lastId)
+#endif
+        {
+            RecursiveT leftChild(leftPointsAndValues, k, maxLeafSize,
+                                 nextAxis, 
+                                 leftChildUBounds, leftChildLBounds, lastId);
+            myChildren[0].swapContents(leftChild);
+        }
+        RecursiveT rightChild(rightPointsAndValues, k, maxLeafSize,
+                              nextAxis, rightChildUBounds, 
+                              rightChildLBounds, rightIds);
+        myChildren[1].swapContents(rightChild);
+#ifdef _OPENMP
+#pragma omp taskwait
+#endif
+        myChildren[1].shiftIds(lastId);
+        lastId += rightIds;
+    }
+}
+
+
+
+
+template <class T, class RecursiveT>
+void BaseKDTreeNode<T, RecursiveT>::swapContents(BaseKDTreeNode<T, RecursiveT> &other)
+{
+    myChildren.swap(other.myChildren);
+    std::swap(myRefCount, other.myRefCount);
+    std::swap(myK, other.myK);
+    myUBounds.swap(other.myUBounds);
+    myLBounds.swap(other.myLBounds);
+    myData.swap(other.myData);
+    std::swap(id, other.id);
+}
+
+
 
-        myChildren.push_back(rightChild);
+
+template <class T, class RecursiveT>
+void BaseKDTreeNode<T, RecursiveT>::shiftIds(unsigned int offset)
+{
+    id += offset;
+    for (unsigned int i = 0; i < myChildren.size(); i++) {
+        myChildren[i].shiftIds(offset);
     }
 }
 
@@ -323,7 +500,7 @@ void BaseKDTreeNode<T, RecursiveT>::debugPrint(int depth) const
     
 template <class T, class RecursiveT>
 double BaseKDTreeNode<T, RecursiveT>::maxByAxis(
-    std::vector<PointAndValue<T> > pointsAndValues, 
+    const std::vector<PointAndValue<T> > &pointsAndValues, 
     unsigned int axis) 
 {
     double tmpMax = 0;
@@ -342,14 +519,15 @@ double BaseKDTreeNode<T, RecursiveT>::maxByAxis(
  
 template <class T, class RecursiveT>
 double BaseKDTreeNode<T, RecursiveT>::getMedianByAxis(
-    std::vector<PointAndValue<T> > pointsAndValues,
+    const std::vector<PointAndValue<T> > &pointsAndValues,
     unsigned int axis)
 {
     double tmpMedian;
     std::vector<double> splitAxisPointData;
     typename std::vector<PointAndValue<T>,
-        std::allocator<PointAndValue<T> > >::iterator myIter;
+        std::allocator<PointAndValue<T> > >::const_iterator myIter;
     
+    splitAxisPointData.reserve(pointsAndValues.size());
     for (myIter = pointsAndValues.begin(); 
          myIter != pointsAndValues.end();
          myIter++) {
@@ -0,0 +1,292 @@
+// -*- LSST-C++ -*-
+
+/*
+ * DetectionToTrackIndex: the inverse of a vector of tracks (or
+ * tracklets), i.e. for each detection, the indices of the tracks
+ * which use it, in ascending order.
+ *
+ * removeSubsets and putLongestPerDetInOutputVector used to build this
+ * as a std::map from detection to a vector or set of track indices;
+ * with millions of tracks that is a tree of millions of nodes, each
+ * with its own small allocation.  Here it is two flat arrays in
+ * compressed sparse row form: the track indices of all the
+ * detections, end to end, and for each detection the offset of its
+ * run of tracks.
+ *
+ * Detection indices are normally indices into a dets file and so
+ * dense, in which case a detection is its own slot.  If they are not
+ * (say, the tracks hold detection IDs), the detections used are
+ * sorted and each is given the slot of its position in that list.
+ *
+ * When built with OpenMP, the index is filled in parallel: a counting
+ * pass sizes each detection's run, then each track writes itself into
+ * the runs of its detections, and each run is sorted.
+ *
+ * intersectWith does the set intersections removeSubsets is made of.
+ * How depends on the sizes of the two lists: a plain merge if they
+ * are similar, a galloping search of the detection's list if it is
+ * much longer, and a bitmap lookup for a detection used by a large
+ * share of all the tracks.  Such a detection gets a bitmap (one bit
+ * per track) when that takes no more room than its list does, so the
+ * bitmaps at most double the size of the index.
+ */
+
+#ifndef LSST_DETECTION_TO_TRACK_INDEX_H
+#define LSST_DETECTION_TO_TRACK_INDEX_H
+
+#include <algorithm>
+#include <set>
+#include <vector>
+
+#include "lsst/mops/Tracklet.h"
+
+// intersectWith gallops through a detection's track list, rather than
+// merging, if it is more than this many times the length of the other.
+#define DETECTION_TO_TRACK_GALLOP_RATIO 8
+
+
+namespace lsst {
+namespace mops {
+
+
+    /* the detections of a track, for the various ways we store one. */
+    inline const std::set<unsigned int> &detectionsOf(const Tracklet &t)
+    {
+        return t.indices;
+    }
+
+    inline const std::set<unsigned int> &detectionsOf(const std::set<unsigned int> &t)
+    {
+        return t;
+    }
+
+
+
+    class DetectionToTrackIndex {
+    public:
+
+        /* returned by slotOf for a detection no track uses. */
+        static const unsigned int NO_SLOT = 0xFFFFFFFFu;
+
+        /* TrackT is anything detectionsOf accepts. */
+        template <class TrackT>
+        explicit DetectionToTrackIndex(const std::vector<TrackT> &tracks) {
+            build(tracks);
+        }
+
+        /* slots are numbered 0 .. numSlots() - 1.  A slot with no
+         * tracks is possible, if detection indices are dense but not
+         * all are used. */
+        unsigned int numSlots() const { return offsets.size() - 1; }
+
+        unsigned int slotOf(unsigned int det) const {
+            if (isDense) {
+                if (det < numSlots()) {
+                    return det;
+                }
+                return NO_SLOT;
+            }
+            std::vector<unsigned int>::const_iterator it =
+                std::lower_bound(slotDets.begin(), slotDets.end(), det);
+            if ((it == slotDets.end()) || (*it != det)) {
+                return NO_SLOT;
+            }
+            return it - slotDets.begin();
+        }
+
+        /* the indices of the tracks using the detection in slot, in
+         * ascending order. */
+        const unsigned int *begin(unsigned int slot) const {
+            return trackIndicesStart() + offsets[slot];
+        }
+        const unsigned int *end(unsigned int slot) const {
+            return trackIndicesStart() + offsets[slot + 1];
+        }
+        unsigned int size(unsigned int slot) const {
+            return offsets[slot + 1] - offsets[slot];
+        }
+
+        /* remove from tracks, which must be sorted, any track which
+         * does not use the detection in slot. */
+        void intersectWith(unsigned int slot, std::vector<unsigned int> &tracks) const {
+            const unsigned int *listIter = begin(slot);
+            const unsigned int *listEnd = end(slot);
+            const unsigned int *bitmap = bitmapOf(slot);
+            unsigned int numTracks = tracks.size();
+            unsigned int nKept = 0;
+
+            if (bitmap != NULL) {
+                for (unsigned int i = 0; i < numTracks; i++) {
+                    unsigned int t = tracks[i];
+                    if ((bitmap[t / 32] >> (t % 32)) & 1u) {
+                        tracks[nKept++] = t;
+                    }
+                }
+            }
+            else if ((unsigned int)(listEnd - listIter) > 
+                     DETECTION_TO_TRACK_GALLOP_RATIO * numTracks) {
+                for (unsigned int i = 0; (i < numTracks) && (listIter != listEnd); i++) {
+                    unsigned int t = tracks[i];
+                    // double the step until we pass t, then binary
+                    // search the last step.
+                    unsigned int remaining = listEnd - listIter;
+                    unsigned int step = 1;
+                    while ((step < remaining) && (listIter[step] < t)) {
+                        step *= 2;
+                    }
+                    const unsigned int *searchEnd = 
+                        (step < remaining) ? listIter + step + 1 : listEnd;
+                    listIter = std::lower_bound(listIter + step / 2, searchEnd, t);
+                    if ((listIter != listEnd) && (*listIter == t)) {
+                        tracks[nKept++] = t;
+                        listIter++;
+                    }
+                }
+            }
+            else {
+                unsigned int i = 0;
+                while ((i < numTracks) && (listIter != listEnd)) {
+                    unsigned int t = tracks[i];
+                    unsigned int u = *listIter;
+                    if (t == u) {
+                        tracks[nKept++] = t;
+                    }
+                    i += (t <= u);
+                    listIter += (u <= t);
+                }
+            }
+            tracks.resize(nKept);
+        }
+
+    private:
+
+        template <class TrackT>
+        void build(const std::vector<TrackT> &tracks) {
+            unsigned int numEntries = 0;
+            unsigned int maxDet = 0;
+            for (unsigned int i = 0; i < tracks.size(); i++) {
+                const std::set<unsigned int> &dets = detectionsOf(tracks[i]);
+                numEntries += dets.size();
+                if ((dets.size() > 0) && (*dets.rbegin() > maxDet)) {
+                    maxDet = *dets.rbegin();
+                }
+            }
+
+            // don't allocate a slot for every possible detection
+            // unless a fair share of them are used.
+            isDense = (maxDet / 2 <= numEntries);
+            if (!isDense) {
+                slotDets.reserve(numEntries);
+                for (unsigned int i = 0; i < tracks.size(); i++) {
+                    const std::set<unsigned int> &dets = detectionsOf(tracks[i]);
+                    slotDets.insert(slotDets.end(), dets.begin(), dets.end());
+                }
+                std::sort(slotDets.begin(), slotDets.end());
+                slotDets.erase(std::unique(slotDets.begin(), slotDets.end()),
+                               slotDets.end());
+            }
+            unsigned int nSlots = 0;
+            if (numEntries > 0) {
+                nSlots = isDense ? maxDet + 1 : slotDets.size();
+            }
+            offsets.assign(nSlots + 1, 0);
+            int numTracks = tracks.size();
+
+            // count the tracks of each detection...
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+            for (int i = 0; i < numTracks; i++) {
+                const std::set<unsigned int> &dets = detectionsOf(tracks[i]);
+                std::set<unsigned int>::const_iterator detIter;
+                for (detIter = dets.begin(); detIter != dets.end(); detIter++) {
+                    unsigned int slot = slotOf(*detIter);
+#ifdef _OPENMP
+#pragma omp atomic
+#endif
+                    offsets[slot + 1]++;
+                }
+            }
+            for (unsigned int s = 0; s < nSlots; s++) {
+                offsets[s + 1] += offsets[s];
+            }
+
+            // ...then write each track into the runs of its detections.
+            trackIndices.resize(numEntries);
+            std::vector<unsigned int> nextFree(offsets.begin(), offsets.end() - 1);
+#ifdef _OPENMP
+#pragma omp parallel for schedule(static)
+#endif
+            for (int i = 0; i < numTracks; i++) {
+                const std::set<unsigned int> &dets = detectionsOf(tracks[i]);
+                std::set<unsigned int>::const_iterator detIter;
+                for (detIter = dets.begin(); detIter != dets.end(); detIter++) {
+                    unsigned int slot = slotOf(*detIter);
+                    unsigned int pos;
+#ifdef _OPENMP
+#pragma omp atomic capture
+#endif
+                    pos = nextFree[slot]++;
+                    trackIndices[pos] = i;
+                }
+            }
+#ifdef _OPENMP
+            // threads write their tracks in any order; a serial build
+            // writes them in order already.
+            int numSlotsToSort = nSlots;
+#pragma omp parallel for schedule(dynamic, 1024)
+            for (int s = 0; s < numSlotsToSort; s++) {
+                std::sort(trackIndices.begin() + offsets[s],
+                          trackIndices.begin() + offsets[s + 1]);
+            }
+#endif
+
+            unsigned int wordsPerBitmap = (numTracks + 31) / 32;
+            for (unsigned int s = 0; s < nSlots; s++) {
+                if (size(s) >= wordsPerBitmap) {
+                    bitmapSlots.push_back(s);
+                }
+            }
+            bitmapWords.assign(bitmapSlots.size() * wordsPerBitmap, 0);
+            for (unsigned int b = 0; b < bitmapSlots.size(); b++) {
+                unsigned int *bitmap = &bitmapWords[b * wordsPerBitmap];
+                const unsigned int *trackIter;
+                for (trackIter = begin(bitmapSlots[b]); 
+                     trackIter != end(bitmapSlots[b]); 
+                     trackIter++) {
+                    bitmap[*trackIter / 32] |= 1u << (*trackIter % 32);
+                }
+            }
+        }
+
+        const unsigned int *bitmapOf(unsigned int slot) const {
+            std::vector<unsigned int>::const_iterator it = 
+                std::lower_bound(bitmapSlots.begin(), bitmapSlots.end(), slot);
+            if ((it == bitmapSlots.end()) || (*it != slot)) {
+                return NULL;
+            }
+            unsigned int wordsPerBitmap = bitmapWords.size() / bitmapSlots.size();
+            return &bitmapWords[(it - bitmapSlots.begin()) * wordsPerBitmap];
+        }
+
+        const unsigned int *trackIndicesStart() const {
+            return trackIndices.empty() ? NULL : &trackIndices[0];
+        }
+
+        bool isDense;
+        // only used if !isDense: the detection held in each slot.
+        std::vector<unsigned int> slotDets;
+        // slot s holds trackIndices[offsets[s]] .. trackIndices[offsets[s+1] - 1]
+        std::vector<unsigned int> offsets;
+        std::vector<unsigned int> trackIndices;
+        // the slots with bitmaps, in order, and their bitmaps, end to
+        // end: bit t of a slot's bitmap is set iff track t uses it.
+        std::vector<unsigned int> bitmapSlots;
+        std::vector<unsigned int> bitmapWords;
+    };
+
+
+
+}} // close namespace lsst::mops
+
+#endif
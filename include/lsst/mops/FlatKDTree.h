@@ -0,0 +1,644 @@
+// -*- LSST-C++ -*-
+
+/*
+ * FlatKDTree: a read-only, relocatable snapshot of a built KDTree.  A
+ * tree is written to disk once (writeSnapshot) and can then be mapped
+ * read-only by any number of later runs, or by several processes on
+ * the same machine at once, which all share one copy of it in the
+ * page cache.  Searches run directly against the mapped file; nothing
+ * is rebuilt or copied when it's opened.
+ *
+ * The tree is stored as flat arrays, and all cross-references are
+ * indices into those arrays rather than pointers, so the file can be
+ * mapped at any address.  Nodes are laid out depth-first (so a node's
+ * left child usually follows it directly) and each leaf's points are
+ * one contiguous run of the point arrays.
+ *
+ * File layout (host byte order, each section 8-byte aligned):
+ *
+ *   FlatKDTreeHeader
+ *   FlatKDTreeNode   nodes[nNodes]
+ *   double           bounds[nNodes][2][k]   (lower bounds, then upper)
+ *   double           points[nPoints][k]
+ *   T                values[nPoints]
+ *
+ * Values are copied byte-for-byte, so T must be a plain-old-data type
+ * holding no pointers (e.g. the usual unsigned int detection or
+ * tracklet ID).  Only the first k elements of each point are kept.
+ *
+ * The searches behave exactly like their KDTree counterparts, and
+ * return results in the same order.  A FlatKDTree can't be copied;
+ * pass it around by reference (or just map the file again, which is
+ * nearly free).
+ *
+ * TrackletTrees aren't supported: linkTracklets walks their nodes
+ * directly and keeps per-search visit counts on them, which doesn't
+ * fit a read-only shared mapping.
+ */
+
+#ifndef LSST_FLAT_KDTREE_H
+#define LSST_FLAT_KDTREE_H
+
+#include <string>
+#include <vector>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "KDTree.h"
+
+
+namespace lsst {
+namespace mops {
+
+
+#define FLAT_KDTREE_MAGIC "MOPSKDT"
+#define FLAT_KDTREE_VERSION 1
+#define FLAT_KDTREE_BYTE_ORDER 0x01020304
+
+
+    struct FlatKDTreeHeader {
+        char magic[8];
+        uint32_t byteOrder;
+        uint32_t version;
+        uint32_t k;
+        uint32_t valueSize;
+        uint64_t nNodes;
+        uint64_t nPoints;
+        uint64_t nodesOffset;
+        uint64_t boundsOffset;
+        uint64_t pointsOffset;
+        uint64_t valuesOffset;
+        uint64_t fileSize;
+    };
+
+    /* a leaf has no children; its points are [dataBegin, dataEnd). A
+     * non-leaf has exactly two children.  The root is node 0, which
+     * is never anyone's child, so 0 means "no child". */
+    struct FlatKDTreeNode {
+        uint32_t children[2];
+        uint32_t dataBegin;
+        uint32_t dataEnd;
+    };
+
+
+
+    template <class T>
+    class FlatKDTree {
+    public:
+
+        /* an empty tree; every search returns nothing. */
+        FlatKDTree();
+
+        /* map a snapshot written by writeSnapshot. Throws
+         * FileException if the file can't be read or isn't a snapshot
+         * of a tree of T on this architecture. */
+        FlatKDTree(const std::string &fileName);
+
+        ~FlatKDTree();
+
+        /* write a snapshot of tree to fileName.  The snapshot is
+         * written beside fileName and then renamed into place, so
+         * anyone mapping fileName never sees a partial file. */
+        static void writeSnapshot(const KDTree<T> &tree,
+                                  const std::string &fileName);
+
+        unsigned int getK() const { return myK; }
+
+        /* as for KDTree, the number of nodes in the tree */
+        unsigned int size() const { return myNumNodes; }
+
+        unsigned int numPoints() const { return myNumPoints; }
+
+        /* see the KDTree searches of the same names. */
+        std::vector<PointAndValue <T> >
+        hyperRectangleSearch(const std::vector<double> &queryPt,
+                             const std::vector<double> &tolerances,
+                             const std::vector<GeometryType>
+                                 &spaceTypesByDimension) const;
+
+        std::vector<PointAndValue <T> >
+        RADecRangeSearch(const std::vector<double> &RADecQueryPoint,
+                         double RADecQueryRange,
+                         const std::vector<double> &otherDimsPoint,
+                         const std::vector<double> &otherDimsTolerances,
+                         const std::vector<GeometryType>
+                             &spaceTypesByDimension) const;
+
+        std::vector<PointAndValue <T> >
+        nearestNeighbors(const std::vector<double> &queryPt,
+                         unsigned int k,
+                         double maxDistance=HUGE_VAL,
+                         std::vector<double> *distances=NULL) const;
+
+        std::vector<PointAndValue <T> >
+        RADecNearestNeighbors(const std::vector<double> &RADecQueryPt,
+                              unsigned int k,
+                              double maxDistance,
+                              const std::vector<double> &otherDimsPoint,
+                              const std::vector<double> &otherDimsTolerances,
+                              const std::vector<GeometryType>
+                                 &spaceTypesByDimension,
+                              std::vector<double> *distances=NULL) const;
+
+    private:
+        // not copyable; see above.
+        FlatKDTree(const FlatKDTree<T> &);
+        FlatKDTree<T> &operator=(const FlatKDTree<T> &);
+
+        void mapFile(const std::string &fileName);
+
+        static unsigned int flattenNode(const KDTreeNode<T> *node,
+                                        unsigned int k,
+                                        std::vector<FlatKDTreeNode> &nodes,
+                                        std::vector<double> &bounds,
+                                        std::vector<double> &points,
+                                        std::vector<T> &values);
+
+        const double *getLBounds(unsigned int node) const
+        {
+            return myBounds + 2 * myK * node;
+        }
+        const double *getUBounds(unsigned int node) const
+        {
+            return myBounds + 2 * myK * node + myK;
+        }
+        const double *getPoint(unsigned int i) const
+        {
+            return myPoints + myK * i;
+        }
+
+        template <bool MayWrap>
+        void hyperRectangleSearchKernel(unsigned int node,
+                                        const ResolvedRectangleQuery &query,
+                                        std::vector<unsigned int> &results) const;
+
+        /* check and resolve a hyperRectangle query, and search with it */
+        void searchRectangle(const std::vector<double> &queryPt,
+                             const std::vector<double> &tolerances,
+                             const std::vector<GeometryType> &spaceTypesByDimension,
+                             std::vector<unsigned int> &results) const;
+
+        template <class Metric>
+        void nearestNeighborSearch(unsigned int node, const Metric &metric,
+                                   NearestNeighborHeap<unsigned int> &heap) const;
+
+        PointAndValue<T> getPointAndValue(unsigned int i) const;
+
+        void *myMap;
+        size_t myMapSize;
+        unsigned int myK;
+        unsigned int myNumNodes;
+        unsigned int myNumPoints;
+        const FlatKDTreeNode *myNodes;
+        const double *myBounds;
+        const double *myPoints;
+        const T *myValues;
+    };
+
+
+
+
+    /* round offset up to the next multiple of 8 bytes */
+    inline uint64_t alignFlatKDTreeOffset(uint64_t offset)
+    {
+        return (offset + 7) & ~((uint64_t) 7);
+    }
+
+
+
+
+template <class T>
+FlatKDTree<T>::FlatKDTree()
+    : myMap(NULL), myMapSize(0), myK(0), myNumNodes(0), myNumPoints(0),
+      myNodes(NULL), myBounds(NULL), myPoints(NULL), myValues(NULL)
+{
+}
+
+
+
+
+template <class T>
+FlatKDTree<T>::FlatKDTree(const std::string &fileName)
+    : myMap(NULL), myMapSize(0), myK(0), myNumNodes(0), myNumPoints(0),
+      myNodes(NULL), myBounds(NULL), myPoints(NULL), myValues(NULL)
+{
+    mapFile(fileName);
+}
+
+
+
+
+template <class T>
+FlatKDTree<T>::~FlatKDTree()
+{
+    if (myMap != NULL) {
+        munmap(myMap, myMapSize);
+    }
+}
+
+
+
+
+template <class T>
+void FlatKDTree<T>::mapFile(const std::string &fileName)
+{
+    int fd = ::open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw LSST_EXCEPT(FileException,
+                          "FlatKDTree: could not open " + fileName);
+    }
+    struct stat fileStats;
+    if ((fstat(fd, &fileStats) != 0) ||
+        ((size_t) fileStats.st_size < sizeof(FlatKDTreeHeader))) {
+        ::close(fd);
+        throw LSST_EXCEPT(FileException,
+                          "FlatKDTree: " + fileName + " is not a KDTree snapshot");
+    }
+    myMapSize = fileStats.st_size;
+    void *map = mmap(NULL, myMapSize, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        throw LSST_EXCEPT(FileException,
+                          "FlatKDTree: could not mmap " + fileName);
+    }
+    myMap = map;
+
+    const char *base = (const char *) myMap;
+    const FlatKDTreeHeader *header = (const FlatKDTreeHeader *) base;
+    uint64_t k = header->k;
+    bool ok = ((strncmp(header->magic, FLAT_KDTREE_MAGIC, 8) == 0) &&
+               (header->byteOrder == FLAT_KDTREE_BYTE_ORDER) &&
+               (header->version == FLAT_KDTREE_VERSION) &&
+               (header->valueSize == sizeof(T)) &&
+               (header->fileSize == myMapSize) &&
+               (header->nodesOffset + header->nNodes * sizeof(FlatKDTreeNode)
+                <= header->boundsOffset) &&
+               (header->boundsOffset + header->nNodes * 2 * k * sizeof(double)
+                <= header->pointsOffset) &&
+               (header->pointsOffset + header->nPoints * k * sizeof(double)
+                <= header->valuesOffset) &&
+               (header->valuesOffset + header->nPoints * sizeof(T)
+                <= myMapSize));
+    if (!ok) {
+        munmap(myMap, myMapSize);
+        myMap = NULL;
+        throw LSST_EXCEPT(FileException,
+                          "FlatKDTree: " + fileName + " is not a (compatible) KDTree snapshot");
+    }
+    myK = header->k;
+    myNumNodes = header->nNodes;
+    myNumPoints = header->nPoints;
+    myNodes = (const FlatKDTreeNode *) (base + header->nodesOffset);
+    myBounds = (const double *) (base + header->boundsOffset);
+    myPoints = (const double *) (base + header->pointsOffset);
+    myValues = (const T *) (base + header->valuesOffset);
+}
+
+
+
+
+template <class T>
+unsigned int FlatKDTree<T>::flattenNode(const KDTreeNode<T> *node,
+                                        unsigned int k,
+                                        std::vector<FlatKDTreeNode> &nodes,
+                                        std::vector<double> &bounds,
+                                        std::vector<double> &points,
+                                        std::vector<T> &values)
+{
+    unsigned int index = nodes.size();
+    FlatKDTreeNode flatNode;
+    flatNode.children[0] = 0;
+    flatNode.children[1] = 0;
+    flatNode.dataBegin = values.size();
+    flatNode.dataEnd = values.size();
+    nodes.push_back(flatNode);
+
+    const std::vector<double> &LBounds = *(node->getLBounds());
+    const std::vector<double> &UBounds = *(node->getUBounds());
+    bounds.insert(bounds.end(), LBounds.begin(), LBounds.begin() + k);
+    bounds.insert(bounds.end(), UBounds.begin(), UBounds.begin() + k);
+
+    if (node->isLeaf()) {
+        const std::vector<PointAndValue <T> > &data = *(node->getMyData());
+        for (unsigned int i = 0; i < data.size(); i++) {
+            const std::vector<double> &point = data[i].getPoint();
+            points.insert(points.end(), point.begin(), point.begin() + k);
+            values.push_back(data[i].getValue());
+        }
+        nodes[index].dataEnd = values.size();
+    }
+    else {
+        // don't hold references into nodes across these; it grows.
+        unsigned int left = flattenNode(node->getLeftChild(), k,
+                                        nodes, bounds, points, values);
+        unsigned int right = flattenNode(node->getRightChild(), k,
+                                         nodes, bounds, points, values);
+        nodes[index].children[0] = left;
+        nodes[index].children[1] = right;
+    }
+    return index;
+}
+
+
+
+
+template <class T>
+void FlatKDTree<T>::writeSnapshot(const KDTree<T> &tree,
+                                  const std::string &fileName)
+{
+    std::vector<FlatKDTreeNode> nodes;
+    std::vector<double> bounds;
+    std::vector<double> points;
+    std::vector<T> values;
+    unsigned int k = 0;
+    if (tree.myRoot != NULL) {
+        k = tree.myRoot->getLBounds()->size();
+        nodes.reserve(tree.size());
+        bounds.reserve(2 * k * tree.size());
+        flattenNode(tree.myRoot, k, nodes, bounds, points, values);
+    }
+
+    FlatKDTreeHeader header;
+    memset(&header, 0, sizeof(header));
+    strncpy(header.magic, FLAT_KDTREE_MAGIC, 8);
+    header.byteOrder = FLAT_KDTREE_BYTE_ORDER;
+    header.version = FLAT_KDTREE_VERSION;
+    header.k = k;
+    header.valueSize = sizeof(T);
+    header.nNodes = nodes.size();
+    header.nPoints = values.size();
+    header.nodesOffset = alignFlatKDTreeOffset(sizeof(header));
+    header.boundsOffset = alignFlatKDTreeOffset(
+        header.nodesOffset + nodes.size() * sizeof(FlatKDTreeNode));
+    header.pointsOffset = alignFlatKDTreeOffset(
+        header.boundsOffset + bounds.size() * sizeof(double));
+    header.valuesOffset = alignFlatKDTreeOffset(
+        header.pointsOffset + points.size() * sizeof(double));
+    header.fileSize = header.valuesOffset + values.size() * sizeof(T);
+
+    std::string tmpFileName = fileName + ".tmp";
+    std::ofstream outFile(tmpFileName.c_str(),
+                          std::ios::out | std::ios::binary | std::ios::trunc);
+    const char padding[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
+    uint64_t written = 0;
+
+    outFile.write((const char *) &header, sizeof(header));
+    written += sizeof(header);
+    outFile.write(padding, header.nodesOffset - written);
+    if (nodes.size() > 0) {
+        outFile.write((const char *) &nodes[0],
+                      nodes.size() * sizeof(FlatKDTreeNode));
+    }
+    written = header.nodesOffset + nodes.size() * sizeof(FlatKDTreeNode);
+    outFile.write(padding, header.boundsOffset - written);
+    if (bounds.size() > 0) {
+        outFile.write((const char *) &bounds[0], bounds.size() * sizeof(double));
+    }
+    written = header.boundsOffset + bounds.size() * sizeof(double);
+    outFile.write(padding, header.pointsOffset - written);
+    if (points.size() > 0) {
+        outFile.write((const char *) &points[0], points.size() * sizeof(double));
+    }
+    written = header.pointsOffset + points.size() * sizeof(double);
+    outFile.write(padding, header.valuesOffset - written);
+    if (values.size() > 0) {
+        outFile.write((const char *) &values[0], values.size() * sizeof(T));
+    }
+    outFile.close();
+
+    if (outFile.fail() ||
+        (rename(tmpFileName.c_str(), fileName.c_str()) != 0)) {
+        throw LSST_EXCEPT(FileException,
+                          "FlatKDTree: could not write snapshot to " + fileName);
+    }
+}
+
+
+
+
+template <class T>
+PointAndValue<T> FlatKDTree<T>::getPointAndValue(unsigned int i) const
+{
+    PointAndValue<T> toRet;
+    toRet.setPoint(std::vector<double>(getPoint(i), getPoint(i) + myK));
+    toRet.setValue(myValues[i]);
+    return toRet;
+}
+
+
+
+
+template <class T>
+std::vector<PointAndValue <T> >
+FlatKDTree<T>::hyperRectangleSearch(const std::vector<double> &queryPt,
+                                    const std::vector<double> &tolerances,
+                                    const std::vector<GeometryType> &spaceTypesByDimension) const
+{
+    if ((queryPt.size() != myK) || (tolerances.size() != myK) ||
+        (spaceTypesByDimension.size() != myK)) {
+        throw LSST_EXCEPT(BadParameterException,
+ "EE: QueryPt must have dimensions at least equal to dimensions of tree.\n");
+    }
+    std::vector<unsigned int> found;
+    searchRectangle(queryPt, tolerances, spaceTypesByDimension, found);
+
+    std::vector<PointAndValue <T> > toRet;
+    toRet.reserve(found.size());
+    for (unsigned int i = 0; i < found.size(); i++) {
+        toRet.push_back(getPointAndValue(found[i]));
+    }
+    return toRet;
+}
+
+
+
+
+template <class T>
+std::vector<PointAndValue <T> >
+FlatKDTree<T>::RADecRangeSearch(const std::vector<double> &RADecQueryPoint,
+                                double RADecQueryRange,
+                                const std::vector<double> &otherDimsPoint,
+                                const std::vector<double> &otherDimsTolerances,
+                                const std::vector<GeometryType> &spaceTypesByDimension) const
+{
+    RADecRectangleQuery rectangle(RADecQueryPoint, RADecQueryRange,
+                                  otherDimsPoint, otherDimsTolerances,
+                                  spaceTypesByDimension, myK);
+    std::vector<unsigned int> found;
+    searchRectangle(rectangle.queryPt, rectangle.tolerances,
+                    rectangle.spaceTypes, found);
+
+    std::vector<PointAndValue <T> > toRet;
+    for (unsigned int i = 0; i < found.size(); i++) {
+        if (rectangle.accepts(getPoint(found[i]))) {
+            toRet.push_back(getPointAndValue(found[i]));
+        }
+    }
+    return toRet;
+}
+
+
+
+
+template <class T>
+void FlatKDTree<T>::searchRectangle(const std::vector<double> &queryPt,
+                                    const std::vector<double> &tolerances,
+                                    const std::vector<GeometryType> &spaceTypesByDimension,
+                                    std::vector<unsigned int> &results) const
+{
+    if (myNumNodes == 0) {
+        return;
+    }
+    checkRectangleQuery(queryPt, tolerances, spaceTypesByDimension,
+                        getLBounds(0), getUBounds(0));
+    ResolvedRectangleQuery query(queryPt, tolerances, spaceTypesByDimension);
+    if (query.mayWrap) {
+        hyperRectangleSearchKernel<true>(0, query, results);
+    }
+    else {
+        hyperRectangleSearchKernel<false>(0, query, results);
+    }
+}
+
+
+
+
+template <class T>
+template <bool MayWrap>
+void FlatKDTree<T>::hyperRectangleSearchKernel(unsigned int node,
+                                               const ResolvedRectangleQuery &query,
+                                               std::vector<unsigned int> &results) const
+{
+    /* just as KDTreeNode::hyperRectangleSearchKernel. */
+    const double *LBounds = getLBounds(node);
+    const double *UBounds = getUBounds(node);
+    for (unsigned int i = 0; i < myK; i++) {
+        if (!query.overlaps<MayWrap>(i, LBounds[i], UBounds[i])) {
+            return;
+        }
+    }
+
+    const FlatKDTreeNode &flatNode = myNodes[node];
+    if (flatNode.children[0] != 0) {
+        hyperRectangleSearchKernel<MayWrap>(flatNode.children[0], query, results);
+        hyperRectangleSearchKernel<MayWrap>(flatNode.children[1], query, results);
+    }
+    else {
+        for (unsigned int i = flatNode.dataBegin; i < flatNode.dataEnd; i++) {
+            const double *point = getPoint(i);
+            bool isInRange = true;
+            for (unsigned int j = 0; (j < myK) && isInRange; j++) {
+                isInRange = query.contains<MayWrap>(j, point[j]);
+            }
+            if (isInRange) {
+                results.push_back(i);
+            }
+        }
+    }
+}
+
+
+
+
+template <class T>
+std::vector<PointAndValue <T> >
+FlatKDTree<T>::nearestNeighbors(const std::vector<double> &queryPt,
+                                unsigned int k,
+                                double maxDistance,
+                                std::vector<double> *distances) const
+{
+    if (queryPt.size() != myK) {
+        throw LSST_EXCEPT(BadParameterException,
+                          "FlatKDTree::nearestNeighbors:  got myK != queryPoint size");
+    }
+    NearestNeighborHeap<unsigned int> heap(k, maxDistance);
+    if (myNumNodes > 0) {
+        EuclideanNNMetric metric(queryPt);
+        if (heap.canImprove(metric.lowerBound(getLBounds(0), getUBounds(0)))) {
+            nearestNeighborSearch(0, metric, heap);
+        }
+    }
+    std::vector<unsigned int> found;
+    heap.getResults(found, distances);
+    std::vector<PointAndValue <T> > toRet;
+    for (unsigned int i = 0; i < found.size(); i++) {
+        toRet.push_back(getPointAndValue(found[i]));
+    }
+    return toRet;
+}
+
+
+
+
+template <class T>
+std::vector<PointAndValue <T> >
+FlatKDTree<T>::RADecNearestNeighbors(const std::vector<double> &RADecQueryPt,
+                                     unsigned int k,
+                                     double maxDistance,
+                                     const std::vector<double> &otherDimsPoint,
+                                     const std::vector<double> &otherDimsTolerances,
+                                     const std::vector<GeometryType> &spaceTypesByDimension,
+                                     std::vector<double> *distances) const
+{
+    NearestNeighborHeap<unsigned int> heap(k, maxDistance);
+    if (myNumNodes > 0) {
+        GreatCircleNNMetric metric = makeRADecNNMetric(
+            RADecQueryPt, otherDimsPoint, otherDimsTolerances,
+            spaceTypesByDimension, myK, getLBounds(0), getUBounds(0));
+        if (heap.canImprove(metric.lowerBound(getLBounds(0), getUBounds(0)))) {
+            nearestNeighborSearch(0, metric, heap);
+        }
+    }
+    std::vector<unsigned int> found;
+    heap.getResults(found, distances);
+    std::vector<PointAndValue <T> > toRet;
+    for (unsigned int i = 0; i < found.size(); i++) {
+        toRet.push_back(getPointAndValue(found[i]));
+    }
+    return toRet;
+}
+
+
+
+
+template <class T>
+template <class Metric>
+void FlatKDTree<T>::nearestNeighborSearch(unsigned int node,
+                                          const Metric &metric,
+                                          NearestNeighborHeap<unsigned int> &heap) const
+{
+    /* just as KDTreeNode::nearestNeighborSearch. */
+    const FlatKDTreeNode &flatNode = myNodes[node];
+    if (flatNode.children[0] == 0) {
+        for (unsigned int i = flatNode.dataBegin; i < flatNode.dataEnd; i++) {
+            heap.offer(metric.distance(getPoint(i)), i);
+        }
+        return;
+    }
+
+    double bounds[2];
+    for (unsigned int i = 0; i < 2; i++) {
+        bounds[i] = metric.lowerBound(getLBounds(flatNode.children[i]),
+                                      getUBounds(flatNode.children[i]));
+    }
+    unsigned int first = (bounds[1] < bounds[0]) ? 1 : 0;
+    unsigned int order[2] = { first, 1 - first };
+    for (unsigned int i = 0; i < 2; i++) {
+        if (heap.canImprove(bounds[order[i]])) {
+            nearestNeighborSearch(flatNode.children[order[i]], metric, heap);
+        }
+    }
+}
+
+
+
+}} // close namespace lsst::mops
+
+#endif
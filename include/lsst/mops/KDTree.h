@@ -160,6 +160,31 @@ namespace mops {
                                 &spaceTypesByDimension) 
             const; 
     
+        /* RADecAnnulusSearch: as RADecRangeSearch, but only return
+         * points at least innerRadius from RADecQueryPoint, and at
+         * most outerRadius from it (both bounds are inclusive, as
+         * findTracklets' velocity limits always were; note that
+         * RADecRangeSearch's bound is not).  Parts of the tree
+         * which lie entirely inside innerRadius are skipped during
+         * the search, rather than searched and thrown away, so this
+         * is much cheaper than RADecRangeSearch and filtering when
+         * most nearby points are too close.
+         *
+         * 0 <= innerRadius < outerRadius is required.  If
+         * nodesVisited isn't NULL, the number of tree nodes looked at
+         * is added to it.
+         */
+        std::vector<PointAndValue <T> > 
+            RADecAnnulusSearch(const std::vector<double> &RADecQueryPoint, 
+                               double innerRadius,
+                               double outerRadius, 
+                               const std::vector<double> &otherDimsPoint,
+                               const std::vector<double> &otherDimsTolerances,
+                               const std::vector<GeometryType> 
+                                  &spaceTypesByDimension,
+                               unsigned long int *nodesVisited=NULL) 
+            const; 
+    
         /* execute a hyperRectangle-shaped range search around queryPt.  queryPt and tolerances
          * must have the same dimensions as the tree.
          *
@@ -198,6 +223,52 @@ namespace mops {
                                     &spaceTypesByDimension) 
             const;
 
+        /* nearestNeighbors: return (up to) the k points nearest to
+         * queryPt, nearest first, treating all k dimensions of the tree
+         * as a single Euclidean space (as rangeSearch does).  Only
+         * points within maxDistance (inclusive) are considered, so
+         * with k == 1 this is a "best match within threshold"
+         * search. If distances is non-NULL it gets the distance to
+         * each result.
+         *
+         * queryPt must have the same dimensions as the tree.
+         */
+        std::vector<PointAndValue <T> >
+        nearestNeighbors(const std::vector<double> &queryPt,
+                         unsigned int k,
+                         double maxDistance=HUGE_VAL,
+                         std::vector<double> *distances=NULL) const;
+
+        /* RADecNearestNeighbors: as nearestNeighbors, but distance is
+         * great-circle distance (in degrees) on the RA and Dec axes
+         * and, just like RADecRangeSearch, the other axes (if any)
+         * are treated as a hyperRectangle cut around otherDimsPoint
+         * with otherDimsTolerances; points outside the cut are never
+         * returned.
+         *
+         * e.g. to find the single detection nearest to (RA, Dec) =
+         * (180, -10) within .01 degrees, in a tree of [RA, Dec, MJD]
+         * data, at MJD 50000.1 +/- .0001:
+         *
+         * RADecQueryPt = [180, -10]
+         * k = 1
+         * maxDistance = .01
+         * otherDimsPoint = [50000.1]
+         * otherDimsTolerances = [.0001]
+         * spaceTypesByDimension = [RA_DEGREES, DEC_DEGREES, EUCLIDEAN]
+         *
+         * The RA and Dec data in the tree must lie along [0, 360).
+         */
+        std::vector<PointAndValue <T> >
+        RADecNearestNeighbors(const std::vector<double> &RADecQueryPt,
+                              unsigned int k,
+                              double maxDistance,
+                              const std::vector<double> &otherDimsPoint,
+                              const std::vector<double> &otherDimsTolerances,
+                              const std::vector<GeometryType> 
+                                 &spaceTypesByDimension,
+                              std::vector<double> *distances=NULL) const;
+
         /* turns out we don't automatically inherit BaseKDTree's
          * constructors/destructors because it's not a direct
          * ancestor, due to template issues.  We'll have to copy-pase
@@ -207,6 +278,25 @@ namespace mops {
         KDTree<T>() { this->setUpEmptyTree() ;}
         ~KDTree<T>() { this->clearPrivateData(); }
 
+    private:
+        /* check a hyperRectangle query (and the tree's data) against the
+         * geometry types requested, throwing BadParameterException on
+         * failure. This is done once per query so that the nodes don't
+         * have to. */
+        void validateRectangleQuery(const std::vector<double> &queryPt, 
+                                    const std::vector<double> &tolerances, 
+                                    const std::vector<GeometryType> 
+                                    &spaceTypesByDimension) const;
+
+        /* the k-NN search proper, and collecting its results. */
+        template <class Metric>
+        void searchNearestNeighbors(
+            const Metric &metric,
+            NearestNeighborHeap<const PointAndValue<T> *> &heap) const;
+
+        std::vector<PointAndValue <T> > getNearestNeighbors(
+            const NearestNeighborHeap<const PointAndValue<T> *> &heap,
+            std::vector<double> *distances) const;
 
     };
 
@@ -265,124 +355,29 @@ KDTree<T>::RADecRangeSearch(const std::vector<double> &RADecQueryPoint,
                             const std::vector<GeometryType> &spaceTypesByDimension)  const
 {
     /*
-     * this function is implemented by finding a series of rectangles which will
-     * enscribe the actual circle along the surface of the sphere. These
-     * rectangles are searched with hyperRectangleSearch (along with the
+     * this function is implemented by finding a rectangle which will
+     * enscribe the actual circle along the surface of the sphere. This
+     * rectangle is searched with hyperRectangleSearch (along with the
      * additional parameters) and results are pruned.
      */
-
-    // step 1: check input data.
-    if ((RADecQueryPoint.size() != 2) || 
-        (otherDimsPoint.size() != this->myK - 2) || 
-        (otherDimsTolerances.size() != this->myK - 2) || 
-        (spaceTypesByDimension.size() != this->myK) ||
-        (RADecQueryRange <= 0.0))
-    {
-        throw LSST_EXCEPT(BadParameterException, 
-    "KDTree::RADecRangeSearch called with illegal parameters.");
-    }
-    int RADimIndex = -1;
-    int DecDimIndex = -1;
-    for (unsigned int i = 0; i < spaceTypesByDimension.size(); i++) {
-        if (spaceTypesByDimension.at(i) == RA_DEGREES) {
-            RADimIndex = i;
-        }
-        else if (spaceTypesByDimension.at(i) == DEC_DEGREES) {
-            DecDimIndex = i;
-        }
-    }
-    if ((RADimIndex == -1) || (DecDimIndex == -1)) {
-        LSST_EXCEPT(BadParameterException,
-                    "KDTree::RADecRangeSearch called with spaceTypesByDimension missing either RA, Dec, or both - this is illegal");        
-    }
-    double RACenter =  convertToStandardDegrees(RADecQueryPoint.at(0));
-    double DecCenter = convertToStandardDegrees(RADecQueryPoint.at(1));
-
-    /* now, find a set of rectangles which enscribe the RA Dec range.
-     * there will be at most 2.
-
-     * simple case: the range does not pass over the north or south pole. You
-     * get one rectangle, which enscribes the circle.
-     * 
-     * complicated case 1: the range passes over either the north or south pole.
-     * you get one rectangle, which has RA width 360 (recall that at the pole,
-     * 360 degrees in RA is basically an infinitely small area).
-     *
-     * Complicated case 2: The dec range passes over BOTH poles, meaning you
-     * actually now have to do a brute force search over all the RA, Dec data! 
-     */
-
-    std::vector<double> realQueryPoint;
-    std::vector<double> realQueryTolerances;
-    std::vector<GeometryType> realQueryTypes;
-    //Constants
-    const double northPole_Dec = 90;
-    const double southPole_Dec = 270;
-
-    double RAHalfWidth = 0;
-    double DecHalfWidth = 0;
-
-    if ((circularShortestPathLen_Deg(DecCenter, northPole_Dec) < RADecQueryRange) ||
-        (circularShortestPathLen_Deg(DecCenter, southPole_Dec) < RADecQueryRange))
-    {
-        // this query range crosses a pole, ergo a complicated case
-        RAHalfWidth = 180; 
-        /* at a pole, we need to search all 360 degrees around
-         * the pole.
-         */
-        if ((circularShortestPathLen_Deg(DecCenter, northPole_Dec) < RADecQueryRange)  && 
-            (circularShortestPathLen_Deg(DecCenter, southPole_Dec) < RADecQueryRange))
-        {
-            /* the query range crosses both poles - so we really search the whole sphere! */
-            DecHalfWidth = 180;            
-        }
-        else {
-            DecHalfWidth = RADecQueryRange;
-        }
-    }
-    else { 
-        // case 1: just one query 
-        RAHalfWidth = maxOfTwo(
-            arcToRA(DecCenter + RADecQueryRange, RADecQueryRange),
-            arcToRA(DecCenter - RADecQueryRange, RADecQueryRange)
-            );        
-        DecHalfWidth = RADecQueryRange;
-    }
-    //build the real search params, pass them off to hyperRectangleSearch.
-    unsigned int otherParamsIndexCounter = 0;
-    for (unsigned int i = 0; i < this->myK; i++) {
-        if (spaceTypesByDimension.at(i) == RA_DEGREES) {
-            realQueryPoint.push_back(RACenter);
-            realQueryTolerances.push_back(RAHalfWidth);            
-            realQueryTypes.push_back(CIRCULAR_DEGREES);
-        }
-        else if (spaceTypesByDimension.at(i) == DEC_DEGREES) {
-            realQueryPoint.push_back(DecCenter);
-            realQueryTolerances.push_back(DecHalfWidth);
-            realQueryTypes.push_back(CIRCULAR_DEGREES);
-        }
-        else {
-            realQueryPoint.push_back(otherDimsPoint.at(otherParamsIndexCounter));
-            realQueryTolerances.push_back(otherDimsTolerances.at(otherParamsIndexCounter));
-            realQueryTypes.push_back(spaceTypesByDimension.at(i));
-            otherParamsIndexCounter++;
-        }
-    }
+    RADecRectangleQuery rectangle(RADecQueryPoint, RADecQueryRange,
+                                  otherDimsPoint, otherDimsTolerances,
+                                  spaceTypesByDimension, this->myK);
              
     // now do a hyperRectangleSearch with this data. 
     std::vector<PointAndValue <T> > searchResults;
-    searchResults = this->myRoot->hyperRectangleSearch(
-        realQueryPoint, realQueryTolerances, realQueryTypes);    
+    if (this->hasData) {
+        validateRectangleQuery(rectangle.queryPt, rectangle.tolerances, 
+                               rectangle.spaceTypes);
+        ResolvedRectangleQuery query(rectangle.queryPt, rectangle.tolerances, 
+                                     rectangle.spaceTypes);
+        this->myRoot->hyperRectangleSearch(query, searchResults);
+    }
 
     //prune results on angular distance around the center of the RA, Dec query.
     std::vector<PointAndValue <T> > prunedResults;
     for (unsigned int i = 0; i < searchResults.size(); i++) {
-        std::vector<double> point = searchResults.at(i).getPoint(); 
-        double resultRA = point.at(RADimIndex);
-        double resultDec = point.at(DecDimIndex);
-
-        if (angularDistanceRADec_deg(resultRA, resultDec, RACenter, DecCenter) 
-            < RADecQueryRange) {
+        if (rectangle.accepts(&(searchResults[i].getPoint()[0]))) {
             prunedResults.push_back(searchResults.at(i));
         }
     }
@@ -393,6 +388,38 @@ KDTree<T>::RADecRangeSearch(const std::vector<double> &RADecQueryPoint,
 
 
 
+template <class T>
+std::vector<PointAndValue <T> > 
+KDTree<T>::RADecAnnulusSearch(const std::vector<double> &RADecQueryPoint, 
+                              double innerRadius,
+                              double outerRadius, 
+                              const std::vector<double> &otherDimsPoint,
+                              const std::vector<double> &otherDimsTolerances,
+                              const std::vector<GeometryType> &spaceTypesByDimension,
+                              unsigned long int *nodesVisited)  const
+{
+    RADecAnnulusQuery annulus(RADecQueryPoint, innerRadius, outerRadius,
+                              otherDimsPoint, otherDimsTolerances,
+                              spaceTypesByDimension, this->myK);
+
+    std::vector<PointAndValue <T> > results;
+    if (this->hasData) {
+        validateRectangleQuery(annulus.outer.queryPt, annulus.outer.tolerances, 
+                               annulus.outer.spaceTypes);
+        ResolvedRectangleQuery rectangle(annulus.outer.queryPt, 
+                                         annulus.outer.tolerances, 
+                                         annulus.outer.spaceTypes);
+        this->myRoot->annulusSearch(rectangle, annulus, results);
+    }
+    if (nodesVisited != NULL) {
+        *nodesVisited += annulus.nodesVisited;
+    }
+    return results;
+}
+
+
+
+
 template <class T>
 std::vector<PointAndValue <T> > 
 KDTree<T>::hyperRectangleSearch(const std::vector<double> &queryPt,
@@ -406,29 +433,113 @@ KDTree<T>::hyperRectangleSearch(const std::vector<double> &queryPt,
       throw LSST_EXCEPT(BadParameterException, 
  "EE: QueryPt must have dimensions at least equal to dimensions of tree.\n");
   }
+  std::vector<PointAndValue <T> > toRet;
   if (this->hasData != true) {
       // if we are queried, but do not have any data, return nothing.
-      std::vector<PointAndValue <T> > toRet;
-      toRet.clear();
       return toRet;
-    }
-  else {
-      for (unsigned int i = 0; i < this->myK; i++) {
-          
-          if (((spaceTypesByDimensions[i] == CIRCULAR_DEGREES) 
-               && (tolerances[i] > 180.)) ||
-              (((spaceTypesByDimensions[i] == CIRCULAR_RADIANS) 
-                && (tolerances[i] > M_PI)))) {
-              throw LSST_EXCEPT(BadParameterException,
-                                "EE: KDTree.hyperRectangleSearch: searching a radius greater than 180 degrees (pi radians) is meaningless.\n");
-          }
-      }
-      
-      /* just punt to the KDTreeNode. */
-      
-      return this->myRoot->hyperRectangleSearch(
-          queryPt, tolerances, spaceTypesByDimensions);
   }
+  validateRectangleQuery(queryPt, tolerances, spaceTypesByDimensions);
+  ResolvedRectangleQuery query(queryPt, tolerances, spaceTypesByDimensions);
+
+  /* just punt to the KDTreeNode. */
+  this->myRoot->hyperRectangleSearch(query, toRet);
+  return toRet;
+}
+
+
+
+
+template <class T>
+std::vector<PointAndValue <T> > 
+KDTree<T>::nearestNeighbors(const std::vector<double> &queryPt,
+                            unsigned int k,
+                            double maxDistance,
+                            std::vector<double> *distances) const
+{
+    if (queryPt.size() != this->myK) {
+        throw LSST_EXCEPT(BadParameterException, 
+                          "KDTree::nearestNeighbors:  got myK != queryPoint size");
+    }
+    NearestNeighborHeap<const PointAndValue<T> *> heap(k, maxDistance);
+    if (this->hasData) {
+        EuclideanNNMetric metric(queryPt);
+        searchNearestNeighbors(metric, heap);
+    }
+    return getNearestNeighbors(heap, distances);
+}
+
+
+
+
+template <class T>
+std::vector<PointAndValue <T> > 
+KDTree<T>::RADecNearestNeighbors(const std::vector<double> &RADecQueryPt,
+                                 unsigned int k,
+                                 double maxDistance,
+                                 const std::vector<double> &otherDimsPoint,
+                                 const std::vector<double> &otherDimsTolerances,
+                                 const std::vector<GeometryType> &spaceTypesByDimension,
+                                 std::vector<double> *distances) const
+{
+    NearestNeighborHeap<const PointAndValue<T> *> heap(k, maxDistance);
+    if (this->hasData) {
+        GreatCircleNNMetric metric = makeRADecNNMetric(
+            RADecQueryPt, otherDimsPoint, otherDimsTolerances, 
+            spaceTypesByDimension, this->myK,
+            &((*(this->myRoot->getLBounds()))[0]),
+            &((*(this->myRoot->getUBounds()))[0]));
+        searchNearestNeighbors(metric, heap);
+    }
+    return getNearestNeighbors(heap, distances);
+}
+
+
+
+
+template <class T>
+template <class Metric>
+void KDTree<T>::searchNearestNeighbors(
+    const Metric &metric,
+    NearestNeighborHeap<const PointAndValue<T> *> &heap) const
+{
+    if (heap.canImprove(metric.lowerBound(&((*(this->myRoot->getLBounds()))[0]),
+                                          &((*(this->myRoot->getUBounds()))[0])))) {
+        this->myRoot->nearestNeighborSearch(metric, heap);
+    }
+}
+
+
+
+
+template <class T>
+std::vector<PointAndValue <T> >
+KDTree<T>::getNearestNeighbors(
+    const NearestNeighborHeap<const PointAndValue<T> *> &heap,
+    std::vector<double> *distances) const
+{
+    std::vector<const PointAndValue<T> *> found;
+    heap.getResults(found, distances);
+    std::vector<PointAndValue <T> > toRet;
+    toRet.reserve(found.size());
+    for (unsigned int i = 0; i < found.size(); i++) {
+        toRet.push_back(*(found[i]));
+    }
+    return toRet;
+}
+
+
+
+
+template <class T>
+void KDTree<T>::validateRectangleQuery(const std::vector<double> &queryPt,
+                                       const std::vector<double> &tolerances,
+                                       const std::vector<GeometryType> &spaceTypesByDimensions) const
+{
+    /* the root's bounds cover all the data in the tree, so checking
+     * them is enough to know every node's bounds are sane too. */
+    checkRectangleQuery(queryPt, tolerances, spaceTypesByDimensions,
+                        &((*(this->myRoot->getLBounds()))[0]),
+                        &((*(this->myRoot->getUBounds()))[0]));
 }
 
 
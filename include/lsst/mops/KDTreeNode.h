@@ -5,10 +5,14 @@
 #define LSST_KDTREE_NODE_H
 
 #include <iostream>
+#include <cmath>
+#include <algorithm>
+#include <utility>
 
 #include "lsst/mops/PointAndValue.h"
 #include "lsst/mops/BaseKDTreeNode.h"
 #include "lsst/mops/Exceptions.h"
+#include "lsst/mops/common.h"
 
 /*
  * the actual implementation of nodes in the KDTree.
@@ -36,6 +40,687 @@ namespace lsst {
 namespace mops {
 
 
+    /*
+     * a hyperRectangleSearch query after validation, with the
+     * geometry of each axis resolved.  Along each axis, the values
+     * which match the query are described by at most two closed,
+     * plain (non-circular) intervals: a circular range which crosses
+     * 0 becomes [0, hi] and [lo, 360] (or 2*pi), while everything
+     * else gets a single interval and an empty second one.
+     *
+     * This is built once per query by KDTree, so the per-node work is
+     * just comparisons; there's no per-node geometry switch and no
+     * re-normalizing of angles.
+     */
+    class ResolvedRectangleQuery {
+    public:
+        ResolvedRectangleQuery(const std::vector<double> &queryPt, 
+                               const std::vector<double> &tolerances, 
+                               const std::vector<GeometryType> &spaceTypesByDimension)
+        {
+            mayWrap = false;
+            unsigned int k = queryPt.size();
+            lo.resize(2 * k, HUGE_VAL);
+            hi.resize(2 * k, -HUGE_VAL);
+            for (unsigned int i = 0; i < k; i++) {
+                double period;
+                if (spaceTypesByDimension[i] == EUCLIDEAN) {
+                    lo[2*i] = queryPt[i] - tolerances[i];
+                    hi[2*i] = queryPt[i] + tolerances[i];
+                    continue;
+                }
+                else if (spaceTypesByDimension[i] == CIRCULAR_DEGREES) {
+                    period = 360.;
+                }
+                else if (spaceTypesByDimension[i] == CIRCULAR_RADIANS) {
+                    period = 2. * M_PI;
+                }
+                else {
+                    throw LSST_EXCEPT(BadParameterException, 
+                                      "EE: hyperRectangleSearch: got unexpected geometry type, must be one of EUCLIDEAN, CIRCULAR_DEGREES or CIRCULAR_RADIANS\n");
+                }
+                double q = fmod(queryPt[i], period);
+                if (q < 0) {
+                    q += period;
+                }
+                double l = q - tolerances[i];
+                double h = q + tolerances[i];
+                if (l < 0) {
+                    lo[2*i] = 0.;
+                    hi[2*i] = h;
+                    lo[2*i + 1] = l + period;
+                    hi[2*i + 1] = period;
+                    mayWrap = true;
+                }
+                else if (h >= period) {
+                    lo[2*i] = l;
+                    hi[2*i] = period;
+                    lo[2*i + 1] = 0.;
+                    hi[2*i + 1] = h - period;
+                    mayWrap = true;
+                }
+                else {
+                    lo[2*i] = l;
+                    hi[2*i] = h;
+                }
+            }
+        }
+
+        /* does [L, U] intersect the query along this axis? */
+        template <bool MayWrap>
+        bool overlaps(unsigned int axis, double L, double U) const 
+        {
+            if ((L <= hi[2*axis]) && (U >= lo[2*axis])) {
+                return true;
+            }
+            return MayWrap && (L <= hi[2*axis + 1]) && (U >= lo[2*axis + 1]);
+        }
+
+        template <bool MayWrap>
+        bool contains(unsigned int axis, double x) const
+        {
+            return overlaps<MayWrap>(axis, x, x);
+        }
+
+        unsigned int getK() const { return lo.size() / 2; }
+
+        bool mayWrap;
+
+    private:
+        // interval j of axis i is [lo[2i + j], hi[2i + j]]
+        std::vector<double> lo;
+        std::vector<double> hi;
+    };
+
+
+
+    /*
+     * helpers for k-nearest-neighbor searches.
+     *
+     * A metric supplies the distance from the query to a point, and a
+     * lower bound on the distance from the query to anything inside
+     * a node's bounding box (both given as plain arrays of at least k
+     * doubles, so they work on any tree layout).  Either may return HUGE_VAL to say "never
+     * a match" (e.g. for points which fail some additional cut).
+     */
+
+    /* plain Euclidean distance over the first k axes. */
+    class EuclideanNNMetric {
+    public:
+        EuclideanNNMetric(const std::vector<double> &queryPt) 
+            : myQuery(queryPt) {}
+
+        double distance(const double *point) const 
+        {
+            double sum = 0.;
+            for (unsigned int i = 0; i < myQuery.size(); i++) {
+                double d = point[i] - myQuery[i];
+                sum += d * d;
+            }
+            return sqrt(sum);
+        }
+
+        double lowerBound(const double *LBounds, const double *UBounds) const
+        {
+            double sum = 0.;
+            for (unsigned int i = 0; i < myQuery.size(); i++) {
+                double d = 0.;
+                if (myQuery[i] < LBounds[i]) {
+                    d = LBounds[i] - myQuery[i];
+                }
+                else if (myQuery[i] > UBounds[i]) {
+                    d = myQuery[i] - UBounds[i];
+                }
+                sum += d * d;
+            }
+            return sqrt(sum);
+        }
+
+    private:
+        std::vector<double> myQuery;
+    };
+
+
+
+    /* great-circle distance (degrees) on an RA, Dec pair of axes,
+     * with an optional rectangle cut on the other axes.  RA and Dec
+     * data must lie along [0,360) as for RADecRangeSearch. 
+     *
+     * The bound uses the haversine formula:
+     *
+     *  hav(r) = hav(dDec) + cos(Dec0) cos(Dec1) hav(dRA)
+     *
+     * where each term is bounded below separately over the box: the
+     * smallest dDec and dRA to the box, and the smallest cos(Dec) of
+     * any (legal) declination inside it. */
+    class GreatCircleNNMetric {
+    public:
+        GreatCircleNNMetric(double RA, double Dec,
+                            unsigned int RADimIndex, unsigned int DecDimIndex,
+                            const ResolvedRectangleQuery &otherDims)
+            : myRA(RA), myDec(Dec), myRAIndex(RADimIndex),
+              myDecIndex(DecDimIndex), myOtherDims(otherDims)
+        {
+            Constants c;
+            myCosDec = cos(c.deg_to_rad() * Dec);
+        }
+
+        double distance(const double *point) const 
+        {
+            for (unsigned int i = 0; i < myOtherDims.getK(); i++) {
+                if (!myOtherDims.contains<true>(i, point[i])) {
+                    return HUGE_VAL;
+                }
+            }
+            return angularDistanceRADec_deg(point[myRAIndex], point[myDecIndex],
+                                            myRA, myDec);
+        }
+
+        double lowerBound(const double *LBounds, const double *UBounds) const
+        {
+            for (unsigned int i = 0; i < myOtherDims.getK(); i++) {
+                if (!myOtherDims.overlaps<true>(i, LBounds[i], UBounds[i])) {
+                    return HUGE_VAL;
+                }
+            }
+            Constants c;
+            double LDec = LBounds[myDecIndex];
+            double UDec = UBounds[myDecIndex];
+            double dDec = c.deg_to_rad() * distanceToInterval(myDec, LDec, UDec);
+            double dRA = c.deg_to_rad() * 
+                distanceToInterval(myRA, LBounds[myRAIndex], UBounds[myRAIndex]);
+
+            /* Dec is stored along [0,360), so the poles are at 90 and
+             * 270; cos(Dec) is smallest at whichever is inside the
+             * box, or else at one of its ends. */
+            double minCos = 0.;
+            if (!((LDec <= 90.) && (UDec >= 90.)) && 
+                !((LDec <= 270.) && (UDec >= 270.))) {
+                minCos = minOfTwo(cos(c.deg_to_rad() * LDec), 
+                                  cos(c.deg_to_rad() * UDec));
+                minCos = maxOfTwo(minCos, 0.);
+            }
+            double sDec = sin(dDec / 2.);
+            double sRA = sin(dRA / 2.);
+            double hav = sDec * sDec + myCosDec * minCos * sRA * sRA;
+            // shave off a little so rounding can't prune an exact tie.
+            hav *= (1. - 1e-12);
+            if (hav >= 1.) {
+                return 180.;
+            }
+            return c.rad_to_deg() * 2. * asin(sqrt(hav));
+        }
+
+    private:
+        /* circular distance (degrees) from x to the closed interval
+         * [L, U], where 0 <= L <= U < 360. */
+        static double distanceToInterval(double x, double L, double U) 
+        {
+            if ((x >= L) && (x <= U)) {
+                return 0.;
+            }
+            return minOfTwo(circularShortestPathLen_Deg(x, L),
+                            circularShortestPathLen_Deg(x, U));
+        }
+
+        double myRA;
+        double myDec;
+        double myCosDec;
+        unsigned int myRAIndex;
+        unsigned int myDecIndex;
+        ResolvedRectangleQuery myOtherDims;
+    };
+
+
+
+    /* check a hyperRectangle query against the geometry types
+     * requested and the bounds (LBounds, UBounds, k entries each) of
+     * the data being searched, throwing BadParameterException on
+     * failure.  This is done once per query so that the nodes don't
+     * have to. */
+    inline void checkRectangleQuery(const std::vector<double> &queryPt,
+                                    const std::vector<double> &tolerances,
+                                    const std::vector<GeometryType> &spaceTypesByDimensions,
+                                    const double *LBounds, 
+                                    const double *UBounds)
+    {
+        for (unsigned int i = 0; i < queryPt.size(); i++) {
+        
+            if (((spaceTypesByDimensions[i] == CIRCULAR_DEGREES) 
+                 && (tolerances[i] > 180.)) ||
+                (((spaceTypesByDimensions[i] == CIRCULAR_RADIANS) 
+                  && (tolerances[i] > M_PI)))) {
+                throw LSST_EXCEPT(BadParameterException,
+                                  "EE: KDTree.hyperRectangleSearch: searching a radius greater than 180 degrees (pi radians) is meaningless.\n");
+            }
+
+            if (spaceTypesByDimensions[i] == CIRCULAR_DEGREES) {
+                if ((UBounds[i] != convertToStandardDegrees(UBounds[i]))
+                    ||
+                    (LBounds[i] != convertToStandardDegrees(LBounds[i]))
+                    ||
+                    (queryPt[i] != convertToStandardDegrees(queryPt[i]))) {
+                    std::cerr << "Requested values: " << UBounds[i] << ", " 
+                              << LBounds[i] << " " << queryPt[i] 
+                              << " and i == " << i << std::endl;
+                    throw LSST_EXCEPT(BadParameterException,  
+                                      "KDTree: Data error: got that dimension is of type CIRCULAR_DEGREES but data and/or query do not lie along [0,360).");
+                }
+            }
+            else if (spaceTypesByDimensions[i] == CIRCULAR_RADIANS) {
+                if ((LBounds[i] < 0.) || (UBounds[i] > 2. * M_PI)) {
+                    throw LSST_EXCEPT(BadParameterException,  
+                                      "KDTree: Data error: got that dimension is of type CIRCULAR_RADIANS but data do not lie along [0,2pi].");
+                }
+            }
+            else if (spaceTypesByDimensions[i] != EUCLIDEAN) {
+                throw LSST_EXCEPT(BadParameterException, 
+                                  "EE: KDTree.hyperRectangleSearch: got unexpected geometry type, must be one of EUCLIDEAN, CIRCULAR_DEGREES or CIRCULAR_RADIANS\n");
+            }
+        }
+    }
+
+
+
+
+    /* find the RA_DEGREES and DEC_DEGREES axes, throwing
+     * BadParameterException if either is missing. */
+    inline void findRADecAxes(const std::vector<GeometryType> &spaceTypesByDimension,
+                              unsigned int &RADimIndex, 
+                              unsigned int &DecDimIndex)
+    {
+        int RAIndex = -1;
+        int DecIndex = -1;
+        for (unsigned int i = 0; i < spaceTypesByDimension.size(); i++) {
+            if (spaceTypesByDimension.at(i) == RA_DEGREES) {
+                RAIndex = i;
+            }
+            else if (spaceTypesByDimension.at(i) == DEC_DEGREES) {
+                DecIndex = i;
+            }
+        }
+        if ((RAIndex == -1) || (DecIndex == -1)) {
+            throw LSST_EXCEPT(BadParameterException,
+                              "KDTree: RA, Dec search called with spaceTypesByDimension missing either RA, Dec, or both - this is illegal");
+        }
+        RADimIndex = RAIndex;
+        DecDimIndex = DecIndex;
+    }
+
+
+
+
+    /*
+     * the hyperRectangle which encloses an RADecRangeSearch
+     * query (see KDTree::RADecRangeSearch for the parameters), and the
+     * great-circle test used to prune the hyperRectangleSearch results
+     * down to the actual query.
+     */
+    class RADecRectangleQuery {
+    public:
+        RADecRectangleQuery(const std::vector<double> &RADecQueryPoint, 
+                            double RADecQueryRange, 
+                            const std::vector<double> &otherDimsPoint,
+                            const std::vector<double> &otherDimsTolerances,
+                            const std::vector<GeometryType> &spaceTypesByDimension,
+                            unsigned int k)
+        {
+            if ((RADecQueryPoint.size() != 2) || 
+                (otherDimsPoint.size() != k - 2) || 
+                (otherDimsTolerances.size() != k - 2) || 
+                (spaceTypesByDimension.size() != k) ||
+                (RADecQueryRange <= 0.0)) {
+                throw LSST_EXCEPT(BadParameterException, 
+                                  "KDTree::RADecRangeSearch called with illegal parameters.");
+            }
+            findRADecAxes(spaceTypesByDimension, RADimIndex, DecDimIndex);
+            RACenter =  convertToStandardDegrees(RADecQueryPoint.at(0));
+            DecCenter = convertToStandardDegrees(RADecQueryPoint.at(1));
+            range = RADecQueryRange;
+
+            /* now, find a rectangle which enscribes the RA Dec range.
+             * 
+             * simple case: the range does not pass over the north or
+             * south pole. You get one rectangle, which enscribes the
+             * circle.
+             * 
+             * complicated case 1: the range passes over either the north
+             * or south pole.  you get one rectangle, which has RA width
+             * 360 (recall that at the pole, 360 degrees in RA is
+             * basically an infinitely small area).
+             *
+             * Complicated case 2: The dec range passes over BOTH poles,
+             * meaning you actually now have to do a brute force search
+             * over all the RA, Dec data!
+             */
+            const double northPole_Dec = 90;
+            const double southPole_Dec = 270;
+
+            double RAHalfWidth = 0;
+            double DecHalfWidth = 0;
+
+            if ((circularShortestPathLen_Deg(DecCenter, northPole_Dec) < range) ||
+                (circularShortestPathLen_Deg(DecCenter, southPole_Dec) < range)) {
+                // this query range crosses a pole, ergo a complicated case
+                RAHalfWidth = 180; 
+                if ((circularShortestPathLen_Deg(DecCenter, northPole_Dec) < range) && 
+                    (circularShortestPathLen_Deg(DecCenter, southPole_Dec) < range)) {
+                    /* the query range crosses both poles - so we
+                     * really search the whole sphere! */
+                    DecHalfWidth = 180;            
+                }
+                else {
+                    DecHalfWidth = range;
+                }
+            }
+            else { 
+                // case 1: just one query 
+                RAHalfWidth = maxOfTwo(arcToRA(DecCenter + range, range),
+                                       arcToRA(DecCenter - range, range));
+                DecHalfWidth = range;
+            }
+
+            unsigned int otherParamsIndexCounter = 0;
+            for (unsigned int i = 0; i < k; i++) {
+                if (i == RADimIndex) {
+                    queryPt.push_back(RACenter);
+                    tolerances.push_back(RAHalfWidth);            
+                    spaceTypes.push_back(CIRCULAR_DEGREES);
+                }
+                else if (i == DecDimIndex) {
+                    queryPt.push_back(DecCenter);
+                    tolerances.push_back(DecHalfWidth);
+                    spaceTypes.push_back(CIRCULAR_DEGREES);
+                }
+                else {
+                    queryPt.push_back(otherDimsPoint.at(otherParamsIndexCounter));
+                    tolerances.push_back(otherDimsTolerances.at(otherParamsIndexCounter));
+                    spaceTypes.push_back(spaceTypesByDimension.at(i));
+                    otherParamsIndexCounter++;
+                }
+            }
+        }
+
+        /* is point (from inside the rectangle) actually within range? */
+        bool accepts(const double *point) const 
+        {
+            return angularDistanceRADec_deg(point[RADimIndex], point[DecDimIndex], 
+                                            RACenter, DecCenter) < range;
+        }
+
+        // the enclosing rectangle, to be handed to hyperRectangleSearch
+        std::vector<double> queryPt;
+        std::vector<double> tolerances;
+        std::vector<GeometryType> spaceTypes;
+
+    private:
+        unsigned int RADimIndex;
+        unsigned int DecDimIndex;
+        double RACenter;
+        double DecCenter;
+        double range;
+    };
+
+
+
+
+    /*
+     * an RADecAnnulusSearch query (see KDTree::RADecAnnulusSearch
+     * for the parameters): the rectangle enclosing the outer circle,
+     * plus an upper bound on the distance from the center to anything
+     * in a node, so that nodes lying entirely inside the inner circle
+     * can be skipped without looking at their points.
+     */
+    class RADecAnnulusQuery {
+    public:
+        RADecAnnulusQuery(const std::vector<double> &RADecQueryPoint, 
+                          double innerRadius,
+                          double outerRadius, 
+                          const std::vector<double> &otherDimsPoint,
+                          const std::vector<double> &otherDimsTolerances,
+                          const std::vector<GeometryType> &spaceTypesByDimension,
+                          unsigned int k)
+            : outer(RADecQueryPoint, outerRadius, otherDimsPoint, 
+                    otherDimsTolerances, spaceTypesByDimension, k)
+        {
+            if ((innerRadius < 0.0) || (innerRadius >= outerRadius)) {
+                throw LSST_EXCEPT(BadParameterException, 
+                                  "KDTree::RADecAnnulusSearch called with illegal radii.");
+            }
+            findRADecAxes(spaceTypesByDimension, RADimIndex, DecDimIndex);
+            RACenter =  convertToStandardDegrees(RADecQueryPoint.at(0));
+            DecCenter = convertToStandardDegrees(RADecQueryPoint.at(1));
+            inner = innerRadius;
+            outerRange = outerRadius;
+            Constants c;
+            // the center's declination along [-90, 90]
+            realDecCenter = (DecCenter > 180.) ? DecCenter - 360. : DecCenter;
+            cosDecCenter = cos(c.deg_to_rad() * realDecCenter);
+            nodesVisited = 0;
+        }
+
+        /* is point (from inside the outer rectangle) within the annulus? */
+        bool accepts(const double *point) const 
+        {
+            double d = angularDistanceRADec_deg(point[RADimIndex], 
+                                                point[DecDimIndex], 
+                                                RACenter, DecCenter);
+            return (d >= inner) && (d <= outerRange);
+        }
+
+        /* is everything in the box [LBounds, UBounds] certainly
+         * closer than the inner radius?
+         *
+         * As for GreatCircleNNMetric, this uses the haversine formula
+         *
+         *  hav(r) = hav(dDec) + cos(Dec0) cos(Dec1) hav(dRA)
+         *
+         * but bounds each term above: the largest dDec and dRA to
+         * anything in the box, and the largest cos(Dec) of any (legal)
+         * declination inside it. */
+        bool enclosedByInner(const double *LBounds, const double *UBounds) const
+        {
+            if (inner <= 0.) {
+                return false;
+            }
+            Constants c;
+            /* Dec is stored along [0,360): [0, 90] is the north and
+             * [270, 360) the south.  Find the span of real
+             * declinations the box covers, and cos(Dec) is largest at
+             * whichever end is nearest the equator. */
+            double LDec = LBounds[DecDimIndex];
+            double UDec = UBounds[DecDimIndex];
+            bool north = (LDec <= 90.);
+            bool south = (UDec >= 270.);
+            if (!(north || south)) {
+                return false;
+            }
+            double loDec = south ? maxOfTwo(LDec, 270.) - 360. : LDec;
+            double hiDec = north ? minOfTwo(UDec, 90.) : UDec - 360.;
+            double maxCos = 0.;
+            if (north) {
+                maxCos = maxOfTwo(maxCos, cos(c.deg_to_rad() * LDec));
+            }
+            if (south) {
+                maxCos = maxOfTwo(maxCos, cos(c.deg_to_rad() * UDec));
+            }
+            double dDec = c.deg_to_rad() * 
+                maxOfTwo(fabs(realDecCenter - loDec), fabs(realDecCenter - hiDec));
+
+            /* the farthest RA from the center is the opposite one, if
+             * it's in the box; otherwise it's one of the ends. */
+            double LRA = LBounds[RADimIndex];
+            double URA = UBounds[RADimIndex];
+            double opposite = convertToStandardDegrees(RACenter + 180.);
+            double dRA = 180.;
+            if ((opposite < LRA) || (opposite > URA)) {
+                dRA = maxOfTwo(circularShortestPathLen_Deg(RACenter, LRA),
+                               circularShortestPathLen_Deg(RACenter, URA));
+            }
+            dRA *= c.deg_to_rad();
+
+            double sDec = sin(dDec / 2.);
+            double sRA = sin(dRA / 2.);
+            double hav = sDec * sDec + cosDecCenter * maxCos * sRA * sRA;
+            // pad a little so rounding can't prune an exact tie.
+            hav *= (1. + 1e-12);
+            if (hav >= 1.) {
+                return false;
+            }
+            return c.rad_to_deg() * 2. * asin(sqrt(hav)) < inner;
+        }
+
+        // the rectangle enclosing the outer circle
+        RADecRectangleQuery outer;
+
+        // how many tree nodes the search has looked at so far
+        mutable unsigned long int nodesVisited;
+
+    private:
+        unsigned int RADimIndex;
+        unsigned int DecDimIndex;
+        double RACenter;
+        double DecCenter;
+        double realDecCenter;
+        double cosDecCenter;
+        double inner;
+        double outerRange;
+    };
+
+
+
+
+    /* set up the metric for an RADecNearestNeighbors query (see
+     * KDTree::RADecNearestNeighbors for the parameters) on data with
+     * the given bounds, checking the query as we go.  The other axes
+     * get the same rectangle cut (and checks) as RADecRangeSearch;
+     * the RA and Dec axes are left to the great-circle metric. */
+    inline GreatCircleNNMetric makeRADecNNMetric(
+        const std::vector<double> &RADecQueryPt,
+        const std::vector<double> &otherDimsPoint,
+        const std::vector<double> &otherDimsTolerances,
+        const std::vector<GeometryType> &spaceTypesByDimension,
+        unsigned int k,
+        const double *LBounds, 
+        const double *UBounds)
+    {
+        if ((RADecQueryPt.size() != 2) || 
+            (otherDimsPoint.size() != k - 2) || 
+            (otherDimsTolerances.size() != k - 2) || 
+            (spaceTypesByDimension.size() != k)) {
+            throw LSST_EXCEPT(BadParameterException, 
+                              "KDTree::RADecNearestNeighbors called with illegal parameters.");
+        }
+        unsigned int RADimIndex, DecDimIndex;
+        findRADecAxes(spaceTypesByDimension, RADimIndex, DecDimIndex);
+
+        std::vector<double> cutPoint;
+        std::vector<double> cutTolerances;
+        std::vector<GeometryType> cutTypes;
+        unsigned int otherParamsIndexCounter = 0;
+        for (unsigned int i = 0; i < k; i++) {
+            if ((i == RADimIndex) || (i == DecDimIndex)) {
+                cutPoint.push_back(180.);
+                cutTolerances.push_back(180.);
+                cutTypes.push_back(CIRCULAR_DEGREES);
+            }
+            else {
+                cutPoint.push_back(otherDimsPoint.at(otherParamsIndexCounter));
+                cutTolerances.push_back(otherDimsTolerances.at(otherParamsIndexCounter));
+                cutTypes.push_back(spaceTypesByDimension.at(i));
+                otherParamsIndexCounter++;
+            }
+        }
+        checkRectangleQuery(cutPoint, cutTolerances, cutTypes, LBounds, UBounds);
+        cutTypes[RADimIndex] = EUCLIDEAN;
+        cutTolerances[RADimIndex] = HUGE_VAL;
+        cutTypes[DecDimIndex] = EUCLIDEAN;
+        cutTolerances[DecDimIndex] = HUGE_VAL;
+        ResolvedRectangleQuery cut(cutPoint, cutTolerances, cutTypes);
+
+        return GreatCircleNNMetric(convertToStandardDegrees(RADecQueryPt.at(0)),
+                                   convertToStandardDegrees(RADecQueryPt.at(1)),
+                                   RADimIndex, DecDimIndex, cut);
+    }
+
+
+
+
+    /* the k best candidates seen so far, as a max-heap on distance,
+     * so the current k-th distance is always at the front.  Handle
+     * is however the tree refers to one of its points. */
+    template <class Handle>
+    class NearestNeighborHeap {
+    public:
+        NearestNeighborHeap(unsigned int k, double maxDistance) 
+            : myK(k), myMaxDistance(maxDistance) 
+        {
+            myCandidates.reserve(k);
+        }
+
+        /* could anything at this distance (or further) still get in? */
+        bool canImprove(double distance) const 
+        {
+            if (myK == 0) {
+                return false;
+            }
+            if (myCandidates.size() < myK) {
+                return distance <= myMaxDistance;
+            }
+            return distance < myCandidates.front().first;
+        }
+
+        void offer(double distance, Handle candidate) 
+        {
+            if (!canImprove(distance)) {
+                return;
+            }
+            if (myCandidates.size() == myK) {
+                std::pop_heap(myCandidates.begin(), myCandidates.end(), 
+                              compareDistances);
+                myCandidates.pop_back();
+            }
+            myCandidates.push_back(std::make_pair(distance, candidate));
+            std::push_heap(myCandidates.begin(), myCandidates.end(), 
+                           compareDistances);
+        }
+
+        /* write out the candidates, nearest first. */
+        void getResults(std::vector<Handle> &results,
+                        std::vector<double> *distances) const 
+        {
+            std::vector<Candidate> sorted(myCandidates);
+            std::stable_sort(sorted.begin(), sorted.end(), compareDistances);
+            results.clear();
+            results.reserve(sorted.size());
+            if (distances != NULL) {
+                distances->clear();
+                distances->reserve(sorted.size());
+            }
+            for (unsigned int i = 0; i < sorted.size(); i++) {
+                results.push_back(sorted[i].second);
+                if (distances != NULL) {
+                    distances->push_back(sorted[i].first);
+                }
+            }
+        }
+
+    private:
+        typedef std::pair<double, Handle> Candidate;
+
+        static bool compareDistances(const Candidate &a, const Candidate &b) 
+        {
+            return a.first < b.first;
+        }
+
+        unsigned int myK;
+        double myMaxDistance;
+        std::vector<Candidate> myCandidates;
+    };
+
+
+
+
     template <class T>
     class KDTreeNode: public BaseKDTreeNode <T, KDTreeNode<T> > {
     public: 
@@ -58,6 +743,17 @@ namespace mops {
                                                 k, maxLeafSize, 
                                                 myAxisToSplit, Ubounds,
                                                 LBounds, lastId) {}
+
+        /* an empty placeholder node, only for use by BaseKDTreeNode
+         * while building the tree. */
+        KDTreeNode() {}
+
+        /* read-only access to the structure of the tree, for
+         * anything (e.g. FlatKDTree) which needs to walk it. */
+        bool isLeaf() const { return this->myChildren.size() == 0; }
+        const KDTreeNode<T> *getLeftChild() const { return &(this->myChildren[0]); }
+        const KDTreeNode<T> *getRightChild() const { return &(this->myChildren[1]); }
+        const std::vector<PointAndValue <T> > *getMyData() const { return &(this->myData); }
         
 
 
@@ -65,11 +761,36 @@ namespace mops {
             std::vector<double> queryPt, 
             double queryRange) const; 
     
-        std::vector<PointAndValue <T> > 
-        hyperRectangleSearch(const std::vector<double> &queryPt, 
-                             const std::vector<double> &tolerances, 
-                             const std::vector<GeometryType> &spaceTypesByDimension) const;
+        /* append everything inside the (already validated) query
+         * rectangle to results. */
+        void hyperRectangleSearch(const ResolvedRectangleQuery &query,
+                                  std::vector<PointAndValue <T> > &results) const;
+
+        /* the search itself, specialized on whether any axis of the
+         * query wraps around (i.e. has two intervals). */
+        template <bool MayWrap>
+        void hyperRectangleSearchKernel(const ResolvedRectangleQuery &query,
+                                        std::vector<PointAndValue <T> > &results) const;
+
+        /* append everything inside the (already validated) query
+         * rectangle which annulus accepts to results, skipping any
+         * node which lies entirely inside the inner circle. */
+        void annulusSearch(const ResolvedRectangleQuery &rectangle,
+                           const RADecAnnulusQuery &annulus,
+                           std::vector<PointAndValue <T> > &results) const;
 
+        template <bool MayWrap>
+        void annulusSearchKernel(const ResolvedRectangleQuery &rectangle,
+                                 const RADecAnnulusQuery &annulus,
+                                 std::vector<PointAndValue <T> > &results) const;
+
+        /* offer everything which might be among the k nearest
+         * neighbors (under metric) to heap, nearer children first,
+         * skipping any subtree which can't beat the current k-th
+         * distance. */
+        template <class Metric>
+        void nearestNeighborSearch(const Metric &metric,
+                                   NearestNeighborHeap<const PointAndValue<T> *> &heap) const;
         
 
     };
@@ -144,93 +865,157 @@ namespace mops {
 
 
 template <class T>
-std::vector<PointAndValue <T> > 
-KDTreeNode<T>::hyperRectangleSearch(const std::vector<double> &queryPt,
-				    const std::vector<double> &tolerances,
-				    const std::vector<GeometryType> &spaceTypesByDimension) 
+void KDTreeNode<T>::hyperRectangleSearch(const ResolvedRectangleQuery &query,
+                                         std::vector<PointAndValue <T> > &results)
     const 
 {
-    std::vector<PointAndValue <T> > myResults;
+    if (query.mayWrap) {
+        hyperRectangleSearchKernel<true>(query, results);
+    }
+    else {
+        hyperRectangleSearchKernel<false>(query, results);
+    }
+}
 
+
+
+
+template <class T>
+template <bool MayWrap>
+void KDTreeNode<T>::hyperRectangleSearchKernel(const ResolvedRectangleQuery &query,
+                                               std::vector<PointAndValue <T> > &results)
+    const 
+{
     /* 
      * just like for rangeSearch, we want to return nothing if queryPt is too
      * far from our representative space; otherwise, we want to either pass the
      * buck to our children and accumulate their results, or we want to search
      * the data ourselves.
+     *
+     * all the geometry was handled when the query was resolved, so
+     * this is just interval overlap along each axis.
      */
+    for (unsigned int i = 0; i < this->myK; i++) {
+        if (!query.overlaps<MayWrap>(i, this->myLBounds[i], this->myUBounds[i])) {
+            return;
+        }
+    }
 
-    bool isInRange = true;
-
-    for (unsigned int i = 0; i < spaceTypesByDimension.size(); i++) {
-        if (spaceTypesByDimension[i] == CIRCULAR_DEGREES) {
-            if ((this->myUBounds[i] != convertToStandardDegrees(this->myUBounds[i]))
-                ||
-                (this->myLBounds[i] != convertToStandardDegrees(this->myLBounds[i]))
-                ||
-                (queryPt[i] != convertToStandardDegrees(queryPt[i]))) {
-                std::cerr << "Requested values: " << this->myUBounds[i] << ", " 
-                          << this->myLBounds[i] << " " << queryPt[i] 
-                          << " and i == " << i << std::endl;
-                throw LSST_EXCEPT(BadParameterException,  
-                                  "KDTreeNode: Data error: got that dimension is of type CIRCULAR_DEGREES but data and/or query do not lie along [0,360).");
+    if (this->myChildren.size() != 0) {
+        /* punt to the children */
+        for (unsigned int i = 0; i < this->myChildren.size(); i++) {
+            this->myChildren[i].template hyperRectangleSearchKernel<MayWrap>(
+                query, results);
+        }
+    }
+    else { 
+        /* do the actual searching */
+        for (unsigned int i = 0; i < this->myData.size(); i++) {                
+            const std::vector<double> &point = this->myData[i].getPoint();
+            bool isInRange = true;
+            for (unsigned int j = 0; (j < this->myK) && isInRange; j++) {
+                isInRange = query.contains<MayWrap>(j, point[j]);
+            }
+            if (isInRange == true) {
+                results.push_back(this->myData[i]);
             }
         }
     }
-    
-    for (unsigned int i = 0; (i < this->myK) && (isInRange == true); i++) {
-        double UBoundTolerance = queryPt[i] + tolerances[i];
-        double LBoundTolerance = queryPt[i] - tolerances[i];
-        /* NB: since tolerances may be up to 180 degrees, it is necessary to do
-         *two* tests here - one for each semicircle, one for the
-         'bottom' half.  this is due to the slightly curious implementation of regionsOverlap1D*/
-        if ((regionsOverlap1D(this->myLBounds[i], this->myUBounds[i], 
-                              UBoundTolerance, queryPt[i],
-                              spaceTypesByDimension[i]) == false) && 
-	    (regionsOverlap1D(this->myLBounds[i], this->myUBounds[i], 
-                              queryPt[i], LBoundTolerance,
-                              spaceTypesByDimension[i]) == false)) { 
-            isInRange = false;
-        }
-    }
-
-    if (isInRange == true) {
-        if (this->myChildren.size() != 0) {
-            /* punt to the children */
-            for (unsigned int i = 0; i < this->myChildren.size(); i++) {
-                std::vector<PointAndValue <T> > childResults;
-                childResults = this->myChildren[i].hyperRectangleSearch(queryPt, tolerances, 
-                                                                  spaceTypesByDimension);
-
-                for (unsigned int j = 0; j < childResults.size(); j++) {                    
-
-                    myResults.push_back(childResults[j]);
-                }                   
-            }
-
-        }
-        else { 
-            /* do the actual searching */
-            for (unsigned int i = 0; i < this->myData.size(); i++) {                
-                isInRange = true;
-                for (unsigned int j = 0; j < this->myK; j++) {
-                    std::vector<double> point = this->myData[i].getPoint();
-                    if (distance1D(point[j], queryPt[j], spaceTypesByDimension[j]) > tolerances[j]) {
-                        isInRange = false;
-                    }
-                }
-                if (isInRange == true) {
-                    myResults.push_back(this->myData[i]);
-                }
+}
+ 
+
+
+
+
+
+template <class T>
+void KDTreeNode<T>::annulusSearch(const ResolvedRectangleQuery &rectangle,
+                                  const RADecAnnulusQuery &annulus,
+                                  std::vector<PointAndValue <T> > &results)
+    const 
+{
+    if (rectangle.mayWrap) {
+        annulusSearchKernel<true>(rectangle, annulus, results);
+    }
+    else {
+        annulusSearchKernel<false>(rectangle, annulus, results);
+    }
+}
+
+
+
+
+template <class T>
+template <bool MayWrap>
+void KDTreeNode<T>::annulusSearchKernel(const ResolvedRectangleQuery &rectangle,
+                                        const RADecAnnulusQuery &annulus,
+                                        std::vector<PointAndValue <T> > &results)
+    const 
+{
+    /* just like hyperRectangleSearchKernel, but with one more way
+     * for a node to miss: being too close to the center. */
+    annulus.nodesVisited++;
+    for (unsigned int i = 0; i < this->myK; i++) {
+        if (!rectangle.overlaps<MayWrap>(i, this->myLBounds[i], this->myUBounds[i])) {
+            return;
+        }
+    }
+    if (annulus.enclosedByInner(&(this->myLBounds[0]), &(this->myUBounds[0]))) {
+        return;
+    }
+
+    if (this->myChildren.size() != 0) {
+        for (unsigned int i = 0; i < this->myChildren.size(); i++) {
+            this->myChildren[i].template annulusSearchKernel<MayWrap>(
+                rectangle, annulus, results);
+        }
+    }
+    else { 
+        for (unsigned int i = 0; i < this->myData.size(); i++) {                
+            const std::vector<double> &point = this->myData[i].getPoint();
+            bool isInRange = true;
+            for (unsigned int j = 0; (j < this->myK) && isInRange; j++) {
+                isInRange = rectangle.contains<MayWrap>(j, point[j]);
+            }
+            if ((isInRange == true) && (annulus.accepts(&(point[0])))) {
+                results.push_back(this->myData[i]);
             }
-            
         }
-        
     }
-    
-    return myResults;
 }
 
- 
+
+
+
+
+template <class T>
+template <class Metric>
+void KDTreeNode<T>::nearestNeighborSearch(const Metric &metric,
+                                          NearestNeighborHeap<const PointAndValue<T> *> &heap) const
+{
+    if (this->myChildren.size() == 0) {
+        for (unsigned int i = 0; i < this->myData.size(); i++) {
+            heap.offer(metric.distance(&(this->myData[i].getPoint()[0])), 
+                       &(this->myData[i]));
+        }
+        return;
+    }
+
+    /* visit the nearer child first; by the time we get to the other
+     * one the k-th distance has usually shrunk enough to skip it. */
+    double bounds[2];
+    for (unsigned int i = 0; i < 2; i++) {
+        bounds[i] = metric.lowerBound(&(this->myChildren[i].myLBounds[0]), 
+                                      &(this->myChildren[i].myUBounds[0]));
+    }
+    unsigned int first = (bounds[1] < bounds[0]) ? 1 : 0;
+    unsigned int order[2] = { first, 1 - first };
+    for (unsigned int i = 0; i < 2; i++) {
+        if (heap.canImprove(bounds[order[i]])) {
+            this->myChildren[order[i]].nearestNeighborSearch(metric, heap);
+        }
+    }
+}
 
 
 
@@ -36,7 +36,7 @@ namespace mops {
         void setPoint(std::vector <double> point) { myPoint = point; }
         void setValue(T value) { myValue = value; }
     
-        std::vector <double> getPoint() const { return myPoint; }
+        const std::vector <double> & getPoint() const { return myPoint; }
         T getValue() const { return myValue; }
 
         void debugPrint() {
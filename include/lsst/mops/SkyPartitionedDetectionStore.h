@@ -0,0 +1,135 @@
+// -*- LSST-C++ -*-
+
+/*
+ * An on-disk detection store partitioned by HEALPix pixel (NESTED
+ * ordering) and by exposure (image ID).  Each (pixel, image) bucket
+ * is a plain dets file in the usual
+ *
+ *     diaId obsHistId ssmId RA Dec MJD mag SNR
+ *
+ * format, so any bucket (or any set of buckets, concatenated) can be
+ * fed straight to the existing command-line tools.  An index file in
+ * the store directory lists every bucket with its detection count and
+ * MJD range, so a stage can find the pixels and exposures it needs
+ * without opening any detection files.
+ *
+ * The idea is that a stage which only cares about some region of the
+ * sky (plus a margin for motion) can load just the buckets which
+ * touch that region, rather than reading the whole night and
+ * indexing it from scratch; regions can then be processed
+ * independently and per-process memory is bounded by region size.
+ */
+
+#ifndef LSST_MOPS_SKY_PARTITIONED_DETECTION_STORE_H
+#define LSST_MOPS_SKY_PARTITIONED_DETECTION_STORE_H
+
+#include <string>
+#include <vector>
+
+#include "MopsDetection.h"
+
+
+namespace lsst {
+namespace mops {
+
+
+
+/*
+ * HEALPix helpers.  nside must be a power of two; RA and Dec are in
+ * degrees.  The implementation follows the NESTED scheme of Gorski et
+ * al. (2005), so pixel numbers agree with healpy/healpix_cxx.
+ */
+
+bool isValidNside(unsigned int nside);
+
+long int healpixNPix(unsigned int nside);
+
+long int healpixAng2PixNest(unsigned int nside, double RA, double Dec);
+
+/* center of the given pixel */
+void healpixPix2AngNest(unsigned int nside, long int pix,
+                        double &RA, double &Dec);
+
+/* an upper bound (in degrees) on the angular distance from the center
+ * of any pixel to any point inside that pixel. */
+double healpixMaxPixRad(unsigned int nside);
+
+
+
+
+/* one (pixel, exposure) bucket as described by the store's index */
+struct DetectionBucket {
+    long int pixel;
+    long int imageID;
+    unsigned int nDets;
+    double minMJD;
+    double maxMJD;
+    std::string fileName;
+};
+
+
+
+
+class SkyPartitionedDetectionStore {
+public:
+
+    /* open an existing store, reading its index. */
+    SkyPartitionedDetectionStore(const std::string &storeDir);
+
+    /* partition dets into (pixel, exposure) buckets and write a new
+     * store into storeDir (which is created if needed).  Throws
+     * FileException if the directory already holds a store.  */
+    static void build(const std::vector<MopsDetection> &dets,
+                      unsigned int nside,
+                      const std::string &storeDir);
+
+    unsigned int getNside() const;
+
+    const std::vector<DetectionBucket> & getBuckets() const;
+
+    /* sorted list of pixels holding at least one detection */
+    std::vector<long int> getPixels() const;
+
+    /* populated pixels which may overlap the cap of the given radius
+     * (degrees) around (RA, Dec). This is conservative: a returned
+     * pixel may not actually intersect the cap, but no pixel which
+     * does will be missed. */
+    std::vector<long int> getPixelsInCap(double RA, double Dec,
+                                         double radius) const;
+
+    /* append every detection from the named pixels with minMJD <=
+     * MJD <= maxMJD to dets. Buckets are read in (pixel, image)
+     * order and buckets entirely outside the time range are never
+     * opened. */
+    void loadPixels(const std::vector<long int> &pixels,
+                    std::vector<MopsDetection> &dets,
+                    double minMJD=-1e30, double maxMJD=1e30) const;
+
+    /* load the detections from every pixel which may overlap the cap;
+     * note that detections outside the cap (but in a touched pixel)
+     * are returned as well. */
+    void loadCap(double RA, double Dec, double radius,
+                 std::vector<MopsDetection> &dets,
+                 double minMJD=-1e30, double maxMJD=1e30) const;
+
+    /* load everything a stage needs to process pixel "pixel": the
+     * contents of every populated pixel within margin degrees of it.
+     * Use ownsDetection() to decide which results belong to this
+     * region and which belong to a neighbor, so that each result is
+     * reported exactly once across all regions. */
+    void loadRegion(long int pixel, double margin,
+                    std::vector<MopsDetection> &dets,
+                    double minMJD=-1e30, double maxMJD=1e30) const;
+
+    bool ownsDetection(long int pixel, const MopsDetection &det) const;
+
+private:
+    std::string myDir;
+    unsigned int myNside;
+    std::vector<DetectionBucket> myBuckets;
+};
+
+
+}} // close lsst::mops
+
+#endif
@@ -8,7 +8,9 @@
 
 #include <fstream>
 #include <string>
+#include <utility>
 #include <vector>
+#include <stdint.h>
 
 
 #include "Tracklet.h"
@@ -102,6 +104,59 @@ private:
 
 };
 
+
+
+
+/*
+ * A compact container for two-detection tracklets (pairs), as
+ * generated by findTracklets: each pair is just two 32-bit indices,
+ * held contiguously, rather than a full Tracklet with its std::set
+ * and best-fit functions.  Pairs are stored with the smaller index
+ * first, so they are written out exactly as the equivalent Tracklet
+ * would be.
+ *
+ * File and cacheing behavior are the same as for TrackletVector; use
+ * toTracklets() where real Tracklets are needed (e.g. going into
+ * collapseTracklets).
+ */
+
+class PairVector {
+public:
+
+    typedef std::pair<uint32_t, uint32_t> Pair;
+
+    PairVector() { useCache = false; cacheSize = 0; useOutFile = false; };
+
+    PairVector(std::string outFileName, bool useCache=false, unsigned int cacheSize=0);
+
+    ~PairVector();
+
+    void purgeToFile();
+
+    void push_back(uint32_t index1, uint32_t index2);
+
+    /* push_back each of other's pairs, in order. */
+    void append(const PairVector &other);
+
+    /* drop all pairs without writing them (even if we have an outfile). */
+    void clear() { componentPairs.clear(); }
+
+    const Pair & at(unsigned int) const;
+
+    unsigned int size() const;
+
+    /* push_back a Tracklet for each of our pairs onto results. */
+    void toTracklets(TrackletVector &results) const;
+
+private:
+    void writeToFile();
+    std::vector<Pair> componentPairs;
+    bool useCache;
+    std::ofstream outFile;
+    bool useOutFile;
+    unsigned int cacheSize;
+};
+
 }} // close namespace lsst::mops
 
 
@@ -41,6 +41,10 @@ namespace mops {
     /* return time since priorEvent (in seconds). */
     double timeElapsed(time_t priorEvent);
 
+    /* the current wall-clock time in seconds (since the epoch), to
+     * about a microsecond; differences give elapsed times. */
+    double wallClockSeconds();
+
     /* O(n)-time implementation returns median value of fv */
     double fastMedian(std::vector<double> fv);
 
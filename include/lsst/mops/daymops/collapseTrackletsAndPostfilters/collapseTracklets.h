@@ -35,14 +35,22 @@ namespace lsst {
          * set. collapsedPairs will actual output data.  I.e. if pairs
          * contains similar tracklets [1,2] and [2,3] they will be
          * marked as collapsed, and [1,2,3] will be added to the
-         * collapsedPairs vector.*/
+         * collapsedPairs vector.
+         *
+         * maxLeafSize is the most tracklets held in a leaf of the
+         * KDTree used to find similar tracklets; the best value
+         * depends on how crowded the data are.  Since collapsing is
+         * greedy, and the leaf size changes the order similar
+         * tracklets are found in, it can also change the output a
+         * little.*/
         void doCollapsingPopulateOutputVector(
             const std::vector<MopsDetection> * detections, 
             std::vector<Tracklet> &pairs,
             std::vector<double> tolerances, 
             std::vector<Tracklet> &collapsedPairs,
             bool useMinimumRMS, bool useBestFit, 
-            bool useRMSFilt, double maxRMS, bool beVerbose);
+            bool useRMSFilt, double maxRMS, bool beVerbose,
+            unsigned int maxLeafSize=50);
             
     }} // close lsst::mops
 
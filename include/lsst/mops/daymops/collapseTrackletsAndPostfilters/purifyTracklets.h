@@ -0,0 +1,48 @@
+// -*- LSST-C++ -*-
+
+/*
+ * jmyers 8/18/08
+ *
+ * purifyTracklets: drop the detections which don't fit a tracklet's
+ * linear motion, so that a tracklet which picked up a stray
+ * detection (e.g. from collapseTracklets) still describes one
+ * object.
+ */
+
+#ifndef LSST_PURIFY_TRACKLETS_H
+#define LSST_PURIFY_TRACKLETS_H
+
+#include <vector>
+
+#include "lsst/mops/MopsDetection.h"
+#include "lsst/mops/Tracklet.h"
+
+namespace lsst {
+    namespace mops {
+
+        /* purifyTracklet: assuming *t is an allocated tracklet, and
+         * allDets is an allocated vector of MopsDetections into which
+         * t's indices are indeed indices.
+         *
+         * return a corresponding tracklet, possibly empty, holding a
+         * subset of t's detections, each of which is within maxRMS
+         * (degrees) of the tracklet's best-fit line.  The worst
+         * offender is removed and the line refit until all are.  If t
+         * actually contains multiple tracklets, this will not help;
+         * but it will probably help you find one tracklet, anyway.
+         */
+        Tracklet purifyTracklet(const Tracklet *t,
+                                const std::vector<MopsDetection>* allDets,
+                                double maxRMS);
+
+        /* purify each tracklet in *trackletsVector and append those
+         * with at least minObs detections left to output, which must
+         * be empty. */
+        void purifyTracklets(const std::vector<Tracklet> *trackletsVector,
+                             const std::vector<MopsDetection> *detsVector,
+                             double maxRMS, unsigned int minObs,
+                             std::vector<Tracklet> &output);
+
+    }} // close lsst::mops
+
+#endif
@@ -28,12 +28,16 @@ namespace lsst {
  * returns a vector of pairs of similar points; each pair has as its
  * first part an index into queryPoints and as its second part an
  * index into dataPoints.
+ *
+ * maxLeafSize is the most data points held in a leaf of the KDTree
+ * searched.
  */
 std::vector<std::pair <unsigned int, unsigned int> > 
 detectionProximity(const std::vector<MopsDetection>& queryPoints,
 		   const std::vector<MopsDetection>& dataPoints,
                    double distanceThreshold,
-		   double timeThreshold);
+		   double timeThreshold,
+                   unsigned int maxLeafSize=100);
 
     }} // close lsst::mops
 
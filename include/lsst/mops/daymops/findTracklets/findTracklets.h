@@ -11,6 +11,8 @@
 #ifndef __FINDTRACKLETS_H__
 #define __FINDTRACKLETS_H__
 
+#include <istream>
+#include <ostream>
 #include <vector>
 
 #include "lsst/mops/TrackletVector.h"
@@ -31,6 +33,125 @@ namespace lsst {
 enum trackletOutputMethod { RETURN_TRACKLETS = 0, 
                             IDS_FILE,
                             IDS_FILE_WITH_CACHE};
+
+
+
+/******************************************************************************
+ * timings (wall-clock seconds) of each stage of a findTracklets run,
+ * and counts of the work done in each.  Fill one in by setting
+ * findTrackletsConfig::stats.
+ *
+ * Stages: grouping the detections by image (for the streaming
+ * version, reading them in), choosing a leaf size (only if
+ * autoTuneLeafSize), building each image's KDTree and footprint,
+ * planning which image pairs to search, searching, and writing (or
+ * handing back) the last of the results.  Results written out while
+ * searching count as searching.
+ ******************************************************************************/
+class findTrackletsStats {
+public:
+    findTrackletsStats() 
+        {
+            groupingTime = 0.;
+            tuningTime = 0.;
+            treeBuildTime = 0.;
+            planningTime = 0.;
+            searchTime = 0.;
+            outputTime = 0.;
+            nDetections = 0;
+            nImages = 0;
+            imagePairsCompared = 0;
+            imagePairsSearched = 0;
+            treeSearches = 0;
+            nodesVisited = 0;
+            candidatesReturned = 0;
+            pairsAccepted = 0;
+            leafSize = 0;
+        }
+
+    double groupingTime;
+    double tuningTime;
+    double treeBuildTime;
+    double planningTime;
+    double searchTime;
+    double outputTime;
+
+    // images within [minDt, maxDt] of each other, and those pairs
+    // whose footprints were close enough to search.
+    unsigned long int nDetections;
+    unsigned long int nImages;
+    unsigned long int imagePairsCompared;
+    unsigned long int imagePairsSearched;
+    // tree searches run (one per query detection per candidate image
+    // it can reach), the KDTree nodes they visited and the
+    // detections they found; pairsAccepted is what's left after any
+    // further cuts (e.g. on trails).
+    unsigned long int treeSearches;
+    unsigned long int nodesVisited;
+    unsigned long int candidatesReturned;
+    unsigned long int pairsAccepted;
+
+    // the KDTree leaf size used
+    unsigned int leafSize;
+
+    /* add other's search counters to ours (e.g. to gather up
+     * per-thread counts). */
+    void addSearchCounts(const findTrackletsStats &other)
+        {
+            treeSearches += other.treeSearches;
+            nodesVisited += other.nodesVisited;
+            candidatesReturned += other.candidatesReturned;
+            pairsAccepted += other.pairsAccepted;
+        }
+
+    double totalTime() const
+        {
+            return groupingTime + tuningTime + treeBuildTime + 
+                planningTime + searchTime + outputTime;
+        }
+
+    /* write as a single JSON object. */
+    void writeJSON(std::ostream &out) const
+        {
+            out << "{\"groupingTime\": " << groupingTime 
+                << ", \"tuningTime\": " << tuningTime
+                << ", \"treeBuildTime\": " << treeBuildTime
+                << ", \"planningTime\": " << planningTime
+                << ", \"searchTime\": " << searchTime
+                << ", \"outputTime\": " << outputTime
+                << ", \"totalTime\": " << totalTime()
+                << ", \"nDetections\": " << nDetections
+                << ", \"nImages\": " << nImages
+                << ", \"imagePairsCompared\": " << imagePairsCompared
+                << ", \"imagePairsSearched\": " << imagePairsSearched
+                << ", \"treeSearches\": " << treeSearches
+                << ", \"nodesVisited\": " << nodesVisited
+                << ", \"candidatesReturned\": " << candidatesReturned
+                << ", \"pairsAccepted\": " << pairsAccepted
+                << ", \"leafSize\": " << leafSize
+                << "}" << std::endl;
+        }
+
+    /* write as CSV: a header line, then one line of values. */
+    void writeCSV(std::ostream &out) const
+        {
+            out << "groupingTime,tuningTime,treeBuildTime,planningTime,"
+                << "searchTime,outputTime,totalTime,nDetections,nImages,"
+                << "imagePairsCompared,imagePairsSearched,treeSearches,"
+                << "nodesVisited,candidatesReturned,pairsAccepted,leafSize" 
+                << std::endl;
+            out << groupingTime << "," << tuningTime << "," 
+                << treeBuildTime << "," 
+                << planningTime << "," << searchTime << "," 
+                << outputTime << "," << totalTime() << ","
+                << nDetections << "," << nImages << ","
+                << imagePairsCompared << "," << imagePairsSearched << ","
+                << treeSearches << "," << nodesVisited << ","
+                << candidatesReturned << "," << pairsAccepted << "," 
+                << leafSize << std::endl;
+        }
+};
+
         
 class findTrackletsConfig {
 public:
@@ -44,6 +165,13 @@ public:
             outputMethod = RETURN_TRACKLETS;
             outputFile = "";
             outputBufferSize = 0;
+            deterministicOutput = false;
+            stats = NULL;
+            leafSize = 16;
+            autoTuneLeafSize = false;
+            trailRateTolerance = .1;
+            trailAngleTolerance = 10.;
+            trailPositionTolerance = .0003; // about 1 arcsec
         }
 
     // units for these two are in days.
@@ -77,7 +205,69 @@ public:
     trackletOutputMethod outputMethod;
     std::string outputFile;
     unsigned int outputBufferSize;
+
+    // deterministicOutput: only used by findTrackletsOMP.  If true,
+    // results are written in exactly the same order as the serial
+    // findTracklets would write them; otherwise, each thread's results
+    // are written in batches, in whatever order the threads finish.
+    bool deterministicOutput;
+
+    // if not NULL, the timings and counters of the run are written
+    // here.
+    findTrackletsStats *stats;
+
+    // the most detections held in a leaf of each image's KDTree.  The
+    // best value depends on how crowded the images are (and the
+    // cache); if autoTuneLeafSize, findTracklets times searches of a
+    // sample of the images with several leaf sizes first, and uses
+    // the fastest instead.  (findTrackletsStreaming doesn't tune.)
+    // The leaf size doesn't change which pairs are found, but may
+    // change the order of each detection's pairs.
+    unsigned int leafSize;
+    bool autoTuneLeafSize;
+
+    // trailRateTolerance, trailAngleTolerance, trailPositionTolerance:
+    // only used when findTracklets is given DetectionMotions (see
+    // below).  A trailed detection is only paired with detections
+    // whose offset from it matches its trail: a rate within
+    // trailRateTolerance (deg/day) of the trail's rate, and a direction
+    // within trailAngleTolerance (degrees) of the trail's (either way
+    // along it).  trailPositionTolerance (degrees) is the astrometric
+    // slack allowed on top of both.
+    double trailRateTolerance;
+    double trailAngleTolerance;
+    double trailPositionTolerance;
 };
+
+
+
+
+/*****************************************************************
+ * The motion implied by a trailed (elongated) detection: rate in
+ * deg/day and position angle (degrees, north through east) of the
+ * trail.  A trail doesn't say which end is which, so the direction of
+ * motion is either angle or angle + 180.  A negative rate means
+ * nothing is known (e.g. the detection isn't trailed).
+ *****************************************************************/
+class DetectionMotion {
+public:
+    DetectionMotion() { rate = -1.; angle = 0.; }
+    DetectionMotion(double rate, double angle) : rate(rate), angle(angle) {}
+
+    bool isTrailed() const { return rate >= 0.; }
+
+    double rate;
+    double angle;
+};
+
+/* the motion implied by a trail of the given length (degrees) and
+ * position angle (degrees), as in the LENGTH and ANGLE of PanSTARRS
+ * MITI format, seen in an exposure of exposureTime seconds. */
+inline DetectionMotion motionFromElongation(double length, double angle,
+                                            double exposureTime)
+{
+    return DetectionMotion(length / (exposureTime / 86400.), angle);
+}
         
 
 
@@ -96,6 +286,50 @@ TrackletVector *
 findTracklets(const std::vector<MopsDetection> &allDetections, 
 	      findTrackletsConfig config);
 
+
+
+/*****************************************************************
+ * As above, but motions[i] holds what allDetections[i]'s trail says
+ * about its motion.  For each trailed detection, rather than looking
+ * at everything within maxV * dt, we only look where the trail
+ * predicts its companion (see the trail* fields of
+ * findTrackletsConfig); untrailed detections are searched as usual.
+ *****************************************************************/
+
+TrackletVector *
+findTracklets(const std::vector<MopsDetection> &allDetections, 
+              const std::vector<DetectionMotion> &motions,
+	      findTrackletsConfig config);
+
+
+
+/*****************************************************************
+ * As findTracklets, but put the tracklets into pairs, each as the
+ * indices in allDetections of its two detections rather than their
+ * IDs (which need not be unique).  config.outputMethod is ignored.
+ *****************************************************************/
+
+void
+findTrackletPairs(const std::vector<MopsDetection> &allDetections, 
+                  findTrackletsConfig config,
+                  PairVector &pairs);
+
+
+
+/*****************************************************************
+ * Streaming version: read detections (in the usual dets file format)
+ * from detsStream and find the same tracklets as findTracklets, in
+ * the same order.  Detections must be sorted by time, with each
+ * image's detections together; only the images within maxDt of the
+ * oldest image not yet searched are held in memory, so memory use
+ * is bounded by the time window rather than the whole input.
+ * Output and return value are as for findTracklets.
+ *****************************************************************/
+
+TrackletVector *
+findTrackletsStreaming(std::istream &detsStream,
+                       findTrackletsConfig config);
+
     }} // close lsst::mops
 
 #endif
@@ -55,6 +55,13 @@ namespace mops {
             bool useMedian=false,
             bool splitWidest=true);
         
+        /* an empty placeholder node, only for use while building the
+         * tree. */
+        TrackletTreeNode() : numVisits(0) {}
+
+        /* see BaseKDTreeNode::swapContents; also swaps numVisits. */
+        void swapContents(TrackletTreeNode &other);
+        
     
         const unsigned int getNumVisits() const;
         void addVisit();
@@ -0,0 +1,107 @@
+// -*- LSST-C++ -*-
+
+/*
+ * makeTracklets: the whole nightly tracklet pipeline
+ *
+ *    findTracklets -> collapseTracklets -> purifyTracklets -> removeSubsets
+ *
+ * run in one process.  Run as separate programs (see
+ * bin/runCollapseTracklets.sh) each stage writes its results to disk
+ * for the next to re-read, with id <-> index conversions in between;
+ * here the results of each stage are handed straight to the next and
+ * only the final tracklets are written.
+ */
+
+#ifndef LSST_MAKE_TRACKLETS_H
+#define LSST_MAKE_TRACKLETS_H
+
+#include <vector>
+
+#include "lsst/mops/MopsDetection.h"
+#include "lsst/mops/Tracklet.h"
+#include "lsst/mops/daymops/findTracklets/findTracklets.h"
+
+
+namespace lsst {
+    namespace mops {
+
+
+
+/*
+ * container class to hold the arguments to each stage of
+ * makeTracklets.  The defaults are those of the stand-alone programs
+ * as run by runCollapseTracklets.sh.
+ */
+class makeTrackletsConfig {
+public:
+
+    makeTrackletsConfig()
+        {
+            collapseTolerances.push_back(.002); // RA0
+            collapseTolerances.push_back(.002); // Dec0
+            collapseTolerances.push_back(5.);   // angle
+            collapseTolerances.push_back(.05);  // velocity
+            collapse = true;
+            useMinimumRMS = false;
+            useBestFit = false;
+            useRMSFilt = false;
+            collapseMaxRMS = .001;
+            collapseLeafSize = 50;
+            purify = true;
+            purifyMaxRMS = .001;
+            purifyMinObs = 2;
+            removeSubsets = true;
+            keepOnlyLongestPerDet = false;
+            shortCircuit = true;
+            sortBeforeIntersect = false;
+            beVerbose = false;
+        }
+
+    // findTracklets.  outputMethod is ignored; the pairs are always
+    // kept in memory.
+    findTrackletsConfig findConfig;
+
+    // collapseTracklets: see doCollapsingPopulateOutputVector.
+    // tolerances are RA0, Dec0 (degrees), angle (degrees) and
+    // velocity (deg/day).
+    bool collapse;
+    std::vector<double> collapseTolerances;
+    bool useMinimumRMS;
+    bool useBestFit;
+    bool useRMSFilt;
+    double collapseMaxRMS;
+    unsigned int collapseLeafSize;
+
+    // purifyTracklets: see purifyTracklets.
+    bool purify;
+    double purifyMaxRMS;
+    unsigned int purifyMinObs;
+
+    // removeSubsets: see SubsetRemover and putLongestPerDetInOutputVector.
+    bool removeSubsets;
+    bool keepOnlyLongestPerDet;
+    bool shortCircuit;
+    bool sortBeforeIntersect;
+
+    // print what each stage is doing, and how long it took.
+    bool beVerbose;
+};
+
+
+
+
+/*
+ * find tracklets in dets and collapse, purify and remove subsets
+ * from them, as asked by config.  The resulting tracklets are
+ * appended to output, which must be empty; their indices are indices
+ * into dets (as for collapseTracklets etc.), not detection IDs.
+ */
+void makeTracklets(const std::vector<MopsDetection> &dets,
+                   const makeTrackletsConfig &config,
+                   std::vector<Tracklet> &output);
+
+
+
+    }} // close lsst::mops
+
+#endif
@@ -30,6 +30,8 @@ namespace lsst {
  *   dataOrbits[pair.first] is similar to 
  *   queryOrbits[pair.second]
  *
+ * maxLeafSize is the most orbits held in a leaf of the KDTree of
+ * dataOrbits.
  */
 std::vector<std::pair<unsigned int, unsigned int> > 
 orbitProximity(std::vector<Orbit> dataOrbits, 
@@ -39,7 +41,8 @@ orbitProximity(std::vector<Orbit> dataOrbits,
                double inclinationTolerance,
                double perihelionArgTolerance,
                double longitudeArgTolerance,
-               double perihelionTimeTolerance);
+               double perihelionTimeTolerance,
+               unsigned int maxLeafSize=100);
 
     }} // close lsst::mops
 
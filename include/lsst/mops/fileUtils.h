@@ -16,6 +16,7 @@
 
 #include <fstream>
 #include <iostream>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -42,6 +43,17 @@ void writeTrackletsToOutFile(const std::vector<Tracklet> * tracklets, std::ofstr
 
 void populateDetVectorFromFile(std::ifstream &detsFile, std::vector <MopsDetection> &myDets, const double &astromErr = 0.0);
 
+/* write dets in the same format populateDetVectorFromFile reads. */
+void writeDetsToOutFile(const std::vector<MopsDetection> * dets, std::ofstream &outFile);
+
+/* read one line of a pairs or tracks file (detection indices or IDs,
+ * separated by spaces) into indices. */
+void parseTrackletLine(const std::string &line, std::set<unsigned int> &indices);
+
+/* as above, but into a sorted vector without repeats; much faster,
+ * for reading big files a line at a time. */
+void parseTrackletLine(const std::string &line, std::vector<unsigned int> &indices);
+
 void populatePairsVectorFromFile(std::ifstream &pairsFile,
 				 std::vector <Tracklet> &pairsVector);
 
@@ -0,0 +1,67 @@
+// -*- LSST-C++ -*-
+
+/*
+ * removal of exact duplicate tracks (or tracklets) from a tracks file.
+ *
+ * When linkTracklets is run on overlapping windows, most of the
+ * redundant tracks in the merged output are not subsets of other
+ * tracks but exact copies of them.  Dropping those first, in one
+ * streaming pass which never holds the tracks themselves, leaves
+ * removeSubsets far less to do.
+ */
+
+#ifndef LSST_REMOVE_DUPLICATES_H
+#define LSST_REMOVE_DUPLICATES_H
+
+#include <set>
+#include <string>
+#include <stdint.h>
+
+
+namespace lsst {
+namespace mops {
+
+
+    /* a 128-bit hash of a track's detections. */
+    class TrackSignature {
+    public:
+        uint64_t hi;
+        uint64_t lo;
+
+        bool operator<(const TrackSignature &other) const {
+            return (hi < other.hi) || ((hi == other.hi) && (lo < other.lo));
+        }
+        bool operator==(const TrackSignature &other) const {
+            return (hi == other.hi) && (lo == other.lo);
+        }
+    };
+
+    TrackSignature trackSignature(const std::set<unsigned int> &dets);
+
+
+
+    /*
+     * copy the tracks in inFileName to outFileName, in order, leaving
+     * out every track with the same detections as an earlier one (so
+     * removeSubsets on the output gives the same results as on the
+     * input).  Returns the number of tracks left out.
+     *
+     * Only the signature and line number of each track is kept, and
+     * only up to maxMemoryBytes of those; past that, sorted runs of
+     * them are written to files named <outFileName>.sigRun<n>, which
+     * are merged and removed at the end.  A bit per track is also
+     * kept, to mark the duplicates.
+     *
+     * Tracks are compared by signature alone, so two different tracks
+     * with the same signature would be taken for duplicates; for a
+     * billion tracks the chance of that is about 1 in 10^20.
+     */
+    unsigned int removeDuplicateTracksFromFile(const std::string &inFileName,
+                                               const std::string &outFileName,
+                                               uint64_t maxMemoryBytes);
+
+
+
+}} // close namespace lsst::mops
+
+#endif
@@ -0,0 +1,54 @@
+// -*- LSST-C++ -*-
+
+/*
+ * removeSubsets for tracks files too large to hold in memory.
+ *
+ * Any superset of a track (or identical copy of it) uses every one of
+ * its detections, in particular its lowest-numbered one.  So we split
+ * the range of detection indices into buckets, small enough that the
+ * tracks using the detections of any one bucket fit in the memory
+ * budget, and write each track to the bucket of each of its
+ * detections.  Running the in-memory SubsetRemover on one bucket then
+ * decides correctly for every track whose lowest detection is in that
+ * bucket, since everything which could rule it out is there too; the
+ * other tracks of the bucket are decided in their own buckets.
+ */
+
+#ifndef LSST_REMOVE_SUBSETS_EXTERNAL_H
+#define LSST_REMOVE_SUBSETS_EXTERNAL_H
+
+#include <string>
+#include <stdint.h>
+
+
+namespace lsst {
+namespace mops {
+
+
+    /*
+     * read tracks from inFileName and write those removeSubsets
+     * would keep to outFileName, in the same order and format as
+     * removeSubsets would.
+     *
+     * maxMemoryBytes is the budget for the tracks of one bucket (an
+     * estimate).  Buckets are built from bins of maxDet / 65536 + 1
+     * consecutive detection indices, maxDet being the largest index
+     * in the file, and never split a bin; so a bin whose tracks
+     * alone don't fit (which may hold several detections) gets a
+     * bucket of its own, over the budget.  Buckets are written to
+     * files named <outFileName>.part<n>, and removed as they are
+     * done.  Besides the buckets, a bit per track is held in memory.
+     *
+     * Returns the number of buckets used.
+     */
+    unsigned int removeSubsetsFromFile(const std::string &inFileName,
+                                       const std::string &outFileName,
+                                       uint64_t maxMemoryBytes,
+                                       bool shortCircuit=true,
+                                       bool sortBeforeIntersect=false);
+
+
+
+}} // close namespace lsst::mops
+
+#endif
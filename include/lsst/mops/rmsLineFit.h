@@ -14,6 +14,7 @@
 #ifndef LSST_RMSLINEFIT_H
 #define LSST_RMSLINEFIT_H
 
+#include <cmath>
 #include <vector>
 #include <map>
 
@@ -34,7 +35,7 @@ namespace mops {
      * perDetSqDist is a pointer to an allocated vector, and we will populate it
      * s.t. mean Sq. distance (trackletDets[i],line) = perDetSqDist[i] 
      */
-    double rmsForTracklet(Tracklet t, const std::vector<MopsDetection> *detections, 
+    double rmsForTracklet(const Tracklet &t, const std::vector<MopsDetection> *detections, 
                           std::vector<double>*perDetSqDist=NULL);
     
 
@@ -85,6 +86,131 @@ namespace mops {
 
 
 
+    /*
+     * Running sums for fitting RA and Dec as linear functions of
+     * time, as leastSquaresSolveForRADecLinear does.  Adding a
+     * detection is O(1), and any detection's squared distance from
+     * the fit and the tracklet's rmsForTracklet value are read off in
+     * closed form.  A caller trying many candidate
+     * additions to a tracklet can copy the accumulator, add the
+     * candidate's detections and ask for the RMS, rather than
+     * refitting everything from scratch; removing a detection is O(1)
+     * too, which is what purifyTracklet wants.
+     *
+     * Times and positions are kept relative to the first detection
+     * added (with RA and Dec differences wrapped into [-180, 180)),
+     * which keeps the sums well conditioned and handles tracklets
+     * which cross RA 0/360.
+     */
+    class LinearFitAccumulator {
+    public:
+        LinearFitAccumulator() : n(0), t0(0.), RA0(0.), Dec0(0.),
+                                 sumT(0.), sumTT(0.),
+                                 sumRA(0.), sumTRA(0.), sumRARA(0.),
+                                 sumDec(0.), sumTDec(0.), sumDecDec(0.) {}
+
+        void add(const MopsDetection &det) {
+            if (n == 0) {
+                t0 = det.getEpochMJD();
+                RA0 = det.getRA();
+                Dec0 = det.getDec();
+            }
+            n++;
+            accumulate(det, 1.);
+        }
+
+        /* undo add(det); det must have been added. */
+        void remove(const MopsDetection &det) {
+            if (n == 0) {
+                throw LSST_EXCEPT(ProgrammerErrorException,
+                                  "LinearFitAccumulator: remove from an empty fit\n");
+            }
+            n--;
+            accumulate(det, -1.);
+        }
+
+        unsigned int size() const { return n; }
+
+        /* sum of squared distances (deg^2) of the detections from the
+         * best-fit line; the 'squaresSum' of rmsForTracklet. */
+        double sumSqResiduals() const {
+            return residual(sumRA, sumTRA, sumRARA) +
+                residual(sumDec, sumTDec, sumDecDec);
+        }
+
+        /* same definition as rmsForTracklet. */
+        double rms() const {
+            if (n == 0) {
+                throw LSST_EXCEPT(ProgrammerErrorException,
+                                  "LinearFitAccumulator: rms of an empty fit\n");
+            }
+            return sqrt(sumSqResiduals()) / n;
+        }
+
+        /* squared distance (deg^2) of det from the best-fit line. */
+        double sqDist(const MopsDetection &det) const {
+            double t = det.getEpochMJD() - t0;
+            double dRA = wrap(det.getRA() - RA0) - project(sumRA, sumTRA, t);
+            double dDec = wrap(det.getDec() - Dec0) - project(sumDec, sumTDec, t);
+            return dRA*dRA + dDec*dDec;
+        }
+
+    private:
+        void accumulate(const MopsDetection &det, double sign) {
+            double t = det.getEpochMJD() - t0;
+            double RA = wrap(det.getRA() - RA0);
+            double Dec = wrap(det.getDec() - Dec0);
+            sumT += sign * t;
+            sumTT += sign * t*t;
+            sumRA += sign * RA;
+            sumTRA += sign * t*RA;
+            sumRARA += sign * RA*RA;
+            sumDec += sign * Dec;
+            sumTDec += sign * t*Dec;
+            sumDecDec += sign * Dec*Dec;
+        }
+
+        static double wrap(double d) {
+            if (d >= 180.) {
+                return d - 360.;
+            }
+            if (d < -180.) {
+                return d + 360.;
+            }
+            return d;
+        }
+
+        /* centered second moment of t; zero if all the times match */
+        double varT() const { return sumTT - sumT * sumT / n; }
+
+        double slope(double sumX, double sumTX) const {
+            double v = varT();
+            return (v > 0.) ? (sumTX - sumT * sumX / n) / v : 0.;
+        }
+
+        double project(double sumX, double sumTX, double t) const {
+            return sumX / n + slope(sumX, sumTX) * (t - sumT / n);
+        }
+
+        double residual(double sumX, double sumTX, double sumXX) const {
+            double covTX = sumTX - sumT * sumX / n;
+            double r = sumXX - sumX * sumX / n;
+            double v = varT();
+            if (v > 0.) {
+                r -= covTX * covTX / v;
+            }
+            return (r > 0.) ? r : 0.;
+        }
+
+        unsigned int n;
+        double t0, RA0, Dec0;
+        double sumT, sumTT;
+        double sumRA, sumTRA, sumRARA;
+        double sumDec, sumTDec, sumDecDec;
+    };
+
+
+
 
 }} // close lsst::mops
 
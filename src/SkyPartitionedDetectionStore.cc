@@ -0,0 +1,478 @@
+// -*- LSST-C++ -*-
+
+/*
+ * See SkyPartitionedDetectionStore.h.
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <sstream>
+// mkdir()
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+
+#include "lsst/mops/SkyPartitionedDetectionStore.h"
+#include "lsst/mops/Exceptions.h"
+#include "lsst/mops/common.h"
+#include "lsst/mops/fileUtils.h"
+
+
+namespace lsst {
+namespace mops {
+
+
+#define STORE_INDEX_FILE "index.txt"
+
+
+
+
+
+/**************************************************************
+ * HEALPix NESTED scheme
+ **************************************************************/
+
+bool isValidNside(unsigned int nside)
+{
+    // power of two, and small enough that 12*nside^2 fits a long int
+    // and pixel coordinates fit an int.
+    return ((nside > 0) && ((nside & (nside - 1)) == 0)
+            && (nside <= (1u << 29)));
+}
+
+
+
+static void checkNside(unsigned int nside)
+{
+    if (!isValidNside(nside)) {
+        throw LSST_EXCEPT(BadParameterException,
+                          "HEALPix nside must be a positive power of two.\n");
+    }
+}
+
+
+
+long int healpixNPix(unsigned int nside)
+{
+    checkNside(nside);
+    return 12L * nside * nside;
+}
+
+
+
+/* interleave the bits of ix (even bits) and iy (odd bits) */
+static long int xy2pix(long int ix, long int iy)
+{
+    long int pix = 0;
+    for (unsigned int bit = 0; bit < 30; bit++) {
+        pix |= ((ix >> bit) & 1L) << (2 * bit);
+        pix |= ((iy >> bit) & 1L) << (2 * bit + 1);
+    }
+    return pix;
+}
+
+
+
+static void pix2xy(long int pix, long int &ix, long int &iy)
+{
+    ix = 0;
+    iy = 0;
+    for (unsigned int bit = 0; bit < 30; bit++) {
+        ix |= ((pix >> (2 * bit)) & 1L) << bit;
+        iy |= ((pix >> (2 * bit + 1)) & 1L) << bit;
+    }
+}
+
+
+
+long int healpixAng2PixNest(unsigned int nside, double RA, double Dec)
+{
+    checkNside(nside);
+    const long int ns = nside;
+    double z = sin(Dec * M_PI / 180.);
+    double za = fabs(z);
+    // tt in [0, 4)
+    double tt = convertToStandardDegrees(RA) / 90.;
+    if (tt >= 4.) {
+        tt = 0.;
+    }
+    long int face, ix, iy;
+
+    if (za <= 2./3.) {
+        // equatorial region
+        double temp1 = ns * (0.5 + tt);
+        double temp2 = ns * (z * 0.75);
+        long int jp = (long int) (temp1 - temp2);
+        long int jm = (long int) (temp1 + temp2);
+        long int ifp = jp / ns;
+        long int ifm = jm / ns;
+        if (ifp == ifm) {
+            face = ifp | 4;
+        }
+        else if (ifp < ifm) {
+            face = ifp;
+        }
+        else {
+            face = ifm + 8;
+        }
+        ix = jm & (ns - 1);
+        iy = ns - (jp & (ns - 1)) - 1;
+    }
+    else {
+        // polar caps
+        long int ntt = std::min(3L, (long int) tt);
+        double tp = tt - ntt;
+        double tmp = ns * sqrt(3. * (1. - za));
+        long int jp = std::min(ns - 1, (long int) (tp * tmp));
+        long int jm = std::min(ns - 1, (long int) ((1. - tp) * tmp));
+        if (z >= 0) {
+            face = ntt;
+            ix = ns - jm - 1;
+            iy = ns - jp - 1;
+        }
+        else {
+            face = ntt + 8;
+            ix = jp;
+            iy = jm;
+        }
+    }
+    return face * ns * ns + xy2pix(ix, iy);
+}
+
+
+
+void healpixPix2AngNest(unsigned int nside, long int pix,
+                        double &RA, double &Dec)
+{
+    static const int jrll[12] = { 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4 };
+    static const int jpll[12] = { 1, 3, 5, 7, 0, 2, 4, 6, 1, 3, 5, 7 };
+
+    const long int npix = healpixNPix(nside);
+    if ((pix < 0) || (pix >= npix)) {
+        throw LSST_EXCEPT(BadParameterException,
+                          "HEALPix pixel number out of range.\n");
+    }
+    const long int ns = nside;
+    const long int nl4 = 4 * ns;
+    const double fact2 = 4. / npix;
+    const double fact1 = (2 * ns) * fact2;
+
+    long int face = pix / (ns * ns);
+    long int ix, iy;
+    pix2xy(pix % (ns * ns), ix, iy);
+
+    long int jr = jrll[face] * ns - ix - iy - 1;
+    long int nr, kshift;
+    double z;
+    if (jr < ns) {
+        nr = jr;
+        z = 1. - nr * nr * fact2;
+        kshift = 0;
+    }
+    else if (jr > 3 * ns) {
+        nr = nl4 - jr;
+        z = nr * nr * fact2 - 1.;
+        kshift = 0;
+    }
+    else {
+        nr = ns;
+        z = (2 * ns - jr) * fact1;
+        kshift = (jr - ns) & 1;
+    }
+
+    long int jp = (jpll[face] * nr + ix - iy + 1 + kshift) / 2;
+    if (jp > nl4) {
+        jp -= nl4;
+    }
+    if (jp < 1) {
+        jp += nl4;
+    }
+    double phi = (jp - (kshift + 1) * 0.5) * (M_PI / 2. / nr);
+
+    RA = convertToStandardDegrees(phi * 180. / M_PI);
+    Dec = asin(std::max(-1., std::min(1., z))) * 180. / M_PI;
+}
+
+
+
+double healpixMaxPixRad(unsigned int nside)
+{
+    /* this is the bound used by healpix_cxx (Healpix_Base::max_pixrad):
+     * the distance between the centre and the far corner of the
+     * largest pixel. Work on unit vectors to avoid precision trouble
+     * for large nside. */
+    checkNside(nside);
+    double ns = nside;
+    double za = 2./3.;
+    double phia = M_PI / (4. * ns);
+    double va[3] = { sqrt(1. - za*za) * cos(phia),
+                     sqrt(1. - za*za) * sin(phia),
+                     za };
+    double t1 = 1. - 1. / ns;
+    t1 *= t1;
+    double zb = 1. - t1 / 3.;
+    double vb[3] = { sqrt(1. - zb*zb), 0., zb };
+    double cross[3] = { va[1]*vb[2] - va[2]*vb[1],
+                        va[2]*vb[0] - va[0]*vb[2],
+                        va[0]*vb[1] - va[1]*vb[0] };
+    double sinAng = sqrt(cross[0]*cross[0] + cross[1]*cross[1]
+                         + cross[2]*cross[2]);
+    double cosAng = va[0]*vb[0] + va[1]*vb[1] + va[2]*vb[2];
+    return atan2(sinAng, cosAng) * 180. / M_PI;
+}
+
+
+
+
+
+
+
+
+
+/**************************************************************
+ * SkyPartitionedDetectionStore
+ **************************************************************/
+
+
+static std::string joinPath(const std::string &dir, const std::string &file)
+{
+    if ((dir.size() > 0) && (dir[dir.size() - 1] == '/')) {
+        return dir + file;
+    }
+    return dir + "/" + file;
+}
+
+
+
+static std::string bucketFileName(long int pixel, long int imageID)
+{
+    std::ostringstream ss;
+    ss << "pix" << pixel << "_img" << imageID << ".dias";
+    return ss.str();
+}
+
+
+
+
+SkyPartitionedDetectionStore::SkyPartitionedDetectionStore(
+    const std::string &storeDir)
+{
+    myDir = storeDir;
+    std::string indexName = joinPath(myDir, STORE_INDEX_FILE);
+    std::ifstream indexFile(indexName.c_str());
+    if (!indexFile.is_open()) {
+        throw LSST_EXCEPT(FileException,
+                          "Could not open detection store index "
+                          + indexName + "\n");
+    }
+
+    std::string line;
+    std::getline(indexFile, line);
+    std::istringstream header(line);
+    std::string key;
+    header >> key >> myNside;
+    if (header.fail() || (key != "nside") || !isValidNside(myNside)) {
+        throw LSST_EXCEPT(InputFileFormatErrorException,
+                          "Bad header in detection store index "
+                          + indexName + "\n");
+    }
+
+    std::getline(indexFile, line);
+    while (!indexFile.fail()) {
+        if (line.size() > 0) {
+            std::istringstream ss(line);
+            DetectionBucket b;
+            ss >> b.pixel >> b.imageID >> b.nDets
+               >> b.minMJD >> b.maxMJD >> b.fileName;
+            if (ss.fail()) {
+                throw LSST_EXCEPT(InputFileFormatErrorException,
+                                  "Badly-formatted line in detection store index "
+                                  + indexName + ": " + line + "\n");
+            }
+            myBuckets.push_back(b);
+        }
+        line.clear();
+        std::getline(indexFile, line);
+    }
+}
+
+
+
+
+void SkyPartitionedDetectionStore::build(const std::vector<MopsDetection> &dets,
+                                         unsigned int nside,
+                                         const std::string &storeDir)
+{
+    checkNside(nside);
+
+    if ((mkdir(storeDir.c_str(), 0755) != 0) && (errno != EEXIST)) {
+        throw LSST_EXCEPT(FileException,
+                          "Could not create detection store directory "
+                          + storeDir + "\n");
+    }
+    std::string indexName = joinPath(storeDir, STORE_INDEX_FILE);
+    {
+        std::ifstream existing(indexName.c_str());
+        if (existing.is_open()) {
+            throw LSST_EXCEPT(FileException,
+                              "Refusing to overwrite existing detection store in "
+                              + storeDir + "\n");
+        }
+    }
+
+    // (pixel, imageID) -> indices into dets
+    std::map<std::pair<long int, long int>, std::vector<unsigned int> > buckets;
+    for (unsigned int i = 0; i < dets.size(); i++) {
+        long int pix = healpixAng2PixNest(nside, dets[i].getRA(),
+                                          dets[i].getDec());
+        buckets[std::make_pair(pix, dets[i].getImageID())].push_back(i);
+    }
+
+    std::ofstream indexFile(indexName.c_str());
+    indexFile << "nside " << nside << std::endl;
+    indexFile << std::fixed << std::setprecision(10);
+
+    std::map<std::pair<long int, long int>,
+        std::vector<unsigned int> >::const_iterator bIter;
+    for (bIter = buckets.begin(); bIter != buckets.end(); bIter++) {
+        std::string fileName = bucketFileName(bIter->first.first,
+                                              bIter->first.second);
+        std::string path = joinPath(storeDir, fileName);
+        std::vector<MopsDetection> bucketDets;
+        for (unsigned int i = 0; i < bIter->second.size(); i++) {
+            bucketDets.push_back(dets.at(bIter->second[i]));
+        }
+        double minMJD = bucketDets.at(0).getEpochMJD();
+        double maxMJD = minMJD;
+        for (unsigned int i = 0; i < bucketDets.size(); i++) {
+            minMJD = std::min(minMJD, bucketDets[i].getEpochMJD());
+            maxMJD = std::max(maxMJD, bucketDets[i].getEpochMJD());
+        }
+        std::ofstream out(path.c_str());
+        writeDetsToOutFile(&bucketDets, out);
+        out.close();
+        if (out.fail()) {
+            throw LSST_EXCEPT(FileException, "Failed writing " + path + "\n");
+        }
+        indexFile << bIter->first.first << " " << bIter->first.second << " "
+                  << bIter->second.size() << " " << minMJD << " " << maxMJD
+                  << " " << fileName << "\n";
+    }
+    indexFile.close();
+    if (indexFile.fail()) {
+        throw LSST_EXCEPT(FileException, "Failed writing " + indexName + "\n");
+    }
+}
+
+
+
+
+unsigned int SkyPartitionedDetectionStore::getNside() const
+{
+    return myNside;
+}
+
+
+
+const std::vector<DetectionBucket> &
+SkyPartitionedDetectionStore::getBuckets() const
+{
+    return myBuckets;
+}
+
+
+
+std::vector<long int> SkyPartitionedDetectionStore::getPixels() const
+{
+    std::vector<long int> toRet;
+    for (unsigned int i = 0; i < myBuckets.size(); i++) {
+        toRet.push_back(myBuckets[i].pixel);
+    }
+    std::sort(toRet.begin(), toRet.end());
+    toRet.erase(std::unique(toRet.begin(), toRet.end()), toRet.end());
+    return toRet;
+}
+
+
+
+std::vector<long int> SkyPartitionedDetectionStore::getPixelsInCap(
+    double RA, double Dec, double radius) const
+{
+    std::vector<long int> pixels = getPixels();
+    std::vector<long int> toRet;
+    double maxDist = radius + healpixMaxPixRad(myNside);
+    for (unsigned int i = 0; i < pixels.size(); i++) {
+        double pRA, pDec;
+        healpixPix2AngNest(myNside, pixels[i], pRA, pDec);
+        if (angularDistanceRADec_deg(RA, Dec, pRA, pDec) <= maxDist) {
+            toRet.push_back(pixels[i]);
+        }
+    }
+    return toRet;
+}
+
+
+
+void SkyPartitionedDetectionStore::loadPixels(const std::vector<long int> &pixels,
+                                              std::vector<MopsDetection> &dets,
+                                              double minMJD, double maxMJD) const
+{
+    std::vector<long int> wanted(pixels);
+    std::sort(wanted.begin(), wanted.end());
+
+    for (unsigned int i = 0; i < myBuckets.size(); i++) {
+        const DetectionBucket &b = myBuckets[i];
+        if ((b.maxMJD < minMJD) || (b.minMJD > maxMJD) ||
+            !std::binary_search(wanted.begin(), wanted.end(), b.pixel)) {
+            continue;
+        }
+        std::string path = joinPath(myDir, b.fileName);
+        std::ifstream bucketFile(path.c_str());
+        if (!bucketFile.is_open()) {
+            throw LSST_EXCEPT(FileException, "Could not open " + path + "\n");
+        }
+        std::vector<MopsDetection> bucketDets;
+        populateDetVectorFromFile(bucketFile, bucketDets);
+        for (unsigned int j = 0; j < bucketDets.size(); j++) {
+            double mjd = bucketDets[j].getEpochMJD();
+            if ((mjd >= minMJD) && (mjd <= maxMJD)) {
+                dets.push_back(bucketDets[j]);
+            }
+        }
+    }
+}
+
+
+
+void SkyPartitionedDetectionStore::loadCap(double RA, double Dec, double radius,
+                                           std::vector<MopsDetection> &dets,
+                                           double minMJD, double maxMJD) const
+{
+    loadPixels(getPixelsInCap(RA, Dec, radius), dets, minMJD, maxMJD);
+}
+
+
+
+void SkyPartitionedDetectionStore::loadRegion(long int pixel, double margin,
+                                              std::vector<MopsDetection> &dets,
+                                              double minMJD, double maxMJD) const
+{
+    double RA, Dec;
+    healpixPix2AngNest(myNside, pixel, RA, Dec);
+    loadCap(RA, Dec, healpixMaxPixRad(myNside) + margin, dets, minMJD, maxMJD);
+}
+
+
+
+bool SkyPartitionedDetectionStore::ownsDetection(long int pixel,
+                                                 const MopsDetection &det) const
+{
+    return (healpixAng2PixNest(myNside, det.getRA(), det.getDec()) == pixel);
+}
+
+
+
+}} // close lsst::mops
@@ -184,4 +184,156 @@ bool TrackletVector::operator!=(const TrackletVector &other) const {
 
 
 
+
+
+
+
+PairVector::PairVector(std::string outFileName, bool useCache, unsigned int cacheSize) 
+{
+    if (useCache) {
+        this->useCache = true;
+        this->cacheSize = cacheSize;
+    }
+    else {
+        this->useCache = false;
+        this->cacheSize = 0;        
+    }
+
+    useOutFile = true;
+    outFile.open(outFileName.c_str(), std::ios_base::out | std::ios_base::app);
+}
+
+
+
+
+
+PairVector::~PairVector() 
+{
+    if (useOutFile) {
+        purgeToFile();
+        outFile.close();
+    }
+}
+
+
+
+
+
+void PairVector::purgeToFile() 
+{
+    if (useOutFile) {
+        if (componentPairs.size() != 0) {
+            writeToFile();
+        }        
+    }
+    else {
+        throw LSST_EXCEPT(BadParameterException,
+                          "PairVector: Cannot purge to file in a PairVector created without a file.");
+    }
+
+    if (useCache) {
+        componentPairs.clear();
+    }
+}
+
+
+
+
+
+void PairVector::writeToFile()
+{
+    // same format as writeTrackletsToOutFile, which would write the
+    // (sorted) indices of the equivalent Tracklet.
+    std::vector<Pair>::const_iterator pairIter;
+    for (pairIter = componentPairs.begin(); 
+         pairIter != componentPairs.end(); 
+         pairIter++) {
+        outFile << pairIter->first << " ";
+        if (pairIter->second != pairIter->first) {
+            outFile << pairIter->second << " ";
+        }
+        outFile << '\n';
+    }
+    outFile.flush();
+}
+
+
+
+
+
+void PairVector::push_back(uint32_t index1, uint32_t index2) 
+{
+    if ((useOutFile) && (useCache) && (componentPairs.size() >= cacheSize)) {
+        purgeToFile();
+    }
+
+    if (index1 <= index2) {
+        componentPairs.push_back(Pair(index1, index2));
+    }
+    else {
+        componentPairs.push_back(Pair(index2, index1));
+    }
+}
+
+
+
+
+
+void PairVector::append(const PairVector &other)
+{
+    std::vector<Pair>::const_iterator pairIter;
+    for (pairIter = other.componentPairs.begin(); 
+         pairIter != other.componentPairs.end(); 
+         pairIter++) {
+        push_back(pairIter->first, pairIter->second);
+    }
+}
+
+
+
+
+
+const PairVector::Pair & PairVector::at(unsigned int i) const 
+{
+    if (useCache) {
+      throw LSST_EXCEPT(KnownShortcomingException,  
+                          "PairVector: Cannot call do random access via at() when using output cacheing.");
+    }
+
+    return componentPairs.at(i);
+}
+
+
+
+
+
+unsigned int PairVector::size() const 
+{
+    if (useCache) {
+        throw LSST_EXCEPT(KnownShortcomingException, 
+                          "PairVector: Cannot request 'size' when using cacheing.");
+    }
+
+    return componentPairs.size();
+}
+
+
+
+
+
+void PairVector::toTracklets(TrackletVector &results) const
+{
+    std::vector<Pair>::const_iterator pairIter;
+    for (pairIter = componentPairs.begin(); 
+         pairIter != componentPairs.end(); 
+         pairIter++) {
+        Tracklet newTracklet;
+        newTracklet.indices.insert(pairIter->first);
+        newTracklet.indices.insert(pairIter->second);
+        results.push_back(newTracklet);
+    }
+}
+
+
+
 }} // close namespace lsst::mops
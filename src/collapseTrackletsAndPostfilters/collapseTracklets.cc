@@ -2,10 +2,14 @@
 /* jonathan myers */
 
 
+#include <algorithm>
 #include <cmath>
+#include <iterator>
 #include <istream>
 #include <sstream>
 
+#include <gsl/gsl_fit.h>
+
 #include "lsst/mops/daymops/collapseTrackletsAndPostfilters/collapseTracklets.h"
 #include "lsst/mops/rmsLineFit.h"
 
@@ -13,8 +17,10 @@
 #define IMPOSSIBLY_EARLY_MJD -1.0E16
 #define IMPOSSIBLY_LATE_MJD 1.0E16
 
-// hard to guess an ideal number for this - could use some benchmarks.
-#define MAX_LEAF_SIZE 50 
+// tracklets are parameterized this many at a time; see
+// populateTrackletsForTreeVector.
+#define PARAMETERIZE_BLOCK_SIZE 1024u
+
 
 
 namespace lsst {
@@ -30,6 +36,17 @@ namespace lsst {
 
 
 
+    /* scratch space for the helpers below, which are called for each
+       similar tracklet of each tracklet; reusing it saves building and
+       freeing a set or two per call.  Each thread needs its own. */
+    class CollapseScratch {
+    public:
+        std::vector<unsigned int> indices;
+        std::vector<double> MJDs;
+    };
+
+
+
     /* returns true iff two tracklets are 'compatible', i.e. the set of their
        combined unique detections contains no detections with the same
        observation time. NB: if t1 is detections AB, and t2 is detections AC,
@@ -37,13 +54,15 @@ namespace lsst {
        combined detections are ABC). */
 
     bool trackletsAreCompatible(const std::vector<MopsDetection> * detections,
-                                Tracklet t1, Tracklet t2);
+                                const Tracklet &t1, const Tracklet &t2,
+                                CollapseScratch &scratch);
 
 
 
     /* returns the average of the squared distances of each detection in queryTracklet from
      * the line described by slopeAndOffsetRA, slopeAndOffsetDec. */ 
-    double getAverageSqDist(std::vector<double> slopeAndOffsetRA, std::vector<double> slopeAndOffsetDec,
+    double getAverageSqDist(const std::vector<double> &slopeAndOffsetRA, 
+                            const std::vector<double> &slopeAndOffsetDec,
                             const std::vector<MopsDetection>* allDets, const Tracklet* queryTracklet, 
                             double timeOffset=0.0);
 
@@ -94,22 +113,14 @@ namespace lsst {
         if (smaller->size() > larger->size()) {
             return false;
         }
-
-        std::set<unsigned int> uniqueIndices;
-
-        std::set_union(smaller->begin(), smaller->end(), 
-                       larger->begin(), larger->end(),
-                       std::inserter(uniqueIndices, uniqueIndices.begin()));
-        if (uniqueIndices.size() == larger->size()) {
-            return true;
-        }
-        return false;
-        
+        return std::includes(larger->begin(), larger->end(),
+                             smaller->begin(), smaller->end());
     }
 
 
 
-    double getSqDist(std::vector<double> slopeAndOffsetRA, std::vector<double> slopeAndOffsetDec,
+    double getSqDist(const std::vector<double> &slopeAndOffsetRA, 
+                     const std::vector<double> &slopeAndOffsetDec,
                      const MopsDetection* det, double timeOffset) {
         double mjd = det->getEpochMJD();
         double projectedRA = slopeAndOffsetRA[0]*(mjd - timeOffset) + slopeAndOffsetRA[1];
@@ -125,7 +136,8 @@ namespace lsst {
 
 
 
-    double getAverageSqDist(std::vector<double> slopeAndOffsetRA, std::vector<double> slopeAndOffsetDec,
+    double getAverageSqDist(const std::vector<double> &slopeAndOffsetRA, 
+                            const std::vector<double> &slopeAndOffsetDec,
                             const std::vector<MopsDetection>* allDets, const Tracklet* queryTracklet, 
                             double timeOffset) {
         std::set<unsigned int>::const_iterator iter;
@@ -144,29 +156,24 @@ namespace lsst {
 
 
 
-    bool trackletsAreCompatible(const std::vector<MopsDetection> *detections, Tracklet t1, Tracklet t2) {
-        std::set<unsigned int> uniqueIndices; 
-        std::set<unsigned int>::iterator indexIter;
-        std::set<unsigned int>::iterator uniqueIndicesIter;
+    bool trackletsAreCompatible(const std::vector<MopsDetection> *detections, 
+                                const Tracklet &t1, const Tracklet &t2,
+                                CollapseScratch &scratch) {
         /* get a list of all detections in either tracklet, then get a list of
          * observation times for each tracklet, making sure there are no repeats
-         * in the *observation* times.*/
+         * in the *observation* times.  Tracklets are short, so sorting
+         * a small vector beats building sets.*/
+        scratch.indices.clear();
         std::set_union(t1.indices.begin(), t1.indices.end(), t2.indices.begin(), t2.indices.end(),
-                       std::inserter(uniqueIndices, uniqueIndices.begin()));
-
-        std::set<double> representedMJDs;
+                       std::back_inserter(scratch.indices));
 
-        for (uniqueIndicesIter = uniqueIndices.begin(); uniqueIndicesIter != uniqueIndices.end(); 
-             uniqueIndicesIter++) {
-            double thisMJD = (*detections)[*uniqueIndicesIter].getEpochMJD();
-            if (representedMJDs.insert(thisMJD).second == false) {
-                /* insert failed because MJD is already there.*/
-                return false;
-            };
+        scratch.MJDs.clear();
+        for (unsigned int i = 0; i < scratch.indices.size(); i++) {
+            scratch.MJDs.push_back((*detections)[scratch.indices[i]].getEpochMJD());
         }
-        /* if we got this far without returning false, then all unique
-         * detections came from separate times */
-        return true;
+        std::sort(scratch.MJDs.begin(), scratch.MJDs.end());
+        return (std::adjacent_find(scratch.MJDs.begin(), scratch.MJDs.end()) 
+                == scratch.MJDs.end());
     }
 
 
@@ -175,28 +182,463 @@ namespace lsst {
     void collapse(Tracklet &t1, Tracklet& t2) {
         t1.isCollapsed = true;
         t2.isCollapsed = true;
-        std::set<unsigned int> uniqueIndices; 
-        std::set_union(t1.indices.begin(), t1.indices.end(), t2.indices.begin(), t2.indices.end(),
-                       std::inserter(uniqueIndices, uniqueIndices.begin()));
-        t2.indices = uniqueIndices;
+        t2.indices.insert(t1.indices.begin(), t1.indices.end());
     }
 
 
 
 
-    Tracklet unionTracklets(Tracklet t1, Tracklet t2) {
+    Tracklet unionTracklets(const Tracklet &t1, const Tracklet &t2) {
         Tracklet toRet;
-        std::set<unsigned int> uniqueIndices; 
-        std::set_union(t1.indices.begin(), t1.indices.end(), t2.indices.begin(), t2.indices.end(),
-                       std::inserter(uniqueIndices, uniqueIndices.begin()));
-        toRet.indices = uniqueIndices;
+        toRet.indices = t1.indices;
+        toRet.indices.insert(t2.indices.begin(), t2.indices.end());
         toRet.isCollapsed = false;
         return toRet;
     }
+
+
+
+
     
 
 
 
+
+
+
+    /* the options to doCollapsingPopulateOutputVector which matter to
+       collapsing one seed tracklet. */
+    class CollapseOptions {
+    public:
+        std::vector<double> tolerances;
+        std::vector<GeometryType> geometryTypes;
+        bool useMinimumRMS;
+        bool useBestFit;
+        bool useRMSFilt;
+        double maxRMS;
+    };
+
+
+
+    /* the similar tracklets of a run of seeds: for each, the results
+       of searching the KDTree around it, as indices into pairs in the
+       order the search found them.  Seed s of the run (counting from
+       0) has neighbours [begin(s), end(s)).  A seed collapsed before
+       the run was searched has none, since it won't be a seed. */
+    class NeighbourGraph {
+    public:
+        const unsigned int *begin(unsigned int s) const {
+            return neighbourStart() + offsets[s];
+        }
+        const unsigned int *end(unsigned int s) const {
+            return neighbourStart() + offsets[s + 1];
+        }
+
+        std::vector<unsigned int> offsets;
+        std::vector<unsigned int> neighbours;
+
+    private:
+        const unsigned int *neighbourStart() const {
+            return neighbours.empty() ? NULL : &neighbours[0];
+        }
+    };
+
+
+
+    /* what collapsing one seed tracklet gives: the new tracklet and
+       the tracklets of pairs it absorbed (the seed first). */
+    class SeedResult {
+    public:
+        Tracklet tracklet;
+        std::vector<unsigned int> absorbed;
+
+        void clear() {
+            tracklet = Tracklet();
+            absorbed.clear();
+        }
+
+        void absorb(const std::vector<Tracklet> &pairs, unsigned int i) {
+            tracklet.isCollapsed = true;
+            tracklet.indices.insert(pairs[i].indices.begin(), pairs[i].indices.end());
+            if (absorbed.empty() || (absorbed.back() != i)) {
+                absorbed.push_back(i);
+            }
+        }
+    };
+
+
+
+    /* a seed tracklet being grown by a CollapseStrategy, and its
+     * candidates: those of its similar tracklets which hadn't been
+     * collapsed when it started.
+     *
+     * Each detection of the candidates gets a slot, so that which of
+     * them the tracklet has, and their squared distances from the
+     * current fit, are array lookups.  A distance is kept until the
+     * fit changes.  A candidate found incompatible stays so, since
+     * the tracklet only grows.  Reuse one of these (one per thread)
+     * for many seeds to save reallocating it.
+     */
+    class CollapseSeed {
+    public:
+        void start(const std::vector<MopsDetection> *detectionsIn,
+                   const std::vector<Tracklet> &pairsIn,
+                   unsigned int seedID,
+                   const unsigned int *neighboursBegin,
+                   const unsigned int *neighboursEnd,
+                   SeedResult &resultIn) {
+            detections = detectionsIn;
+            pairs = &pairsIn;
+            result = &resultIn;
+            result->clear();
+            result->absorb(*pairs, seedID);
+
+            candidates.clear();
+            for (const unsigned int *n = neighboursBegin; n != neighboursEnd; n++) {
+                if ((!(*pairs)[*n].isCollapsed) && (*n != seedID)) {
+                    candidates.push_back(*n);
+                }
+            }
+            closed.assign(candidates.size(), 0);
+
+            slotDets.clear();
+            for (unsigned int c = 0; c < candidates.size(); c++) {
+                const std::set<unsigned int> &dets = candidate(c).indices;
+                slotDets.insert(slotDets.end(), dets.begin(), dets.end());
+            }
+            std::sort(slotDets.begin(), slotDets.end());
+            slotDets.erase(std::unique(slotDets.begin(), slotDets.end()), slotDets.end());
+            slotStart.resize(candidates.size() + 1);
+            slots.clear();
+            for (unsigned int c = 0; c < candidates.size(); c++) {
+                slotStart[c] = slots.size();
+                const std::set<unsigned int> &dets = candidate(c).indices;
+                for (std::set<unsigned int>::const_iterator detIter = dets.begin();
+                     detIter != dets.end(); detIter++) {
+                    slots.push_back(slotOf(*detIter));
+                }
+            }
+            slotStart[candidates.size()] = slots.size();
+
+            inTracklet.assign(slotDets.size(), 0);
+            sqDists.resize(slotDets.size());
+            sqDistFitVersion.assign(slotDets.size(), 0);
+            fitVersion = 1;
+            currentFit = LinearFitAccumulator();
+            const std::set<unsigned int> &seedDets = tracklet().indices;
+            for (std::set<unsigned int>::const_iterator detIter = seedDets.begin();
+                 detIter != seedDets.end(); detIter++) {
+                currentFit.add((*detections)[*detIter]);
+                std::vector<unsigned int>::iterator slotIter = 
+                    std::lower_bound(slotDets.begin(), slotDets.end(), *detIter);
+                if ((slotIter != slotDets.end()) && (*slotIter == *detIter)) {
+                    inTracklet[slotIter - slotDets.begin()] = 1;
+                }
+            }
+        }
+
+        const Tracklet &tracklet() const { return result->tracklet; }
+
+        /* the running fit to tracklet(). */
+        const LinearFitAccumulator &fit() const { return currentFit; }
+
+        unsigned int numCandidates() const { return candidates.size(); }
+
+        const Tracklet &candidate(unsigned int c) const {
+            return (*pairs)[candidates[c]];
+        }
+
+        /* true iff candidate c hasn't been absorbed or passed over,
+           and is compatible with tracklet(). */
+        bool isOpen(unsigned int c) {
+            if (closed[c]) {
+                return false;
+            }
+            if (!trackletsAreCompatible(detections, candidate(c), tracklet(), scratch)) {
+                closed[c] = 1;
+                return false;
+            }
+            return true;
+        }
+
+        /* leave candidate c out of this tracklet for good. */
+        void close(unsigned int c) { closed[c] = 1; }
+
+        /* fitOut = fit(), plus the detections of candidate c which
+           tracklet() doesn't have. */
+        void fitWith(unsigned int c, LinearFitAccumulator &fitOut) const {
+            fitOut = currentFit;
+            for (unsigned int i = slotStart[c]; i < slotStart[c + 1]; i++) {
+                if (!inTracklet[slots[i]]) {
+                    fitOut.add((*detections)[slotDets[slots[i]]]);
+                }
+            }
+        }
+
+        /* the sum of the squared distances from fit() of the
+           detections of candidate c which tracklet() doesn't have,
+           over one more than their number. */
+        double newDetsSqDistOverCount(unsigned int c) {
+            double netSqDist = 0;
+            unsigned int newDets = 1;
+            for (unsigned int i = slotStart[c]; i < slotStart[c + 1]; i++) {
+                unsigned int slot = slots[i];
+                if (!inTracklet[slot]) {
+                    newDets++;
+                    if (sqDistFitVersion[slot] != fitVersion) {
+                        sqDists[slot] = currentFit.sqDist((*detections)[slotDets[slot]]);
+                        sqDistFitVersion[slot] = fitVersion;
+                    }
+                    netSqDist += sqDists[slot];
+                }
+            }
+            return netSqDist / newDets;
+        }
+
+        /* add candidate c to tracklet(). */
+        void absorb(unsigned int c) {
+            LinearFitAccumulator newFit;
+            fitWith(c, newFit);
+            currentFit = newFit;
+            fitVersion++;
+            for (unsigned int i = slotStart[c]; i < slotStart[c + 1]; i++) {
+                inTracklet[slots[i]] = 1;
+            }
+            result->absorb(*pairs, candidates[c]);
+            closed[c] = 1;
+        }
+
+    private:
+        unsigned int slotOf(unsigned int det) const {
+            return std::lower_bound(slotDets.begin(), slotDets.end(), det) - slotDets.begin();
+        }
+
+        const std::vector<MopsDetection> *detections;
+        const std::vector<Tracklet> *pairs;
+        SeedResult *result;
+        CollapseScratch scratch;
+        std::vector<unsigned int> candidates;
+        std::vector<char> closed;
+        // the detection of each slot, in order.
+        std::vector<unsigned int> slotDets;
+        // the slots of candidate c are slots[slotStart[c]] .. slots[slotStart[c+1] - 1].
+        std::vector<unsigned int> slotStart;
+        std::vector<unsigned int> slots;
+        std::vector<char> inTracklet;
+        // sqDists[s] is good if sqDistFitVersion[s] == fitVersion.
+        std::vector<double> sqDists;
+        std::vector<unsigned int> sqDistFitVersion;
+        unsigned int fitVersion;
+        LinearFitAccumulator currentFit;
+    };
+
+
+
+    /* a way of choosing which candidates a seed tracklet takes in.
+     * To add one, subclass this and have newCollapseStrategy return
+     * it for some options. */
+    class CollapseStrategy {
+    public:
+        virtual ~CollapseStrategy() {}
+        virtual void grow(CollapseSeed &seed) const = 0;
+    };
+
+
+
+    /* take each compatible candidate in the order found.
+     *
+     * NB: the RMS filter has never applied here: the check was made
+     * on the tracklet as it was before the candidate was absorbed,
+     * and the candidate was absorbed either way.  It is left out
+     * rather than changing what this gives. */
+    class GreedyCollapseStrategy : public CollapseStrategy {
+    public:
+        void grow(CollapseSeed &seed) const {
+            for (unsigned int c = 0; c < seed.numCandidates(); c++) {
+                if (seed.isOpen(c)) {
+                    seed.absorb(c);
+                }
+            }
+        }
+    };
+
+
+
+    /* until no work is done: check the RMS of the current tracklet
+     * combined with each candidate.  Choose the "best" option and
+     * collapse that into the current tracklet. repeat. */
+    class MinimumRMSCollapseStrategy : public CollapseStrategy {
+    public:
+        MinimumRMSCollapseStrategy(bool useRMSFilt, double maxRMS)
+            : useRMSFilt(useRMSFilt), maxRMS(maxRMS) {}
+
+        void grow(CollapseSeed &seed) const {
+            bool done = false;
+            LinearFitAccumulator tmpFit;
+            while (done == false) {
+                bool foundOne = false;
+                double bestMatchRMS = 1337;
+                unsigned int bestMatch = 0;
+                for (unsigned int c = 0; c < seed.numCandidates(); c++) {
+                    if (seed.isOpen(c)) {
+                        seed.fitWith(c, tmpFit);
+                        double tmpRMS = tmpFit.rms();
+                        if ((useRMSFilt == false) || (tmpRMS <= maxRMS)) {
+                            if ((foundOne == false) || (bestMatchRMS > tmpRMS)) {
+                                foundOne = true;
+                                bestMatchRMS = tmpRMS;
+                                bestMatch = c;
+                            }
+                        }
+                    }
+                }
+                if (foundOne == true) {
+                    seed.absorb(bestMatch);
+                }
+                else {
+                    /* found no allowable matches*/
+                    done = true;
+                }
+            }
+        }
+
+    private:
+        bool useRMSFilt;
+        double maxRMS;
+    };
+
+
+
+    /* until no work is done: find the candidate whose new detections
+     * are closest to the current tracklet's line.  Collapse that
+     * candidate into the current one, unless that takes it over the
+     * RMS limit, in which case stop.  Repeat. */
+    class BestFitCollapseStrategy : public CollapseStrategy {
+    public:
+        BestFitCollapseStrategy(bool useRMSFilt, double maxRMS)
+            : useRMSFilt(useRMSFilt), maxRMS(maxRMS) {}
+
+        void grow(CollapseSeed &seed) const {
+            bool done = false;
+            while (done == false) {
+                bool foundOne = false;
+                double bestMatchAvSqDist = 1337;
+                unsigned int bestMatch = 0;
+                for (unsigned int c = 0; c < seed.numCandidates(); c++) {
+                    if (seed.isOpen(c)) {
+                        double avSqDist = seed.newDetsSqDistOverCount(c);
+                        if ((foundOne == false) || (avSqDist < bestMatchAvSqDist)) {
+                            foundOne = true;
+                            bestMatchAvSqDist = avSqDist;
+                            bestMatch = c;
+                        }
+                    }
+                }
+                if (foundOne == true) {
+                    // if the tracklet + best match has higher RMS than filter allows, we're done!
+                    LinearFitAccumulator tmpFit;
+                    seed.fitWith(bestMatch, tmpFit);
+                    if ((useRMSFilt == true) && (tmpFit.rms() > maxRMS)) {
+                        done = true;
+                    }
+                    else { /* we got a result, and it was legal */
+                        seed.absorb(bestMatch);
+                    }
+                }
+                else {
+                    /* found no allowable matches */
+                    done = true;
+                }
+            }
+        }
+
+    private:
+        bool useRMSFilt;
+        double maxRMS;
+    };
+
+
+
+    /* the strategy options asks for; the caller deletes it. */
+    const CollapseStrategy *newCollapseStrategy(const CollapseOptions &options) {
+        if (options.useMinimumRMS) {
+            return new MinimumRMSCollapseStrategy(options.useRMSFilt, options.maxRMS);
+        }
+        if (options.useBestFit) {
+            return new BestFitCollapseStrategy(options.useRMSFilt, options.maxRMS);
+        }
+        return new GreedyCollapseStrategy();
+    }
+
+
+
+    /* collapse the seed tracklet pairs[seedID] with those of its
+     * neighbours [neighboursBegin, neighboursEnd) which haven't been
+     * collapsed yet, leaving the output in result.  pairs is only
+     * read; commitSeed marks the absorbed tracklets as collapsed.  So
+     * long as none of the neighbours are collapsed in between, the
+     * result is just what it would have been had the two been done
+     * together.
+     */
+    void collapseSeed(const std::vector<MopsDetection> *detections,
+                      const std::vector<Tracklet> &pairs,
+                      unsigned int seedID,
+                      const unsigned int *neighboursBegin,
+                      const unsigned int *neighboursEnd,
+                      const CollapseStrategy &strategy,
+                      CollapseSeed &seed,
+                      SeedResult &result) {
+        /* the new tracklet which will be output starts as the seed,
+           marked as collapsed already, and so will be the seed
+           tracklet from pairs.  This way we won't bother trying to
+           collapse this tracklet again - if we don't get it now, it
+           won't happen later, either. */
+        seed.start(detections, pairs, seedID, neighboursBegin, neighboursEnd, result);
+        strategy.grow(seed);
+    }
+
+
+
+    /* mark the tracklets result absorbed as collapsed and output its
+       tracklet. */
+    void commitSeed(std::vector<Tracklet> &pairs, const SeedResult &result,
+                    std::vector<Tracklet> &collapsedPairs) {
+        for (unsigned int i = 0; i < result.absorbed.size(); i++) {
+            pairs[result.absorbed[i]].isCollapsed = true;
+        }
+        collapsedPairs.push_back(result.tracklet);
+    }
+
+
+
+    /* search for the similar tracklets of seeds [first, last) of
+       trackletsForTree. */
+    void buildNeighbourGraph(const std::vector<Tracklet> &pairs,
+                             const KDTree<unsigned int> &searchTree,
+                             const std::vector<PointAndValue<unsigned int> > &trackletsForTree,
+                             unsigned int first, unsigned int last,
+                             const CollapseOptions &options,
+                             NeighbourGraph &graph) {
+        graph.offsets.resize(last - first + 1);
+        graph.neighbours.clear();
+        for (unsigned int ti = first; ti < last; ti++) {
+            graph.offsets[ti - first] = graph.neighbours.size();
+            if (pairs[trackletsForTree[ti].getValue()].isCollapsed == false) {
+                std::vector<PointAndValue<unsigned int> > queryResults = 
+                    searchTree.hyperRectangleSearch(trackletsForTree[ti].getPoint(), 
+                                                    options.tolerances, 
+                                                    options.geometryTypes);
+                for (unsigned int ri = 0; ri < queryResults.size(); ri++) {
+                    graph.neighbours.push_back(queryResults[ri].getValue());
+                }
+            }
+        }
+        graph.offsets[last - first] = graph.neighbours.size();
+    }
+
+
+
+
   
     /*
      * given vector detections and pairs, a vector of vectors of indices into
@@ -211,22 +653,27 @@ namespace lsst {
         std::vector<Tracklet> &collapsedPairs,       
         bool useMinimumRMS, bool useBestFit, 
         bool useRMSFilt,
-        double maxRMS, bool beVerbose) {
+        double maxRMS, bool beVerbose,
+        unsigned int maxLeafSize) {
 
         /* each t in trackletsForTree maps tracklet physical parameters (RA0,
          * Dec0, angle, vel.) to an index into pairs. */
         std::vector<PointAndValue <unsigned int> >
             trackletsForTree;
-        std::vector<PointAndValue<unsigned int> >::iterator trackletIter;
-        std::vector<PointAndValue<unsigned int> >::iterator similarTrackletIter;
 
-        std::vector<GeometryType> geometryTypes(4);
+        CollapseOptions options;
+        options.tolerances = tolerances;
+        options.useMinimumRMS = useMinimumRMS;
+        options.useBestFit = useBestFit;
+        options.useRMSFilt = useRMSFilt;
+        options.maxRMS = maxRMS;
+        options.geometryTypes.resize(4);
         /* RA0, Dec0, and angle are all degree measures along [0,360).
 	   Velocity is purely euclidean.*/
-        geometryTypes[0] = CIRCULAR_DEGREES;
-        geometryTypes[1] = CIRCULAR_DEGREES;
-        geometryTypes[2] = CIRCULAR_DEGREES;
-        geometryTypes[3] = EUCLIDEAN;
+        options.geometryTypes[0] = CIRCULAR_DEGREES;
+        options.geometryTypes[1] = CIRCULAR_DEGREES;
+        options.geometryTypes[2] = CIRCULAR_DEGREES;
+        options.geometryTypes[3] = EUCLIDEAN;
 
         if (beVerbose) {
             std::cout << "Extrapolating linear movement functions for each tracklet." << std::endl;
@@ -237,190 +684,29 @@ namespace lsst {
             
             std::cout << "Building KDTree of all tracklets.." << std::endl;
         }
-        KDTree<unsigned int> searchTree(trackletsForTree, 4, MAX_LEAF_SIZE);       
+        KDTree<unsigned int> searchTree(trackletsForTree, 4, maxLeafSize);       
         if (beVerbose) {
             std::cout << "done." << std::endl;
             std::cout << "Doing many, many tree queries and collapses..." << std::endl;
         }
-        unsigned int trackletCount = 0;
-        for (trackletIter = trackletsForTree.begin(); 
-             trackletIter != trackletsForTree.end();
-             trackletIter++) {
-            trackletCount++;
+        const CollapseStrategy *strategy = newCollapseStrategy(options);
+        /* search for one seed's similar tracklets at a time, so no
+           search is wasted on a tracklet collapsed before its turn. */
+        NeighbourGraph graph;
+        CollapseSeed seed;
+        SeedResult result;
+        for (unsigned int i = 0; i < trackletsForTree.size(); i++) {
             /* don't collapse a given tracklet twice */
-            if (pairs[trackletIter->getValue()].isCollapsed == false) {
-                
-                /* create a new tracklet which will be output. it is marked as
-                   collapsed already, and so will be the current tracklet from
-                   pairs.  This way we won't bother trying to collapse this tracklet again - 
-                   if we don't get it now, it won't happen later, either. */
-                Tracklet newTracklet;
-                collapse(pairs[trackletIter->getValue()], newTracklet);
-
-                /* find all similar tracklets */
-                std::vector<PointAndValue<unsigned int> > queryResults = 
-                    searchTree.hyperRectangleSearch((*trackletIter).getPoint(), 
-                                                    tolerances, 
-                                                    geometryTypes);
-                
-
-
-                if (useMinimumRMS) {
-                    bool done = false;
-                    /* until no work is done: check the RMS of the current
-                     * tracklet combined with the each similar tracklet.  Choose
-                     * the "best" option and collapse that into the current
-                     * tracklet. repeat.
-                     */
-                    while (done == false) {
-                        bool foundOne = false;
-                        double bestMatchRMS = 1337;
-                        unsigned int bestMatchID = 1337;
-                        for (similarTrackletIter = queryResults.begin();
-                             similarTrackletIter != queryResults.end();
-                             similarTrackletIter++) {
-                            /* try combining the current tracklet with each
-                               similar tracklet and getting an RMS value. */
-                            unsigned int similarTrackletID = similarTrackletIter->getValue();			    
-			    if ((pairs[similarTrackletID].isCollapsed == false) && 
-                                (trackletsAreCompatible(detections, pairs[similarTrackletID], newTracklet))) {
-                                Tracklet tmp = unionTracklets(newTracklet, pairs[similarTrackletID]);
-                                double tmpRMS = rmsForTracklet(tmp, detections);
-                               if ((useRMSFilt == false) || 
-                                    (tmpRMS <= maxRMS)) {
-                                    if ((foundOne == false) || (bestMatchRMS > tmpRMS)) {
-                                        foundOne = true;
-                                        bestMatchRMS = tmpRMS;
-                                        bestMatchID = similarTrackletID;
-                                    }
-                                }
-                            }
-                        }
-                        if (foundOne == true) {
-                            collapse(pairs[bestMatchID], newTracklet);
-                        }
-                        else {
-                            /* found no allowable matches*/
-                            done = true;
-                        }
-                    }
-                }
-                else if (useBestFit) {
-                    bool done = false;
-                    /* until no work is done: get the best-fit equation for the
-                     * current concept of the tracklet.  Find the legal similar
-                     * tracklet whose detections are closest to the current
-                     * conception of the line (if one exists).  Collapse that
-                     * tracklet into the current one.  Repeat.
-                     */
-                    while (done == false) {
-                        bool foundOne = false;
-                        double bestMatchAvSqDist = 1337;
-                        unsigned int bestMatchID = 1337;
-                        std::vector <double> currentRAFunc;
-                        std::vector <double> currentDecFunc;
-                        std::vector <MopsDetection> trackletDets;
-                        std::set<unsigned int>::iterator detIter;
-                        for (detIter = newTracklet.indices.begin(); 
-                             detIter != newTracklet.indices.end(); 
-                             detIter++) {
-                            trackletDets.push_back((*detections)[*detIter]);
-                        }
-                        double t0 = (*detections)[*newTracklet.indices.begin()].getEpochMJD();
-                        leastSquaresSolveForRADecLinear(&trackletDets, currentRAFunc, 
-                                                                    currentDecFunc, t0);
-
-                        for (similarTrackletIter = queryResults.begin();
-                             similarTrackletIter != queryResults.end();
-                             similarTrackletIter++) {
-                            /* find the similar tracklet closest to the current line. */
-                            unsigned int similarTrackletID = similarTrackletIter->getValue();
-                            const Tracklet* similarTracklet = &pairs[similarTrackletID];
-                            std::map<unsigned int, double> detIDToSqDist;
-                            if ((pairs[similarTrackletID].isCollapsed == false) && 
-                                (trackletsAreCompatible(detections, *similarTracklet, newTracklet))) {
-                                double netSqDist = 0;
-                                unsigned int newDets = 1;
-                                for (std::set<unsigned int>::const_iterator sIter=similarTracklet->indices.begin();
-                                     sIter != similarTracklet->indices.end(); sIter++) {
-                                    if (newTracklet.indices.find(*sIter) == newTracklet.indices.end()) {
-                                        // this detection is not already in our current tracklet
-                                        newDets++;
-                                        if (detIDToSqDist.find(*sIter) != detIDToSqDist.end()) {
-                                            // look it up
-                                            netSqDist += detIDToSqDist[*sIter];
-                                        }
-                                        else {
-                                            //calculate it and save it
-                                            double newSqDist = getSqDist(currentRAFunc, currentDecFunc, 
-                                                                         &((*detections)[*sIter]), t0);
-                                            detIDToSqDist.insert(std::make_pair(*sIter, newSqDist));
-                                            netSqDist += newSqDist;
-                                        }
-                                    }
-                                }
-                                double avSqDist = netSqDist / newDets;
-                                if ((foundOne == false) || (avSqDist < bestMatchAvSqDist)) {
-                                    foundOne = true;
-                                    bestMatchAvSqDist = avSqDist;
-                                    bestMatchID = similarTrackletID;
-                                }
-                            }
-                        }
-                        if (foundOne == true) {
-                            // if newTracklet + best match has higher RMS than filter allows, we're done!
-                            Tracklet tmp = unionTracklets(newTracklet, pairs[bestMatchID]);
-                            double tmpRMS = rmsForTracklet(tmp, detections);
-                            if ((useRMSFilt == true) && (tmpRMS >  maxRMS)) {
-                                done = true;
-                            }
-                            else { /* we got a result, and it was legal */
-                                collapse(pairs[bestMatchID], newTracklet);
-                            }
-                        }
-                        else {
-                            /* found no allowable matches */
-                            done = true;
-                        }
-                    }
-                }
-                else {
-                    /* be greedy - try tracklets without much discriminiation */
-                    for (similarTrackletIter = queryResults.begin();
-                         similarTrackletIter != queryResults.end();
-                         similarTrackletIter++) {
-                        /* if tracklet is similar, has not already been collapsed,
-                           not == query tracklet, and compatible with this tracklet
-                           so far, then go ahead and collapse them together
-                           greedily. */
-                        Tracklet similarTracklet = pairs[similarTrackletIter->getValue()];
-                        if ((similarTrackletIter->getValue() != trackletIter->getValue()) 
-                            &&
-                            (similarTracklet.isCollapsed == false)
-                            && 
-                            (trackletsAreCompatible(detections, similarTracklet, newTracklet))) {
-                            bool collapseIsLegal = true;
-                            if (useRMSFilt) {
-                                /* check that this is a 'good enough' fit to use. */
-                                Tracklet tmp = newTracklet;
-                                /* subtly abuse the 'collapse' function as a union operation */
-                                collapse(pairs[similarTrackletIter->getValue()], newTracklet);
-                                if (rmsForTracklet(tmp, detections) > maxRMS) {
-                                    collapseIsLegal = false;
-                                }
-                            }
-                            if (collapseIsLegal) {
-                                collapse(pairs[similarTrackletIter->getValue()], newTracklet);
-                            }
-                        }
-                    }                        
-                }
-
+            if (pairs[trackletsForTree[i].getValue()].isCollapsed == false) {
+                buildNeighbourGraph(pairs, searchTree, trackletsForTree, i, i + 1,
+                                    options, graph);
+                collapseSeed(detections, pairs, trackletsForTree[i].getValue(),
+                             graph.begin(0), graph.end(0), *strategy, seed, result);
                 /* this tracklet is valid output. */
-                collapsedPairs.push_back(newTracklet);
-            } /* end 'if (pairs[trackletIter->getValue().isCollapsed == false) */
-        
-        } /* end 'for (trackletIter in trackletsForTree... ) */
+                commitSeed(pairs, result, collapsedPairs);
+            }
+        }
+        delete strategy;
 
         /* temporary sanity check */
 
@@ -448,31 +734,121 @@ namespace lsst {
 
 
 
+    /*
+     * the detections of a block of tracklets, laid out as flat arrays
+     * so the whole block can be parameterized in one pass without
+     * building a vector<MopsDetection> per tracklet.  Tracklet i of the
+     * block has detections [start[i], start[i+1]).  Times are
+     * relative to the normalTime given to fillTrackletDetArrays, and
+     * each tracklet's RAs and Decs have been moved into a contiguous <
+     * 180 degree range as by leastSquaresSolveForRADecLinear.
+     */
+    class TrackletDetArrays {
+    public:
+        std::vector<unsigned int> start;
+        std::vector<double> MJDs;
+        std::vector<double> RAs;
+        std::vector<double> Decs;
+    };
+
+
+
+    /* as make180To360Negative in rmsLineFit, on the range [first, last). */
+    void moveToContiguousRange(double *first, double *last) {
+        if (*std::max_element(first, last) - *std::min_element(first, last) <= 180.) {
+            return;
+        }
+        for (double *iter = first; iter != last; iter++) {
+            if (*iter > 180) {
+                *iter = *iter - 360;
+            }
+        }
+        if (*std::max_element(first, last) - *std::min_element(first, last) > 180.) {
+            throw LSST_EXCEPT(ProgrammerErrorException, 
+                              "EE: Unexpected coding error: could not move data into a contiguous < 180 degree range.\n");
+        }
+    }
+
+
+
+    /* put the detections of tracklets [first, last) in arrays. */
+    void fillTrackletDetArrays(const std::vector<MopsDetection> *detections,
+                               const std::vector<Tracklet> *tracklets,
+                               unsigned int first, unsigned int last,
+                               double normalTime,
+                               TrackletDetArrays &arrays) {
+        arrays.start.clear();
+        arrays.MJDs.clear();
+        arrays.RAs.clear();
+        arrays.Decs.clear();
+        std::set<unsigned int>::const_iterator indicesIter;
+        for (unsigned int i = first; i < last; i++) {
+            const Tracklet &t = (*tracklets)[i];
+            unsigned int trackletStart = arrays.MJDs.size();
+            arrays.start.push_back(trackletStart);
+            for (indicesIter = t.indices.begin(); 
+                 indicesIter != t.indices.end();
+                 indicesIter++) {
+                const MopsDetection &det = (*detections)[*indicesIter];
+                arrays.MJDs.push_back(det.getEpochMJD() - normalTime);
+                arrays.RAs.push_back(det.getRA());
+                arrays.Decs.push_back(det.getDec());
+            }
+            if (arrays.MJDs.size() > trackletStart) {
+                moveToContiguousRange(&arrays.RAs[trackletStart], 
+                                      &arrays.RAs[0] + arrays.RAs.size());
+                moveToContiguousRange(&arrays.Decs[trackletStart],
+                                      &arrays.Decs[0] + arrays.Decs.size());
+            }
+        }
+        arrays.start.push_back(arrays.MJDs.size());
+    }
+
+
 
   /*
-   * set define t = 0 as normalTime, so all times in the detections
-   * are offsets thereof.  Then find best-fit function for mapping
-   * time to RA and Dec (in deg).  Extrapolate RA, Dec at t=0; also
-   * find the angle above RA = 0, Dec=t and the velocity in deg/day of
-   * the tracklet.  These three will be our "point" in space.
+   * given the detections of a tracklet (as laid out by
+   * fillTrackletDetArrays, so times are offsets from normalTime),
+   * find best-fit function for mapping time to RA and Dec (in deg).
+   * Extrapolate RA, Dec at t=0; also find the angle above RA = 0,
+   * Dec=t and the velocity in deg/day of the tracklet.  These three
+   * will be our "point" in space.
+   *
+   * Nearly all tracklets are pairs, and the best-fit line through two
+   * points is just the line through them, so those skip the general
+   * least-squares fit.
    * 
-   * ASSUME that physicalParams was allocated with 4 slots.
+   * ASSUME that motionVector was allocated with 4 slots.
    */
-    void parameterize(const std::vector<MopsDetection> *trackletDets,
-                      std::vector<double> &motionVector,
-                      double normalTime) {
-        std::vector<double> RASlopeAndOffset;
-        std::vector<double> DecSlopeAndOffset;
-        
+    void parameterize(const double *MJDs, const double *RAs, const double *Decs,
+                      unsigned int numDets, std::vector<double> &motionVector) {
+        double RAv, RA0, Decv, Dec0;
+
+        if ((numDets == 2) && (MJDs[1] != MJDs[0])) {
+            // as gsl_fit_linear: offset = mean(y) - slope * mean(t)
+            double dt = MJDs[1] - MJDs[0];
+            double meanT = MJDs[0] + dt / 2.;
+            RAv = (RAs[1] - RAs[0]) / dt;
+            Decv = (Decs[1] - Decs[0]) / dt;
+            RA0 = RAs[0] + (RAs[1] - RAs[0]) / 2. - RAv * meanT;
+            Dec0 = Decs[0] + (Decs[1] - Decs[0]) / 2. - Decv * meanT;
+        }
+        else {
+            int gslRV = 0;
+            double cov00, cov01, cov11, sumsq;
+            gslRV += gsl_fit_linear(MJDs, 1, RAs, 1, numDets, &RA0, &RAv, 
+                                    &cov00, &cov01, &cov11, &sumsq);
+            gslRV += gsl_fit_linear(MJDs, 1, Decs, 1, numDets, &Dec0, &Decv, 
+                                    &cov00, &cov01, &cov11, &sumsq);
+            if (gslRV != 0) {
+                throw LSST_EXCEPT(GSLException, "EE: gsl_fit_linear unexpectedly returned error.\n");
+            }
+        }
 
         // physical params 0, 1 are initial RA, initial Dec at normalTime.
-        leastSquaresSolveForRADecLinear(trackletDets, RASlopeAndOffset, DecSlopeAndOffset,
-                                                    normalTime);
-        motionVector[0] = convertToStandardDegrees(RASlopeAndOffset[1]);
-        motionVector[1] = convertToStandardDegrees(DecSlopeAndOffset[1]);
-        double RAv = RASlopeAndOffset[0];
-        double Decv = DecSlopeAndOffset[0];
-        double velocity = sqrt(pow(RAv, 2) + pow(Decv, 2));
+        motionVector[0] = convertToStandardDegrees(RA0);
+        motionVector[1] = convertToStandardDegrees(Dec0);
+        double velocity = sqrt(RAv*RAv + Decv*Decv);
         if (velocity != 0) {
             motionVector[3] = velocity;
             double sineOfTheta = Decv/velocity;
@@ -517,36 +893,39 @@ namespace lsst {
                                                            &trackletsForTree) {
         
         double midPointTime = getMidPointTime(detections);
-        std::vector<Tracklet>::const_iterator trackletIter;
-        std::set<unsigned int>::iterator indicesIter;
-
-        unsigned int i = 0;
-        for (trackletIter = (*tracklets).begin(); trackletIter != (*tracklets).end(); trackletIter++) {
-            PointAndValue <unsigned int> curTracklet;
+        unsigned int numTracklets = tracklets->size();
+        unsigned int firstOut = trackletsForTree.size();
+        int numBlocks = (numTracklets + PARAMETERIZE_BLOCK_SIZE - 1) / PARAMETERIZE_BLOCK_SIZE;
+        trackletsForTree.resize(firstOut + numTracklets);
+        {
+            TrackletDetArrays arrays;
             std::vector<double> motionVector(4); /* will hold RA0, Dec0, angle, velocity */
-            std::vector<MopsDetection> trackletDets;
-
-            for (indicesIter = trackletIter->indices.begin(); 
-                 indicesIter != trackletIter->indices.end();
-                 indicesIter++) {
-                trackletDets.push_back((*detections)[*indicesIter]);
+            for (int block = 0; block < numBlocks; block++) {
+                unsigned int first = block * PARAMETERIZE_BLOCK_SIZE;
+                unsigned int last = std::min(first + PARAMETERIZE_BLOCK_SIZE, numTracklets);
+                fillTrackletDetArrays(detections, tracklets, first, last,
+                                      midPointTime, arrays);
+                for (unsigned int i = first; i < last; i++) {
+                    unsigned int s = arrays.start[i - first];
+                    parameterize(&arrays.MJDs[0] + s, &arrays.RAs[0] + s, 
+                                 &arrays.Decs[0] + s,
+                                 arrays.start[i - first + 1] - s, motionVector);
+                    /* for the KDTree, use parameterized representation as the
+                       spatial 'point' and make sure we get a reference to the
+                       current index into pairs as the associated value */
+                    PointAndValue <unsigned int> &curTracklet = trackletsForTree[firstOut + i];
+                    curTracklet.setPoint(motionVector);
+                    /*each PointAndValue for the tree has Value which is index into
+                     * tracklets vector of corresponding tracklet*/
+                    curTracklet.setValue(i);
+                }
             }
-
-            parameterize(&trackletDets, motionVector, midPointTime);
-            /* for the KDTree, use parameterized representation as the
-               spatial 'point' and make sure we get a reference to the
-               current index into pairs as the associated value */
-            curTracklet.setPoint(motionVector);
-            /*each PointAndValue for the tree has Value which is index into
-             * tracklets vector of corresponding tracklet*/
-            curTracklet.setValue(i);
-            trackletsForTree.push_back(curTracklet);
-            i++;
         }
     }
 
 
 
+
     }} // close lsst::mops
 
 
@@ -61,6 +61,10 @@ enforce a maximum RMS distance for any tracklet which is the product of collapsi
 --maxRMS=<double>,\n\
 --------------------------------------------------\n\
 Only used if useRMSfilt == true.  Describes the function for RMS filtering.  Tracklets will not be collapsed unless the resulting tracklet would have RMS <= maxRMSm * average magnitude + maxRMSb.   Defaults are 0. and .001.\n\
+\n\
+--leafSize=<int>\n\
+--------------------------------------------------\n\
+the most tracklets in a leaf of the KDTree of tracklets.  default is 50.\n\
 ");
 
         std::ifstream detsFile;
@@ -87,16 +91,18 @@ Only used if useRMSfilt == true.  Describes the function for RMS filtering.  Tra
         bool useBestFit = false;
         bool useRMSFilt = false;
         double maxRMS = .001;
+        unsigned int leafSize = 50;
         
         static const struct option longOpts[] = {
             { "method", required_argument, NULL, 'e' },
             { "useRMSFilt", required_argument, NULL, 'u' },
             { "maxRMS", required_argument, NULL, 'm' },
+            { "leafSize", required_argument, NULL, 'l' },
             { "help", no_argument, NULL, 'h' },
             { NULL, no_argument, NULL, 0 }
         };
 
-        const char* optString = "e:u:m:h:v";
+        const char* optString = "e:u:m:l:h:v";
         int longIndex = -1;
         int opt = getopt_long( argc, argv, optString, longOpts, &longIndex );        
         std::stringstream ss;
@@ -136,6 +142,12 @@ Only used if useRMSfilt == true.  Describes the function for RMS filtering.  Tra
                 ss << optarg;
                 ss >> maxRMS;
                 break;
+
+            case 'l':
+                ss.clear();
+                ss << optarg;
+                ss >> leafSize;
+                break;
                 
             case 'h':   /* fall-through is intentional */
             case '?':
@@ -239,7 +251,7 @@ Only used if useRMSfilt == true.  Describes the function for RMS filtering.  Tra
             std::cout << "Doing the collapsing..." << std::endl;
             doCollapsingPopulateOutputVector(&detections, pairs, tolerances, collapsedPairs, 
                                              useMinimumRMS, useBestFit, useRMSFilt, maxRMS, 
-                                             beVerbose);
+                                             beVerbose, leafSize);
             std::cout << std::endl << "Done!" << std::endl;
 
         }
@@ -19,44 +19,56 @@ namespace lsst {
     namespace mops {    
 
 
-    Tracklet purifyTracklet(const Tracklet *t, const std::vector<MopsDetection>* allDets, 
-                                              double maxRMS) {
+    /* as purifyTracklet, but give up once fewer than minObs
+     * detections are left, since the caller won't want the result. */
+    static Tracklet purifyTrackletToMinObs(const Tracklet *t, 
+                                           const std::vector<MopsDetection>* allDets, 
+                                           double maxRMS, unsigned int minObs) {
         Tracklet curTracklet = *t;
-        bool isClean = false;
-
-        while (isClean == false) {
-            double t0 = (*allDets)[*(curTracklet.indices.begin())].getEpochMJD();
-            std::vector<MopsDetection> curTrackletDets = getTrackletDets(&curTracklet, allDets);
-            std::vector<double> RASlopeAndOffset, DecSlopeAndOffset;
-            leastSquaresSolveForRADecLinear(&curTrackletDets, RASlopeAndOffset, 
-                                                 DecSlopeAndOffset, t0);
-            std::map<unsigned int, double> indexToSqDist = 
-                getPerDetSqDistanceToLine(&curTracklet, allDets, RASlopeAndOffset[0], RASlopeAndOffset[1],
-                                          DecSlopeAndOffset[0], DecSlopeAndOffset[1], t0);
+        // the detections still in the tracklet, in index order, and
+        // the running fit to them.
+        std::vector<const MopsDetection*> curDets;
+        LinearFitAccumulator fit;
+        for (std::set<unsigned int>::const_iterator indexIter = t->indices.begin();
+             indexIter != t->indices.end(); indexIter++) {
+            curDets.push_back(&(*allDets)[*indexIter]);
+            fit.add(*curDets.back());
+        }
 
+        double maxSqDist = maxRMS*maxRMS;
+        bool isClean = false;
+        while ((isClean == false) && (curDets.size() >= minObs)) {
             isClean = true;
             double worstDetVal = 0.0;
-            unsigned int worstDetIndex = 0;
-            for (std::map<unsigned int, double>::iterator distIter = indexToSqDist.begin();
-                 distIter != indexToSqDist.end(); distIter++) {
-                double distMax = maxRMS;
-                if ((distIter->second > distMax*distMax) && (distIter->second > worstDetVal)) {
-                    worstDetVal = distIter->second;
+            unsigned int worstDet = 0;
+            for (unsigned int i = 0; i < curDets.size(); i++) {
+                double sqDist = fit.sqDist(*curDets[i]);
+                if ((sqDist > maxSqDist) && (sqDist > worstDetVal)) {
+                    worstDetVal = sqDist;
 		    if (worstDetVal > 1) {
                         std::cerr << "Warning: detection point to projected point is improbably large distance: " << worstDetVal << std::endl;
 		    }
-                    worstDetIndex = distIter->first;
+                    worstDet = i;
                     isClean = false;
                 }
             }
             if (isClean == false) {
-                curTracklet.indices.erase(worstDetIndex);
+                fit.remove(*curDets[worstDet]);
+                curTracklet.indices.erase(curDets[worstDet] - &(*allDets)[0]);
+                curDets.erase(curDets.begin() + worstDet);
             }
         }
         return curTracklet;
     }
 
 
+
+    Tracklet purifyTracklet(const Tracklet *t, const std::vector<MopsDetection>* allDets, 
+                                              double maxRMS) {
+        return purifyTrackletToMinObs(t, allDets, maxRMS, 0);
+    }
+
+
     void purifyTracklets(const std::vector<Tracklet> *trackletsVector,
                                            const std::vector<MopsDetection> *detsVector,
                                            double maxRMS, unsigned int minObs,
@@ -79,15 +91,28 @@ namespace lsst {
     }
 
         
-#pragma omp parallel for schedule(dynamic, 128)
-        for (int i = 0; i < trackletsVector->size(); i++) {
-            Tracklet tmp = purifyTracklet(&(*trackletsVector)[i], detsVector, maxRMS);
-            if (tmp.indices.size() >= minObs) {
-#pragma omp critical(writeResults)
-                {
-                    output.push_back(tmp);
+        /* each thread purifies one contiguous share of the
+         * tracklets into its own output; appending those in thread
+         * order gives the same output as the serial version. */
+        std::vector<std::vector<Tracklet> > threadOutputs;
+#pragma omp parallel
+        {
+#pragma omp single
+            threadOutputs.resize(omp_get_num_threads());
+            std::vector<Tracklet> &myOutput = threadOutputs[omp_get_thread_num()];
+            int numTracklets = trackletsVector->size();
+#pragma omp for schedule(static)
+            for (int i = 0; i < numTracklets; i++) {
+                Tracklet tmp = purifyTrackletToMinObs(&(*trackletsVector)[i], detsVector, 
+                                                      maxRMS, minObs);
+                if (tmp.indices.size() >= minObs) {
+                    myOutput.push_back(tmp);
                 }
             }
+        }
+        for (unsigned int thread = 0; thread < threadOutputs.size(); thread++) {
+            output.insert(output.end(), threadOutputs[thread].begin(), 
+                          threadOutputs[thread].end());
         }        
     
         
@@ -2,6 +2,7 @@
 
 #include <algorithm> //for nth_element
 #include <iostream>
+#include <sys/time.h>
 
 #include "lsst/mops/common.h"
 #include "lsst/mops/Exceptions.h"
@@ -18,6 +19,15 @@ double timeElapsed(time_t priorEvent)
 }
 
 
+
+double wallClockSeconds()
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec + now.tv_usec / 1e6;
+}
+
+
     
 double fastMedian(std::vector<double> fv) {
     unsigned int middleIndex = 0;
@@ -12,7 +12,8 @@ namespace lsst {
 
 // prototypes not to be seen outside this file
 
-KDTree<unsigned int> buildKDTree(const std::vector<MopsDetection>);
+KDTree<unsigned int> buildKDTree(const std::vector<MopsDetection>,
+                                 unsigned int maxLeafSize);
 
 std::vector<std::pair <unsigned int, unsigned int> > getProximity(const std::vector<MopsDetection>& queryPoints,
 								  const KDTree<unsigned int>& searchTree,
@@ -24,14 +25,15 @@ std::vector<std::pair <unsigned int, unsigned int> > detectionProximity(
     const std::vector<MopsDetection>& queryPoints,
     const std::vector<MopsDetection>& dataPoints,
     double distanceThreshold,
-    double timeThreshold)
+    double timeThreshold,
+    unsigned int maxLeafSize)
 {
     std::vector<std::pair <unsigned int, unsigned int> > results;
     
     if(queryPoints.size() > 0 && dataPoints.size() > 0){
         
         //build KDTrees from detection vectors
-        KDTree<unsigned int> dataTree(buildKDTree(dataPoints));
+        KDTree<unsigned int> dataTree(buildKDTree(dataPoints, maxLeafSize));
         
         //get results
         results = getProximity(queryPoints, dataTree, distanceThreshold,
@@ -46,7 +48,8 @@ std::vector<std::pair <unsigned int, unsigned int> > detectionProximity(
 /**********************************************************************
  * Populate a KDTree 'tree' from the Detections in vector 'points'
  ***********************************************************************/
-KDTree<unsigned int> buildKDTree(const std::vector<MopsDetection> points)
+KDTree<unsigned int> buildKDTree(const std::vector<MopsDetection> points,
+                                 unsigned int maxLeafSize)
 {
 
   std::vector<PointAndValue<unsigned int> > vecPV;
@@ -68,7 +71,7 @@ KDTree<unsigned int> buildKDTree(const std::vector<MopsDetection> points)
     }
     
   }
-  KDTree<unsigned int> newTree(vecPV, 3, 100);
+  KDTree<unsigned int> newTree(vecPV, 3, maxLeafSize);
   return newTree;
 }
     
@@ -5,6 +5,7 @@
  * 
  */
 
+#include <algorithm>
 #include <istream>
 #include <sstream>
 // these C style headers used by printMemUse()
@@ -84,29 +85,92 @@ void populateDetVectorFromFile(std::ifstream &detsFile, std::vector <MopsDetecti
 
 
 
+void writeDetsToOutFile(const std::vector<MopsDetection> * dets, std::ofstream &outFile)
+{
+     std::streamsize oldPrecision = outFile.precision(10);
+     std::ios_base::fmtflags oldFlags = outFile.setf(std::ios_base::fixed,
+                                                     std::ios_base::floatfield);
+     std::vector<MopsDetection>::const_iterator detIter;
+     for (detIter = dets->begin(); detIter != dets->end(); detIter++) {
+	  outFile << detIter->getID() << " " << detIter->getImageID() << " "
+		  << detIter->getSsmId() << " " << detIter->getRA() << " "
+		  << detIter->getDec() << " " << detIter->getEpochMJD() << " "
+		  << detIter->getMag() << " " << detIter->getSNR() << "\n";
+     }
+     outFile.precision(oldPrecision);
+     outFile.flags(oldFlags);
+}
+
+
+
+void parseTrackletLine(const std::string &line, std::set<unsigned int> &indices) {
+     int tmpInt = -1;
+     std::istringstream ss(line);
+     ss.exceptions(std::ifstream::failbit | std::ifstream::badbit);    
+     while (!ss.eof()) {
+	  try {
+	       ss >> tmpInt;
+	       ss >> std::ws;
+	  }
+	  catch (...) {
+	       throw LSST_EXCEPT(InputFileFormatErrorException, "Improperly-formatted pairs file.\n");
+	  }
+	  indices.insert(tmpInt);
+     }
+}
+
+
+
+void parseTrackletLine(const std::string &line, std::vector<unsigned int> &indices) {
+     // lines are nearly always just unsigned decimal numbers and
+     // spaces; read those directly, and leave anything else to the
+     // istringstream version so both read the same thing.
+     indices.clear();
+     bool simple = true;
+     unsigned int cur = 0;
+     unsigned int numDigits = 0;
+     for (unsigned int i = 0; (i <= line.size()) && simple; i++) {
+	  char c = (i < line.size()) ? line[i] : ' ';
+	  if ((c >= '0') && (c <= '9')) {
+	       cur = cur * 10 + (c - '0');
+	       numDigits++;
+	       // more than this could overflow
+	       simple = (numDigits <= 9);
+	  }
+	  else if ((c == ' ') || (c == '\t') || (c == '\r')) {
+	       if (numDigits > 0) {
+		    indices.push_back(cur);
+	       }
+	       cur = 0;
+	       numDigits = 0;
+	  }
+	  else {
+	       simple = false;
+	  }
+     }
+     if (simple && (indices.size() > 0)) {
+	  std::sort(indices.begin(), indices.end());
+	  indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+	  return;
+     }
+     std::set<unsigned int> indexSet;
+     parseTrackletLine(line, indexSet);
+     indices.assign(indexSet.begin(), indexSet.end());
+}
+
+
+
 void populatePairsVectorFromFile(std::ifstream &pairsFile, 
                                  std::vector<Tracklet> &pairsVector) {
 
      Tracklet tmpPair;
      std::string line;
-     int tmpInt = -1;
      tmpPair.indices.clear();
      tmpPair.isCollapsed = false;
      line.clear();
      std::getline(pairsFile, line);
      while (pairsFile.fail() == false) {
-	  std::istringstream ss(line);
-	  ss.exceptions(std::ifstream::failbit | std::ifstream::badbit);    
-	  while (!ss.eof()) {
-	       try {
-                    ss >> tmpInt;
-                    ss >> std::ws;
-	       }
-	       catch (...) {
-                    throw LSST_EXCEPT(InputFileFormatErrorException, "Improperly-formatted pairs file.\n");
-	       }
-	       tmpPair.indices.insert(tmpInt);
-	  }
+	  parseTrackletLine(line, tmpPair.indices);
 	  if (tmpPair.indices.size() < 2) {
 	       throw LSST_EXCEPT(InputFileFormatErrorException, "EE: CollapseTracklets: pairs in pairs file must be length >= 2!\n");
 	  }
@@ -7,8 +7,14 @@
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
 
@@ -902,3 +908,337 @@ BOOST_AUTO_TEST_CASE( findTracklets_blackbox_using_minv_8 )
   delete pairs;
 
 }
+
+
+
+// pairs are only made between images at least minDt and at most
+// maxDt apart, whatever order the detections come in.
+BOOST_AUTO_TEST_CASE( findTracklets_blackbox_timeWindow_1 )
+{
+  std::vector<MopsDetection> myDets;
+  // the same stationary object in six images, listed out of order.
+  addDetectionAt(53736.38, 100.0, 10.0, myDets); // id 0
+  addDetectionAt(53736.00, 100.0, 10.0, myDets); // id 1
+  addDetectionAt(53736.07, 100.0, 10.0, myDets); // id 2
+  addDetectionAt(53736.02, 100.0, 10.0, myDets); // id 3
+  addDetectionAt(53736.12, 100.0, 10.0, myDets); // id 4
+  addDetectionAt(53736.25, 100.0, 10.0, myDets); // id 5
+
+  findTrackletsConfig config;
+  config.maxV = 1.0;
+  config.minDt = .04;
+  config.maxDt = .15;
+
+  TrackletVector *pairs = findTracklets(myDets, config);
+  BOOST_CHECK(pairs->size() == 7);
+  BOOST_CHECK(containsPair(1, 2, pairs));
+  BOOST_CHECK(containsPair(1, 4, pairs));
+  BOOST_CHECK(containsPair(3, 2, pairs));
+  BOOST_CHECK(containsPair(3, 4, pairs));
+  BOOST_CHECK(containsPair(2, 4, pairs));
+  BOOST_CHECK(containsPair(4, 5, pairs));
+  BOOST_CHECK(containsPair(5, 0, pairs));
+  // too close together, or too far apart
+  BOOST_CHECK(!containsPair(1, 3, pairs));
+  BOOST_CHECK(!containsPair(2, 5, pairs));
+  delete pairs;
+}
+
+
+
+// images which are too far apart on the sky are never paired, but
+// images whose footprints straddle RA 0 or a pole still are.
+BOOST_AUTO_TEST_CASE( findTracklets_blackbox_footprints_1 )
+{
+  std::vector<MopsDetection> myDets;
+  // two images of a field straddling RA 0
+  addDetectionAt(53736.00, 359.9, 1.0, myDets); // id 0
+  addDetectionAt(53736.00, 0.2, -1.0, myDets); // id 1
+  addDetectionAt(53736.05, 359.95, 1.0, myDets); // id 2
+  addDetectionAt(53736.05, 0.25, -1.0, myDets); // id 3
+  // two images of a field around the north pole
+  addDetectionAt(53736.01, 10.0, 89.97, myDets); // id 4
+  addDetectionAt(53736.01, 190.0, 89.9, myDets); // id 5
+  addDetectionAt(53736.06, 190.0, 89.96, myDets); // id 6
+  addDetectionAt(53736.06, 100.0, 89.5, myDets); // id 7
+  // and an image far from everything
+  addDetectionAt(53736.03, 180.0, -45.0, myDets); // id 8
+
+  findTrackletsConfig config;
+  config.maxV = 2.0;
+  config.maxDt = .1;
+
+  TrackletVector *pairs = findTracklets(myDets, config);
+  BOOST_CHECK(containsPair(0, 2, pairs));
+  BOOST_CHECK(containsPair(1, 3, pairs));
+  BOOST_CHECK(containsPair(4, 6, pairs));
+  BOOST_CHECK(containsPair(5, 6, pairs));
+  BOOST_CHECK(!containsPair(5, 7, pairs));
+  BOOST_CHECK(pairs->size() == 4);
+  delete pairs;
+}
+
+
+
+// streaming through time-sorted detections finds the same pairs, in
+// the same order, as reading them all in.
+BOOST_AUTO_TEST_CASE( findTracklets_streaming_1 )
+{
+  srand(35);
+  std::stringstream detsText;
+  detsText << std::fixed << std::setprecision(10);
+  unsigned int id = 0;
+  for (unsigned int image = 0; image < 40; image++) {
+      // images every 15-odd minutes, pointed around a small patch
+      double MJD = 53736. + image * .011;
+      double fieldRA = 30. + (image % 5) * 1.5;
+      for (unsigned int i = 0; i < 30; i++) {
+          double RA = fieldRA + 1.5 * rand() / (RAND_MAX + 1.);
+          double Dec = -1. + 2. * rand() / (RAND_MAX + 1.);
+          detsText << id << " " << image << " -1 " << RA << " " << Dec
+                   << " " << MJD << " 20.0 5.0\n";
+          id++;
+      }
+  }
+
+  std::vector<MopsDetection> myDets;
+  std::string line;
+  std::getline(detsText, line);
+  while (!detsText.fail()) {
+      MopsDetection tmpDet;
+      tmpDet.fromString(line);
+      myDets.push_back(tmpDet);
+      std::getline(detsText, line);
+  }
+  detsText.clear();
+  detsText.seekg(0);
+
+  findTrackletsConfig config;
+  config.maxV = 10.0;
+  config.minDt = .01;
+  config.maxDt = .05;
+
+  TrackletVector *pairs = findTracklets(myDets, config);
+  TrackletVector *streamedPairs = findTrackletsStreaming(detsText, config);
+  BOOST_CHECK(pairs->size() > 0);
+  BOOST_REQUIRE(streamedPairs->size() == pairs->size());
+  for (unsigned int i = 0; i < pairs->size(); i++) {
+      BOOST_CHECK(streamedPairs->at(i) == pairs->at(i));
+  }
+  delete pairs;
+  delete streamedPairs;
+}
+
+
+
+// a trailed detection only pairs with detections its trail points
+// at (either way), at about the trail's rate; untrailed ones are
+// paired as usual.
+BOOST_AUTO_TEST_CASE( findTracklets_trailed_1 )
+{
+  std::vector<MopsDetection> myDets;
+  addDetectionAt(53736.00, 10.0, 0.0, myDets); // id 0, trailed east-west
+  addDetectionAt(53736.00, 20.0, 0.0, myDets); // id 1, not trailed
+  addDetectionAt(53736.05, 10.05, 0.0, myDets); // id 2, east at 1 deg/day
+  addDetectionAt(53736.05, 9.95, 0.0, myDets); // id 3, west at 1 deg/day
+  addDetectionAt(53736.05, 10.0, 0.05, myDets); // id 4, north at 1 deg/day
+  addDetectionAt(53736.05, 10.15, 0.0, myDets); // id 5, east at 3 deg/day
+  addDetectionAt(53736.05, 20.0, 0.05, myDets); // id 6
+  addDetectionAt(53736.05, 20.15, 0.0, myDets); // id 7
+
+  std::vector<DetectionMotion> motions(myDets.size());
+  // 1 deg/day for 30 seconds, at position angle 90 (east)
+  motions[0] = motionFromElongation(30. / 86400., 90., 30.);
+  BOOST_CHECK(motions[0].isTrailed());
+  BOOST_CHECK(!motions[1].isTrailed());
+
+  findTrackletsConfig config;
+  config.maxV = 5.0;
+
+  TrackletVector *pairs = findTracklets(myDets, config);
+  BOOST_CHECK(containsPair(0, 2, pairs));
+  BOOST_CHECK(containsPair(0, 3, pairs));
+  BOOST_CHECK(containsPair(0, 4, pairs));
+  BOOST_CHECK(containsPair(0, 5, pairs));
+  BOOST_CHECK(pairs->size() == 6);
+  delete pairs;
+
+  pairs = findTracklets(myDets, motions, config);
+  BOOST_CHECK(containsPair(0, 2, pairs));
+  BOOST_CHECK(containsPair(0, 3, pairs));
+  BOOST_CHECK(!containsPair(0, 4, pairs));
+  BOOST_CHECK(!containsPair(0, 5, pairs));
+  BOOST_CHECK(containsPair(1, 6, pairs));
+  BOOST_CHECK(containsPair(1, 7, pairs));
+  BOOST_CHECK(pairs->size() == 4);
+  delete pairs;
+}
+
+
+
+// the stats agree with what was found
+BOOST_AUTO_TEST_CASE( findTracklets_stats_1 )
+{
+  std::vector<MopsDetection> myDets;
+  addDetectionAt(53736.00, 10.0, 0.0, myDets); // id 0
+  addDetectionAt(53736.00, 20.0, 0.0, myDets); // id 1
+  addDetectionAt(53736.05, 10.05, 0.0, myDets); // id 2
+  addDetectionAt(53736.05, 20.01, 0.01, myDets); // id 3
+  addDetectionAt(53736.05, 50.0, 0.0, myDets); // id 4
+  // too far from the others for its image to be searched at all
+  addDetectionAt(53736.02, 180.0, 0.0, myDets); // id 5
+
+  findTrackletsStats stats;
+  BOOST_CHECK(stats.pairsAccepted == 0);
+  findTrackletsConfig config;
+  config.maxV = 2.0;
+  config.stats = &stats;
+
+  TrackletVector *pairs = findTracklets(myDets, config);
+  BOOST_CHECK(pairs->size() == 2);
+  BOOST_CHECK(stats.nDetections == 6);
+  BOOST_CHECK(stats.nImages == 3);
+  BOOST_CHECK(stats.imagePairsCompared == 3);
+  BOOST_CHECK(stats.imagePairsSearched == 1);
+  BOOST_CHECK(stats.treeSearches == 2);
+  BOOST_CHECK(stats.nodesVisited >= stats.treeSearches);
+  BOOST_CHECK(stats.candidatesReturned == 2);
+  BOOST_CHECK(stats.pairsAccepted == 2);
+  BOOST_CHECK(stats.searchTime >= 0.);
+  BOOST_CHECK(stats.totalTime() >= stats.searchTime);
+  delete pairs;
+}
+
+
+
+// the leaf size (set or tuned) changes neither which pairs are found
+// nor the order they come out in
+BOOST_AUTO_TEST_CASE( findTracklets_leafSize_1 )
+{
+  srand(39);
+  std::vector<MopsDetection> myDets;
+  for (unsigned int image = 0; image < 12; image++) {
+      double MJD = 53736. + image * .011;
+      for (unsigned int i = 0; i < 60; i++) {
+          addDetectionAt(MJD, 30. + rand() / (RAND_MAX + 1.), 
+                         rand() / (RAND_MAX + 1.), myDets);
+      }
+  }
+
+  findTrackletsConfig config;
+  config.maxV = 5.0;
+  TrackletVector *pairs = findTracklets(myDets, config);
+  BOOST_CHECK(pairs->size() > 0);
+
+  config.leafSize = 1;
+  TrackletVector *smallLeafPairs = findTracklets(myDets, config);
+
+  findTrackletsStats stats;
+  config.autoTuneLeafSize = true;
+  config.stats = &stats;
+  TrackletVector *tunedPairs = findTracklets(myDets, config);
+  BOOST_CHECK((stats.leafSize >= 4) && (stats.leafSize <= 64));
+
+  // each search's partners are sorted, so not even the order changes.
+  BOOST_REQUIRE(smallLeafPairs->size() == pairs->size());
+  BOOST_REQUIRE(tunedPairs->size() == pairs->size());
+  for (unsigned int i = 0; i < pairs->size(); i++) {
+      BOOST_CHECK(smallLeafPairs->at(i) == pairs->at(i));
+      BOOST_CHECK(tunedPairs->at(i) == pairs->at(i));
+  }
+  delete pairs;
+  delete smallLeafPairs;
+  delete tunedPairs;
+}
+
+
+
+
+// pairs come out in the order serial findTracklets has always
+// written them: by query image, then query detection (in input
+// order), then candidate image, then partner ID.  Built against
+// findTrackletsOMP.cc, this checks that deterministicOutput keeps
+// that order with several threads; there are enough queries for a
+// few rounds of blocks (QUERY_BLOCK_SIZE * BLOCKS_PER_THREAD_PER_ROUND
+// * 4 threads = 16384 queries a round).
+BOOST_AUTO_TEST_CASE( findTracklets_order_1 )
+{
+  srand(33);
+  const unsigned int nImages = 8;
+  const unsigned int detsPerImage = 7000;
+  double imageTimes[nImages];
+  for (unsigned int image = 0; image < nImages; image++) {
+      imageTimes[image] = 53736. + image * .012;
+  }
+  // the images' detections are interleaved, so IDs don't follow
+  // the order of the images.
+  std::vector<MopsDetection> myDets;
+  std::vector<std::vector<unsigned int> > imageDets(nImages);
+  while (myDets.size() < nImages * detsPerImage) {
+      unsigned int image = rand() % nImages;
+      if (imageDets[image].size() < detsPerImage) {
+          imageDets[image].push_back(myDets.size());
+          addDetectionAt(imageTimes[image], 30. + 10. * rand() / (RAND_MAX + 1.),
+                         10. * rand() / (RAND_MAX + 1.), myDets);
+      }
+  }
+
+  findTrackletsConfig config;
+  config.maxV = .5;
+#ifdef _OPENMP
+  config.deterministicOutput = true;
+  omp_set_num_threads(4);
+#endif
+  TrackletVector *pairs = findTracklets(myDets, config);
+
+  // the same pairs, found by brute force (among each image's
+  // detections near enough in Dec) in the serial order.
+  std::vector<std::vector<std::pair<double, unsigned int> > > byDec(nImages);
+  for (unsigned int image = 0; image < nImages; image++) {
+      for (unsigned int i = 0; i < detsPerImage; i++) {
+          unsigned int d = imageDets[image][i];
+          byDec[image].push_back(std::make_pair(myDets[d].getDec(), d));
+      }
+      std::sort(byDec[image].begin(), byDec[image].end());
+  }
+  std::vector<Tracklet> expected;
+  for (unsigned int queryImage = 0; queryImage < nImages; queryImage++) {
+      for (unsigned int i = 0; i < detsPerImage; i++) {
+          const MopsDetection &query = myDets[imageDets[queryImage][i]];
+          for (unsigned int image = queryImage + 1; image < nImages; image++) {
+              double dt = imageTimes[image] - imageTimes[queryImage];
+              if ((dt < config.minDt) || (dt > config.maxDt)) {
+                  continue;
+              }
+              double maxDistance = dt * config.maxV;
+              std::vector<unsigned int> partners;
+              std::vector<std::pair<double, unsigned int> >::const_iterator candIter;
+              candIter = std::lower_bound(byDec[image].begin(), byDec[image].end(),
+                                          std::make_pair(query.getDec() - maxDistance, 0u));
+              for (; (candIter != byDec[image].end()) && 
+                       (candIter->first <= query.getDec() + maxDistance); candIter++) {
+                  const MopsDetection &cand = myDets[candIter->second];
+                  if (angularDistanceRADec_deg(query.getRA(), query.getDec(),
+                                               cand.getRA(), cand.getDec())
+                      <= maxDistance) {
+                      partners.push_back(cand.getID());
+                  }
+              }
+              std::sort(partners.begin(), partners.end());
+              for (unsigned int p = 0; p < partners.size(); p++) {
+                  Tracklet t;
+                  t.indices.insert(query.getID());
+                  t.indices.insert(partners[p]);
+                  expected.push_back(t);
+              }
+          }
+      }
+  }
+
+  BOOST_CHECK(expected.size() > 0);
+  BOOST_REQUIRE(pairs->size() == expected.size());
+  for (unsigned int i = 0; i < expected.size(); i++) {
+      BOOST_CHECK(pairs->at(i) == expected[i]);
+  }
+  delete pairs;
+}
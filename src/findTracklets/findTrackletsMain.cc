@@ -18,6 +18,56 @@
 
 
 
+/*****************************************************************
+ * Read trail lengths and angles from an elongation file, one
+ * detection per line:
+ *
+ *     diaId length angle [exposureTime]
+ *
+ * with length and angle (position angle, north through east) in
+ * degrees and exposure time in seconds (defaulting to
+ * exposureTime). Fill motions so that motions[i] goes with myDets[i];
+ * detections missing from the file get no motion.
+ *****************************************************************/
+void readMotionsFromFile(const std::string &fileName, 
+                         const std::vector<lsst::mops::MopsDetection> &myDets,
+                         double exposureTime,
+                         std::vector<lsst::mops::DetectionMotion> &motions)
+{
+    std::ifstream elongFile(fileName.c_str());
+    if (!elongFile.is_open()) {
+        std::cerr << "Could not open elongation file " << fileName 
+                  << "." << std::endl;
+        exit(1);
+    }
+    std::map<long int, lsst::mops::DetectionMotion> motionsById;
+    std::string line;
+    while (std::getline(elongFile, line)) {
+        std::istringstream ss(line);
+        long int diaId;
+        double length, angle;
+        double thisExposureTime = exposureTime;
+        if (!(ss >> diaId >> length >> angle)) {
+            continue;
+        }
+        ss >> thisExposureTime;
+        motionsById[diaId] = lsst::mops::motionFromElongation(length, angle,
+                                                             thisExposureTime);
+    }
+
+    motions.clear();
+    motions.resize(myDets.size());
+    for (unsigned int i = 0; i < myDets.size(); i++) {
+        std::map<long int, lsst::mops::DetectionMotion>::const_iterator m;
+        m = motionsById.find(myDets[i].getID());
+        if (m != motionsById.end()) {
+            motions[i] = m->second;
+        }
+    }
+}
+
+
+
 /*****************************************************************
  *The main program.
  *****************************************************************/
@@ -37,9 +87,22 @@ int main(int argc, char* argv[])
 
     double maxVelocity = 2.0;
     double minVelocity = 0.0;
+    // only matters to findTrackletsOMP: write output in serial order
+    bool deterministicOutput = false;
+    // read the input a window at a time (it must be sorted by time)
+    bool streaming = false;
+    // trail lengths/angles, if we have them, and the default exposure
+    // time (seconds) they were measured over.
+    std::string elongFileName;
+    double exposureTime = 30.;
+    // where to write per-stage timings and counters (CSV if the name
+    // ends in .csv, otherwise JSON)
+    std::string statsFileName;
+    // KDTree leaf size, or 0 to choose one automatically
+    unsigned int leafSize = 16;
 
     if(argc < 2){
-        std::cout << "Usage: findTracklets -i <input file> -o <output file> [-v <max velocity>] [-m <min velocity>]" << std::endl;
+        std::cout << "Usage: findTracklets -i <input file> -o <output file> [-v <max velocity>] [-m <min velocity>] [-d] [-s] [-e <elongation file> [-x <exposure time>]] [-t <stats file>] [-l <leaf size> | -a]" << std::endl;
         exit(1);
     }
 
@@ -48,13 +111,20 @@ int main(int argc, char* argv[])
         { "outFile", required_argument, NULL, 'o' },
         { "maxVeloctiy", required_argument, NULL, 'v' },
         { "minVeloctiy", optional_argument, NULL, 'm' },
+        { "deterministic", no_argument, NULL, 'd' },
+        { "streaming", no_argument, NULL, 's' },
+        { "elongationFile", required_argument, NULL, 'e' },
+        { "exposureTime", required_argument, NULL, 'x' },
+        { "statsFile", required_argument, NULL, 't' },
+        { "leafSize", required_argument, NULL, 'l' },
+        { "autoTuneLeafSize", no_argument, NULL, 'a' },
         { "help", no_argument, NULL, 'h' },
         { NULL, no_argument, NULL, 0 }
     };
 
 
     int longIndex = -1;
-    const char *optString = "i:o:v:m:h";
+    const char *optString = "i:o:v:m:dse:x:t:l:ah";
     int opt = getopt_long( argc, argv, optString, longOpts, &longIndex );
     while( opt != -1 ) {
         switch( opt ) {
@@ -70,8 +140,29 @@ int main(int argc, char* argv[])
         case 'm':
             minVelocity = atof(optarg);
             break;
+        case 'd':
+            deterministicOutput = true;
+            break;
+        case 's':
+            streaming = true;
+            break;
+        case 'e':
+            elongFileName = optarg;
+            break;
+        case 'x':
+            exposureTime = atof(optarg);
+            break;
+        case 't':
+            statsFileName = optarg;
+            break;
+        case 'l':
+            leafSize = atoi(optarg);
+            break;
+        case 'a':
+            leafSize = 0;
+            break;
         case 'h':
-            std::cout << "Usage: findTracklets -i <input file> -o <output file> [-v <max velocity>] [-m <min velocity>]" << std::endl;
+            std::cout << "Usage: findTracklets -i <input file> -o <output file> [-v <max velocity>] [-m <min velocity>] [-d] [-s] [-e <elongation file> [-x <exposure time>]] [-t <stats file>] [-l <leaf size> | -a]" << std::endl;
             exit(0);
         default:
             break;
@@ -79,32 +170,86 @@ int main(int argc, char* argv[])
         opt = getopt_long( argc, argv, optString, longOpts, &longIndex );
     }
 
+    if (streaming && (elongFileName != "")) {
+        std::cerr << "Elongation files aren't supported with --streaming." 
+                  << std::endl;
+        exit(1);
+    }
+
     std::ifstream detsFile(inFileName.c_str());
     
-    populateDetVectorFromFile(detsFile, myDets);
+    if (!streaming) {
+        populateDetVectorFromFile(detsFile, myDets);
 
-    double dif = lsst::mops::timeElapsed(start);
-    std::cout << "Reading input took " << std::fixed << std::setprecision(10) 
-              <<  dif  << " seconds." <<std::endl;     
+        double dif = lsst::mops::timeElapsed(start);
+        std::cout << "Reading input took " << std::fixed << std::setprecision(10) 
+                  <<  dif  << " seconds." <<std::endl;     
+    }
 
 
     lsst::mops::findTrackletsConfig config;
     config.maxV = maxVelocity;
     config.minV = minVelocity;
+    config.deterministicOutput = deterministicOutput;
+    if (leafSize == 0) {
+        config.autoTuneLeafSize = true;
+    }
+    else {
+        config.leafSize = leafSize;
+    }
     config.outputMethod = lsst::mops::IDS_FILE_WITH_CACHE;
     config.outputFile = outFileName;
     // hold up to 1 GB before purging.
     config.outputBufferSize = 1073741824;
+    if (streaming) {
+        // keep the output from outgrowing the window; 1M pairs.
+        config.outputBufferSize = 1048576;
+    }
+    lsst::mops::findTrackletsStats stats;
+    config.stats = &stats;
     
     // since we set up IDS_FILE_WITH_CACHE, output will be written automatically
-    time_t linkingStart = time(NULL);
-    lsst::mops::findTracklets(myDets, config);
-    //double linkingDif = lsst::mops::timeElapsed(linkingStart);
-    double linkingDif = (time(NULL) - linkingStart);
+    double linkingStart = lsst::mops::wallClockSeconds();
+    if (streaming) {
+        lsst::mops::findTrackletsStreaming(detsFile, config);
+    }
+    else if (elongFileName != "") {
+        std::vector<lsst::mops::DetectionMotion> motions;
+        readMotionsFromFile(elongFileName, myDets, exposureTime, motions);
+        lsst::mops::findTracklets(myDets, motions, config);
+    }
+    else {
+        lsst::mops::findTracklets(myDets, config);
+    }
+    double linkingDif = lsst::mops::wallClockSeconds() - linkingStart;
     std::cout << "Linking took " << std::fixed << std::setprecision(10)
 	      << linkingDif << " seconds." << std::endl;
+    std::cout << "Stages: " << std::setprecision(6) 
+              << "grouping " << stats.groupingTime 
+              << " s, tuning " << stats.tuningTime
+              << " s, tree building " << stats.treeBuildTime
+              << " s (leaf size " << stats.leafSize << ")"
+              << ", planning " << stats.planningTime
+              << " s, searching " << stats.searchTime
+              << " s, output " << stats.outputTime << " s." << std::endl;
+    std::cout << "Visited " << stats.nodesVisited << " tree nodes in "
+              << stats.treeSearches << " searches, finding " 
+              << stats.candidatesReturned << " candidates and " 
+              << stats.pairsAccepted << " pairs." << std::endl;
+
+    if (statsFileName != "") {
+        std::ofstream statsFile(statsFileName.c_str());
+        statsFile << std::setprecision(6);
+        if ((statsFileName.size() >= 4) && 
+            (statsFileName.substr(statsFileName.size() - 4) == ".csv")) {
+            stats.writeCSV(statsFile);
+        }
+        else {
+            stats.writeJSON(statsFile);
+        }
+    }
     
-    dif = lsst::mops::timeElapsed(start);
+    double dif = lsst::mops::timeElapsed(start);
     std::cout << "Completed after " << std::fixed << std::setprecision(10) 
               <<  dif  << " seconds." <<std::endl;     
     lsst::mops::printMemUse();
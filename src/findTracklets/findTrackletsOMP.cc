@@ -7,6 +7,7 @@
 #include <iomanip>
 #include <fstream>
 #include <vector>
+#include <deque>
 #include <getopt.h>
 #include <set>
 #include <map>
@@ -23,7 +24,21 @@
 #include "lsst/mops/MopsDetection.h"
 #include "lsst/mops/daymops/findTracklets/findTracklets.h"
 
-#define LEAF_NODE_SIZE 16
+// leaf sizes tried when tuning, and how many query images to time
+// them on
+#define TUNING_LEAF_SIZES {4, 8, 16, 32, 64}
+#define TUNING_SAMPLE_IMAGES 8
+
+// degrees of slack added to image footprints, for rounding
+#define FOOTPRINT_SLACK 1e-9
+
+// tracklets each thread holds before handing them to the output
+#define THREAD_OUTPUT_BUFFER_SIZE 65536
+
+// with deterministicOutput: queries per block, and blocks per thread
+// in each round of blocks
+#define QUERY_BLOCK_SIZE 256
+#define BLOCKS_PER_THREAD_PER_ROUND 16
 
 #define uint unsigned int
 
@@ -36,30 +51,162 @@ namespace mops {
 
 /*****************************************************************
  * Populate 2D vector of detections.
- * Each outer vector contains Detections of equal MJD.
+ * Each outer vector contains Detections of equal MJD.  With
+ * indicesAsIDs, each detection's ID is replaced by its index in
+ * myDets.
  *****************************************************************/
 void groupByImageTime(const std::vector<MopsDetection>&,
-		      std::map<double, std::vector<MopsDetection> >&);
+		      std::map<double, std::vector<MopsDetection> >&,
+                      bool indicesAsIDs=false);
+
+/* the same, for each detection's motion (motions[i] goes with
+ * myDets[i]), so that motionSets[t][j] goes with detectionSets[t][j]. */
+void groupMotionsByImageTime(const std::vector<MopsDetection> &myDets,
+                             const std::vector<DetectionMotion> &motions,
+                             std::map<double, std::vector<DetectionMotion> > &motionSets);
 
 
 /******************************************************************
- * Take 2D vector of detections and create a map linking
- * each MJD vector to its MJD double value.
+ * Take 2D vector of detections and build a KDTree for each image.
+ * imageTimes[i] is the MJD of the image held by imageTrees[i];
+ * imageTimes comes out sorted (and unique).
  ******************************************************************/
 void generatePerImageTrees(const std::map<double, std::vector<MopsDetection> > &detectionSets, 
-                           std::map<double, KDTree<long int> > &myTreeMap);
+                           std::vector<double> &imageTimes,
+                           std::vector<KDTree<long int> > &imageTrees,
+                           unsigned int leafSize);
+
+/* the KDTree (RA, Dec -> detection ID) of one image's detections */
+KDTree<long int> buildImageTree(const std::vector<MopsDetection> &dets,
+                                unsigned int leafSize);
+
+
+/******************************************************************
+ * Find the images which may hold tracklet partners for detections
+ * from image queryImage: those in [firstImage, lastImage).
+ ******************************************************************/
+void getCandidateImageRange(const std::vector<double> &imageTimes,
+                            unsigned int queryImage,
+                            const findTrackletsConfig &config,
+                            unsigned int &firstImage,
+                            unsigned int &lastImage);
+
+
+/******************************************************************
+ * A cap (center and radius, in degrees) which holds every detection
+ * from one image.
+ ******************************************************************/
+class ImageFootprint {
+public:
+    double RA;
+    double Dec;
+    double radius;
+};
+
+void computeImageFootprints(const std::map<double, std::vector<MopsDetection> > &detectionSets,
+                            std::vector<ImageFootprint> &footprints);
+
+ImageFootprint computeImageFootprint(const std::vector<MopsDetection> &dets);
+
+
+/******************************************************************
+ * Plan the image pairs to search: for each image, the later images
+ * within [minDt, maxDt] whose footprints, widened by maxV * dt,
+ * overlap its own.  Pairs which fail this can't hold a tracklet.
+ ******************************************************************/
+void planImagePairs(const std::vector<double> &imageTimes,
+                    const std::vector<ImageFootprint> &footprints,
+                    const findTrackletsConfig &config,
+                    std::vector<std::vector<unsigned int> > &searchImages,
+                    findTrackletsStats &stats);
+
+/* the footprint test used by planImagePairs, for one pair of images */
+bool imagesMayPair(double queryMJD, const ImageFootprint &queryFootprint,
+                   double imageMJD, const ImageFootprint &imageFootprint,
+                   const findTrackletsConfig &config);
+
+
+/******************************************************************
+ * Choose a KDTree leaf size for these images: build the trees and
+ * search the detections of a sample of the query images with each
+ * of TUNING_LEAF_SIZES, and return whichever took the least time.
+ ******************************************************************/
+unsigned int tuneLeafSize(const std::map<double, std::vector<MopsDetection> > &detectionSets,
+                          const findTrackletsConfig &config);
+
+
+/******************************************************************
+ * Set up the PairVector results go into, as config.outputMethod asks;
+ * once all the results are in, finishPairs writes them out (or turns
+ * them into the TrackletVector returned for RETURN_TRACKLETS) and
+ * deletes the PairVector.
+ ******************************************************************/
+PairVector * newPairVector(const findTrackletsConfig &config);
+
+/*****************************************************************
+ * Find the tracklets in myDets, as findTracklets does, and put them
+ * into pairs; with pairIndices, each pair holds the indices in myDets
+ * of its detections rather than their IDs.  config.leafSize is
+ * tuned if config asks for it.
+ *****************************************************************/
+void findPairs(const std::vector<MopsDetection> &myDets, 
+               const std::vector<DetectionMotion> &motions,
+               findTrackletsConfig &config,
+               bool pairIndices,
+               PairVector &pairs,
+               findTrackletsStats &stats);
+
+TrackletVector * finishPairs(PairVector * pairsVec, 
+                             const findTrackletsConfig &config);
+
+
+/******************************************************************
+ * Given the per-image KDTrees and the detections from each image,
+ * generate tracklets for each query point within a distance
+ * determined by maxVelocity.
+ ******************************************************************/
+
+void getTracklets(PairVector &resultsVec,  
+                  const std::vector<double> &imageTimes,
+                  const std::vector<KDTree<long int> > &imageTrees,
+                  const std::vector<ImageFootprint> &footprints,
+                  const std::vector<std::vector<unsigned int> > &searchImages,
+                  const std::map<double, std::vector<MopsDetection> > &detectionSets,
+                  const std::map<double, std::vector<DetectionMotion> > &motionSets,
+		  findTrackletsConfig config,
+                  findTrackletsStats &stats);
+
+
+/******************************************************************
+ * Pair the detections from one image (taken at queryMJD) with those
+ * in the given candidate images.  If queryMotions isn't NULL, it
+ * holds the motion of each query detection.  The search counters of
+ * stats are updated as we go.
+ ******************************************************************/
+void getTrackletsForImage(PairVector &results,
+                          double queryMJD,
+                          const std::vector<MopsDetection> &queryPoints,
+                          const std::vector<DetectionMotion> *queryMotions,
+                          const std::vector<double> &candidateTimes,
+                          const std::vector<const KDTree<long int> *> &candidateTrees,
+                          const std::vector<const ImageFootprint *> &candidateFootprints,
+                          const findTrackletsConfig &config,
+                          findTrackletsStats &stats);
 
 
 /******************************************************************
- * Given a mapping of MJDs to KDTrees of PointAndValue pairs 
- * index by file line number index, generate tracklets for each 
- * query point within a distance determined by maxVelocity.
+ * Narrow the distances [minDistance, maxDistance] searched around a
+ * trailed detection to those its trail allows after dt days.
  ******************************************************************/
+void trailDistanceRange(const DetectionMotion &motion, double dt,
+                        const findTrackletsConfig &config,
+                        double &minDistance, double &maxDistance);
 
-void getTracklets(TrackletVector &resultsVec,  
-		  const std::map<double, KDTree<long int> > &myTreeMap,
-		  const std::vector<MopsDetection> &queryPoints,
-		  findTrackletsConfig config);
+/* is the offset (distance degrees long) from (RA0, Dec0) to (RA1,
+ * Dec1) along the trail, one way or the other? */
+bool isAlongTrail(const DetectionMotion &motion, 
+                  double RA0, double Dec0, double RA1, double Dec1,
+                  double distance, const findTrackletsConfig &config);
 
 
 
@@ -71,48 +218,278 @@ void getTracklets(TrackletVector &resultsVec,
 TrackletVector * findTracklets(const std::vector<MopsDetection> &myDets, 
                                findTrackletsConfig config)
 {
+    std::vector<DetectionMotion> noMotions;
+    return findTracklets(myDets, noMotions, config);
+}
+
+
+
+TrackletVector * findTracklets(const std::vector<MopsDetection> &myDets, 
+                               const std::vector<DetectionMotion> &motions,
+                               findTrackletsConfig config)
+{
+    findTrackletsStats stats;
+
+    //get results; pairs are kept compactly, and only turned into
+    //Tracklets if the caller wants them back.
+    PairVector * pairsVec = newPairVector(config);
+
+    findPairs(myDets, motions, config, false, *pairsVec, stats);
+    double stageStart = wallClockSeconds();
+
+    TrackletVector * resultsVec = finishPairs(pairsVec, config);
+    stats.outputTime = wallClockSeconds() - stageStart;
+
+    std::cout << "Linking took " << std::fixed << std::setprecision(6)
+	      << stats.searchTime << " seconds." << std::endl;
+    if (config.stats != NULL) {
+        *(config.stats) = stats;
+    }
+    return resultsVec;
+}
+
+
+
+void findTrackletPairs(const std::vector<MopsDetection> &myDets, 
+                       findTrackletsConfig config,
+                       PairVector &pairs)
+{
+    std::vector<DetectionMotion> noMotions;
+    findTrackletsStats stats;
+    findPairs(myDets, noMotions, config, true, pairs, stats);
+
+    std::cout << "Linking took " << std::fixed << std::setprecision(6)
+	      << stats.searchTime << " seconds." << std::endl;
+    if (config.stats != NULL) {
+        *(config.stats) = stats;
+    }
+}
+
+
+
+void findPairs(const std::vector<MopsDetection> &myDets, 
+               const std::vector<DetectionMotion> &motions,
+               findTrackletsConfig &config,
+               bool pairIndices,
+               PairVector &pairs,
+               findTrackletsStats &stats)
+{
+    if ((motions.size() != 0) && (motions.size() != myDets.size())) {
+        throw LSST_EXCEPT(BadParameterException, 
+                          "findTracklets: need exactly one motion per detection.");
+    }
+
+    double stageStart = wallClockSeconds();
+
     //detection vectors, each vector of unique MJD
     std::map<double,  std::vector<MopsDetection> > detectionSets; 
 
-    //vector of RA and dec pairs for later searching
-    std::vector<double> queryPoints; 
-
-    //link MJD to KDTree of unique MJD detections
-    std::map<double, KDTree<long int> > myTreeMap; 
+    //sorted image times, and a KDTree of each image's detections
+    std::vector<double> imageTimes;
+    std::vector<KDTree<long int> > imageTrees;
 
     groupByImageTime(myDets, 
-                     detectionSets);
+                     detectionSets, pairIndices);
+
+    //the motions, grouped the same way (if we have any)
+    std::map<double,  std::vector<DetectionMotion> > motionSets; 
+    if (motions.size() != 0) {
+        groupMotionsByImageTime(myDets, motions, motionSets);
+    }
+    stats.nDetections = myDets.size();
+    stats.nImages = detectionSets.size();
+    stats.groupingTime = wallClockSeconds() - stageStart;
+    stageStart = wallClockSeconds();
+
+    if (config.autoTuneLeafSize) {
+        config.leafSize = tuneLeafSize(detectionSets, config);
+        stats.tuningTime = wallClockSeconds() - stageStart;
+        stageStart = wallClockSeconds();
+    }
+    stats.leafSize = config.leafSize;
     
-    generatePerImageTrees(detectionSets, myTreeMap);
+    generatePerImageTrees(detectionSets, imageTimes, imageTrees, 
+                          config.leafSize);
+
+    //the later images worth searching for each image's detections
+    std::vector<ImageFootprint> footprints;
+    std::vector<std::vector<unsigned int> > searchImages;
+    computeImageFootprints(detectionSets, footprints);
+    stats.treeBuildTime = wallClockSeconds() - stageStart;
+    stageStart = wallClockSeconds();
+
+    planImagePairs(imageTimes, footprints, config, searchImages, stats);
+    stats.planningTime = wallClockSeconds() - stageStart;
+    stageStart = wallClockSeconds();
+
+    getTracklets(pairs, imageTimes, imageTrees, footprints, 
+                 searchImages, detectionSets, motionSets, config, stats);
+    stats.searchTime = wallClockSeconds() - stageStart;
+}
+
+
+
+/*****************************************************************
+ * The streaming version: read detections (sorted by time) from
+ * detsStream, holding only the images within maxDt of the oldest
+ * image not yet searched.
+ *****************************************************************/
+TrackletVector * findTrackletsStreaming(std::istream &detsStream,
+                                        findTrackletsConfig config)
+{
+    findTrackletsStats stats;
+    stats.leafSize = config.leafSize;
+    double start = wallClockSeconds();
+    double stageStart = start;
+
+    // the window of images read but not yet searched (as query
+    // images), oldest first.
+    std::deque<double> windowTimes;
+    std::deque<std::vector<MopsDetection> > windowDets;
+    std::deque<KDTree<long int> > windowTrees;
+    std::deque<ImageFootprint> windowFootprints;
+    unsigned int maxWindowSize = 0;
+
+    PairVector * pairsVec = newPairVector(config);
+
+    std::vector<MopsDetection> curImage;
+    MopsDetection curDet;
+    std::string line;
+    bool moreDets = true;
+    while ((moreDets) || (windowTimes.size() > 0)) {
+        if (moreDets) {
+            line.clear();
+            std::getline(detsStream, line);
+            moreDets = (detsStream.fail() == false);
+            if (moreDets) {
+                curDet.fromString(line);
+            }
+        }
+
+        // carry on reading until we have a whole image.
+        if ((moreDets) && ((curImage.size() == 0) ||
+                           (curDet.getEpochMJD() == curImage[0].getEpochMJD()))) {
+            curImage.push_back(curDet);
+            continue;
+        }
+
+        if (curImage.size() > 0) {
+            double curMJD = curImage[0].getEpochMJD();
+            if ((windowTimes.size() > 0) && (curMJD <= windowTimes.back())) {
+                throw LSST_EXCEPT(BadParameterException, 
+                                  "findTrackletsStreaming: detections must be sorted by time, with each image's detections together.");
+            }
+            stats.nDetections += curImage.size();
+            stats.nImages++;
+            stats.groupingTime += wallClockSeconds() - stageStart;
+            stageStart = wallClockSeconds();
+
+            windowTimes.push_back(curMJD);
+            windowDets.push_back(curImage);
+            windowTrees.push_back(buildImageTree(curImage, config.leafSize));
+            windowFootprints.push_back(computeImageFootprint(curImage));
+            maxWindowSize = std::max(maxWindowSize, 
+                                     (unsigned int) windowTimes.size());
+            curImage.clear();
+            stats.treeBuildTime += wallClockSeconds() - stageStart;
+            stageStart = wallClockSeconds();
+        }
+        if (moreDets) {
+            curImage.push_back(curDet);
+        }
+
+        // the oldest image can be searched once we have every image
+        // within maxDt of it, i.e. once a later one has come in (or
+        // there's nothing left to read); after that, nothing will
+        // ever need it again.
+        while ((windowTimes.size() > 0) &&
+               ((windowTimes.back() - windowTimes.front() > config.maxDt) ||
+                ((!moreDets) && (curImage.size() == 0)))) {
+            std::vector<double> candidateTimes;
+            std::vector<const KDTree<long int> *> candidateTrees;
+            std::vector<const ImageFootprint *> candidateFootprints;
+            for (unsigned int image = 1; image < windowTimes.size(); image++) {
+                double dt = windowTimes[image] - windowTimes.front();
+                if ((dt < config.minDt) || (dt > config.maxDt)) {
+                    continue;
+                }
+                stats.imagePairsCompared++;
+                if (imagesMayPair(windowTimes.front(), windowFootprints.front(),
+                                  windowTimes[image], windowFootprints[image],
+                                  config)) {
+                    candidateTimes.push_back(windowTimes[image]);
+                    candidateTrees.push_back(&(windowTrees[image]));
+                    candidateFootprints.push_back(&(windowFootprints[image]));
+                    stats.imagePairsSearched++;
+                }
+            }
+            stats.planningTime += wallClockSeconds() - stageStart;
+            stageStart = wallClockSeconds();
+
+            getTrackletsForImage(*pairsVec, windowTimes.front(), 
+                                 windowDets.front(), NULL, candidateTimes, 
+                                 candidateTrees, candidateFootprints, config,
+                                 stats);
+            windowTimes.pop_front();
+            windowDets.pop_front();
+            windowTrees.pop_front();
+            windowFootprints.pop_front();
+            stats.searchTime += wallClockSeconds() - stageStart;
+            stageStart = wallClockSeconds();
+        }
+    }
+
+    std::cout << "Searched " << stats.imagePairsSearched << " of " 
+              << stats.imagePairsCompared 
+              << " image pairs within the time window, holding at most "
+              << maxWindowSize << " images at once." << std::endl;
+    std::cout << "Streaming search took " << std::fixed << std::setprecision(6)
+	      << wallClockSeconds() - start << " seconds." << std::endl;
+
+    stageStart = wallClockSeconds();
+    TrackletVector * resultsVec = finishPairs(pairsVec, config);
+    stats.outputTime = wallClockSeconds() - stageStart;
+
+    if (config.stats != NULL) {
+        *(config.stats) = stats;
+    }
+    return resultsVec;
+}
 
-    //get results
-    TrackletVector * resultsVec;
 
+
+PairVector * newPairVector(const findTrackletsConfig &config)
+{
     if (config.outputMethod == RETURN_TRACKLETS) {
-        resultsVec = new TrackletVector();
+        return new PairVector();
     }
     else if (config.outputMethod == IDS_FILE) {
-        resultsVec = new TrackletVector(config.outputFile, false, 0);
+        return new PairVector(config.outputFile, false, 0);
     }
     else if (config.outputMethod == IDS_FILE_WITH_CACHE) {
-        resultsVec = new TrackletVector(config.outputFile, true, config.outputBufferSize);
+        return new PairVector(config.outputFile, true, config.outputBufferSize);
     }
     else {
         throw LSST_EXCEPT(BadParameterException, 
                           "findTracklets: got unknown or unimplemented output method.");
     }
+}
+
 
-    getTracklets(*resultsVec, myTreeMap, 
-                 myDets, config);
 
-    if ((config.outputMethod == IDS_FILE) || 
-        (config.outputMethod == IDS_FILE_WITH_CACHE)) {
+TrackletVector * finishPairs(PairVector * pairsVec, 
+                             const findTrackletsConfig &config)
+{
+    TrackletVector * resultsVec = NULL;
 
-        resultsVec->purgeToFile();
-        delete resultsVec;
-        resultsVec = NULL;
+    if (config.outputMethod == RETURN_TRACKLETS) {
+        resultsVec = new TrackletVector();
+        pairsVec->toTracklets(*resultsVec);
     }
-    
+    else {
+        pairsVec->purgeToFile();
+    }
+    delete pairsVec;
 
     return resultsVec;
 }
@@ -124,14 +501,19 @@ TrackletVector * findTracklets(const std::vector<MopsDetection> &myDets,
  * Each outer vector contains Detections of equal MJD.
  *****************************************************************/
 void groupByImageTime(const std::vector<MopsDetection> &myDets, 
-		      std::map<double, std::vector<MopsDetection> > &detectionSets)
+		      std::map<double, std::vector<MopsDetection> > &detectionSets,
+                      bool indicesAsIDs)
 {
     // maps by default sort on their first parameter.
     // build a map from detection time to all dets at that time. we'll have a nice sorted
     // set of vectors.
 
     for (unsigned int i = 0; i < myDets.size(); i++) {
-        detectionSets[myDets.at(i).getEpochMJD()].push_back(myDets.at(i));
+        std::vector<MopsDetection> &image = detectionSets[myDets.at(i).getEpochMJD()];
+        image.push_back(myDets.at(i));
+        if (indicesAsIDs) {
+            image.back().setID(i);
+        }
     }
     
 }
@@ -139,12 +521,25 @@ void groupByImageTime(const std::vector<MopsDetection> &myDets,
 
 
 
+void groupMotionsByImageTime(const std::vector<MopsDetection> &myDets,
+                             const std::vector<DetectionMotion> &motions,
+                             std::map<double, std::vector<DetectionMotion> > &motionSets)
+{
+    for (unsigned int i = 0; i < myDets.size(); i++) {
+        motionSets[myDets.at(i).getEpochMJD()].push_back(motions.at(i));
+    }
+}
+
+
+
+
 /******************************************************************
- * Take 2D vector of detections and create a map linking
- * each per-MJD Detection vector to its MJD double value.
+ * Take 2D vector of detections and build a KDTree for each image.
  ******************************************************************/
 void generatePerImageTrees(const std::map<double, std::vector<MopsDetection> > &detectionSets, 
-                           std::map<double, KDTree<long int> > &myTreeMap)
+                           std::vector<double> &imageTimes,
+                           std::vector<KDTree<long int> > &imageTrees,
+                           unsigned int leafSize)
 {
 
     // for each vector representing a single EpochMJD, created
@@ -152,41 +547,503 @@ void generatePerImageTrees(const std::map<double, std::vector<MopsDetection> > &
 
     std::map<double, std::vector<MopsDetection> >::const_iterator imageIter;
 
+    imageTimes.reserve(detectionSets.size());
+    imageTrees.reserve(detectionSets.size());
     for(imageIter = detectionSets.begin(); imageIter != detectionSets.end(); imageIter++) {
 
-        const std::vector<MopsDetection> *thisDetVec = &(imageIter->second);
         double thisEpoch = imageIter->first;
-        std::vector<PointAndValue<long int> > vecPV;
-        
-        for(unsigned int j=0; j < thisDetVec->size(); j++) {
+        imageTimes.push_back(thisEpoch);
+        imageTrees.push_back(buildImageTree(imageIter->second, leafSize));
+    }
+}
+
 
-            PointAndValue<long int> tempPV;
-            std::vector<double> pairRADec;
+
+KDTree<long int> buildImageTree(const std::vector<MopsDetection> &dets,
+                                unsigned int leafSize)
+{
+    std::vector<PointAndValue<long int> > vecPV;
+    vecPV.reserve(dets.size());
+    for(unsigned int j=0; j < dets.size(); j++) {
+
+        PointAndValue<long int> tempPV;
+        std::vector<double> pairRADec;
             
-            pairRADec.push_back(convertToStandardDegrees(thisDetVec->at(j).getRA()));                    
-            pairRADec.push_back(convertToStandardDegrees(thisDetVec->at(j).getDec()));
+        pairRADec.push_back(convertToStandardDegrees(dets.at(j).getRA()));                    
+        pairRADec.push_back(convertToStandardDegrees(dets.at(j).getDec()));
             
-            tempPV.setPoint(pairRADec);
-            tempPV.setValue(thisDetVec->at(j).getID());
-            vecPV.push_back(tempPV);
+        tempPV.setPoint(pairRADec);
+        tempPV.setValue(dets.at(j).getID());
+        vecPV.push_back(tempPV);
+    }
+    return KDTree<long int>(vecPV, 2, leafSize);
+}
+
+
+
+
+/* comparisons for searching the sorted image times by their time
+ * since queryMJD.  Subtraction is monotonic, so comparing differences
+ * (rather than e.g. image time against queryMJD + dt) finds exactly
+ * the images with minDt <= image time - queryMJD <= maxDt. */
+class DtBelow {
+public:
+    DtBelow(double queryMJD) : myQueryMJD(queryMJD) {}
+    bool operator()(double imageMJD, double dt) const {
+        return imageMJD - myQueryMJD < dt;
+    }
+private:
+    double myQueryMJD;
+};
+
+class DtAbove {
+public:
+    DtAbove(double queryMJD) : myQueryMJD(queryMJD) {}
+    bool operator()(double dt, double imageMJD) const {
+        return dt < imageMJD - myQueryMJD;
+    }
+private:
+    double myQueryMJD;
+};
+
+
+
+void getCandidateImageRange(const std::vector<double> &imageTimes,
+                            unsigned int queryImage,
+                            const findTrackletsConfig &config,
+                            unsigned int &firstImage,
+                            unsigned int &lastImage)
+{
+    double queryMJD = imageTimes.at(queryImage);
+    // images with minDt <= (image time - query time) <= maxDt, and
+    // strictly after the query image.
+    firstImage = std::lower_bound(imageTimes.begin(), imageTimes.end(),
+                                  config.minDt, DtBelow(queryMJD))
+        - imageTimes.begin();
+    lastImage = std::upper_bound(imageTimes.begin(), imageTimes.end(),
+                                 config.maxDt, DtAbove(queryMJD))
+        - imageTimes.begin();
+    firstImage = std::max(firstImage, queryImage + 1);
+    lastImage = std::max(lastImage, firstImage);
+}
+
+
+
+void computeImageFootprints(const std::map<double, std::vector<MopsDetection> > &detectionSets,
+                            std::vector<ImageFootprint> &footprints)
+{
+    std::map<double, std::vector<MopsDetection> >::const_iterator imageIter;
+    footprints.reserve(detectionSets.size());
+    for (imageIter = detectionSets.begin(); imageIter != detectionSets.end(); 
+         imageIter++) {
+        footprints.push_back(computeImageFootprint(imageIter->second));
+    }
+}
+
+
+
+ImageFootprint computeImageFootprint(const std::vector<MopsDetection> &dets)
+{
+    // center the cap on the mean direction of the detections.
+    double sumX = 0., sumY = 0., sumZ = 0.;
+    for (unsigned int i = 0; i < dets.size(); i++) {
+        double x, y, z;
+        toCartesian_deg(dets[i].getRA(), dets[i].getDec(), x, y, z);
+        sumX += x;
+        sumY += y;
+        sumZ += z;
+    }
+    // any center will do, so long as the radius covers every
+    // detection from it.
+    ImageFootprint footprint;
+    toRaDec_deg(sumX, sumY, sumZ, footprint.RA, footprint.Dec);
+    footprint.RA = convertToStandardDegrees(footprint.RA);
+    footprint.radius = 0.;
+    for (unsigned int i = 0; i < dets.size(); i++) {
+        footprint.radius = maxOfTwo(
+            footprint.radius,
+            angularDistanceRADec_deg(dets[i].getRA(), dets[i].getDec(),
+                                     footprint.RA, footprint.Dec));
+    }
+    // leave room for rounding in the distances above.
+    footprint.radius += FOOTPRINT_SLACK;
+    return footprint;
+}
+
+
+
+
+unsigned int tuneLeafSize(const std::map<double, std::vector<MopsDetection> > &detectionSets,
+                          const findTrackletsConfig &config)
+{
+    std::vector<double> imageTimes;
+    std::vector<const std::vector<MopsDetection> *> imageDets;
+    std::map<double, std::vector<MopsDetection> >::const_iterator imageIter;
+    for (imageIter = detectionSets.begin(); imageIter != detectionSets.end();
+         imageIter++) {
+        imageTimes.push_back(imageIter->first);
+        imageDets.push_back(&(imageIter->second));
+    }
+    std::vector<ImageFootprint> footprints;
+    computeImageFootprints(detectionSets, footprints);
+
+    // the query images with something to search, and what to search
+    std::vector<unsigned int> queryImages;
+    std::vector<std::vector<unsigned int> > searchImages;
+    for (unsigned int queryImage = 0; queryImage < imageTimes.size(); queryImage++) {
+        unsigned int firstImage, lastImage;
+        getCandidateImageRange(imageTimes, queryImage, config, 
+                               firstImage, lastImage);
+        std::vector<unsigned int> candidates;
+        for (unsigned int image = firstImage; image < lastImage; image++) {
+            if (imagesMayPair(imageTimes[queryImage], footprints[queryImage],
+                              imageTimes[image], footprints[image], config)) {
+                candidates.push_back(image);
+            }
+        }
+        if (candidates.size() > 0) {
+            queryImages.push_back(queryImage);
+            searchImages.push_back(candidates);
+        }
+    }
+
+    // spread the sample over the whole set of images.
+    std::vector<unsigned int> sample;
+    unsigned int nSample = std::min((unsigned int) queryImages.size(), 
+                                    (unsigned int) TUNING_SAMPLE_IMAGES);
+    for (unsigned int i = 0; i < nSample; i++) {
+        sample.push_back(i * queryImages.size() / nSample);
+    }
+    if (sample.size() == 0) {
+        return config.leafSize;
+    }
+
+    const unsigned int leafSizes[] = TUNING_LEAF_SIZES;
+    unsigned int nLeafSizes = sizeof(leafSizes) / sizeof(leafSizes[0]);
+    unsigned int bestLeafSize = config.leafSize;
+    double bestTime = -1.;
+    findTrackletsStats ignoredStats;
+    for (unsigned int l = 0; l < nLeafSizes; l++) {
+        double start = wallClockSeconds();
+        // build just the trees the sample needs, as findTracklets
+        // would.
+        std::map<unsigned int, KDTree<long int> > trees;
+        for (unsigned int s = 0; s < sample.size(); s++) {
+            const std::vector<unsigned int> &candidates = searchImages[sample[s]];
+            for (unsigned int c = 0; c < candidates.size(); c++) {
+                if (trees.find(candidates[c]) == trees.end()) {
+                    trees[candidates[c]] = buildImageTree(*(imageDets[candidates[c]]),
+                                                          leafSizes[l]);
+                }
+            }
+        }
+
+        PairVector results;
+        for (unsigned int s = 0; s < sample.size(); s++) {
+            unsigned int queryImage = queryImages[sample[s]];
+            const std::vector<unsigned int> &candidates = searchImages[sample[s]];
+            std::vector<double> candidateTimes;
+            std::vector<const KDTree<long int> *> candidateTrees;
+            std::vector<const ImageFootprint *> candidateFootprints;
+            for (unsigned int c = 0; c < candidates.size(); c++) {
+                candidateTimes.push_back(imageTimes[candidates[c]]);
+                candidateTrees.push_back(&(trees[candidates[c]]));
+                candidateFootprints.push_back(&(footprints[candidates[c]]));
+            }
+            getTrackletsForImage(results, imageTimes[queryImage], 
+                                 *(imageDets[queryImage]), NULL, 
+                                 candidateTimes, candidateTrees, 
+                                 candidateFootprints, config, ignoredStats);
+            results.clear();
         }
+
+        double elapsed = wallClockSeconds() - start;
+        if ((bestTime < 0.) || (elapsed < bestTime)) {
+            bestTime = elapsed;
+            bestLeafSize = leafSizes[l];
+        }
+    }
+    std::cout << "Tuning on " << sample.size() << " images chose leaf size " 
+              << bestLeafSize << "." << std::endl;
+    return bestLeafSize;
+}
+
+
+
+void planImagePairs(const std::vector<double> &imageTimes,
+                    const std::vector<ImageFootprint> &footprints,
+                    const findTrackletsConfig &config,
+                    std::vector<std::vector<unsigned int> > &searchImages,
+                    findTrackletsStats &stats)
+{
+    searchImages.clear();
+    searchImages.resize(imageTimes.size());
+    for (unsigned int queryImage = 0; queryImage < imageTimes.size(); queryImage++) {
+        unsigned int firstImage, lastImage;
+        getCandidateImageRange(imageTimes, queryImage, config, 
+                               firstImage, lastImage);
+        for (unsigned int image = firstImage; image < lastImage; image++) {
+            stats.imagePairsCompared++;
+            if (imagesMayPair(imageTimes[queryImage], footprints[queryImage],
+                              imageTimes[image], footprints[image], config)) {
+                searchImages[queryImage].push_back(image);
+                stats.imagePairsSearched++;
+            }
+        }
+    }
+    std::cout << "Searching " << stats.imagePairsSearched << " of " 
+              << stats.imagePairsCompared
+              << " image pairs within the time window." << std::endl;
+}
+
+
+
+bool imagesMayPair(double queryMJD, const ImageFootprint &queryFootprint,
+                   double imageMJD, const ImageFootprint &imageFootprint,
+                   const findTrackletsConfig &config)
+{
+    // by the triangle inequality, if any pair of detections from
+    // these images is within maxDistance, the caps are within
+    // maxDistance of each other.
+    double maxDistance = (imageMJD - queryMJD) * config.maxV;
+    double centerDistance = angularDistanceRADec_deg(
+        queryFootprint.RA, queryFootprint.Dec,
+        imageFootprint.RA, imageFootprint.Dec);
+    return (centerDistance <= queryFootprint.radius + 
+            imageFootprint.radius + maxDistance);
+}
+
+
+
+
+/******************************************************************
+ * Find the tracklets starting at one query detection (from an image
+ * taken at queryMJD) in the given candidate images, appending them to
+ * results.  motion is what the query's trail says about its motion,
+ * or NULL if nothing.  The search counters of stats are updated as
+ * we go.
+ ******************************************************************/
+void getTrackletsForDetection(const MopsDetection &query,
+                              const DetectionMotion *motion,
+                              double queryMJD,
+                              const std::vector<double> &candidateTimes,
+                              const std::vector<const KDTree<long int> *> &candidateTrees,
+                              const std::vector<const ImageFootprint *> &candidateFootprints,
+                              const findTrackletsConfig &config,
+                              PairVector &results,
+                              findTrackletsStats &stats)
+{
+    std::vector<GeometryType> myGeos;
+    // we search RA, Dec only.
+    myGeos.push_back(RA_DEGREES);
+    myGeos.push_back(DEC_DEGREES);
+        
+    // vectors of RADecRangeSearch parameters we search
+    // exclusively in RA, Dec; the "otherDims" parameters sent to
+    // KDTree range search are empty.
+    std::vector<double> otherDimsTolerances;
+    std::vector<double> otherDimsPt;
+    // the partners found for the query detection in one image.
+    std::vector<long int> pairedIDs;
+        
+    const MopsDetection * curQuery = &query;
+    double queryRA = convertToStandardDegrees(curQuery->getRA());
+    double queryDec = convertToStandardDegrees(curQuery->getDec());
         
-        KDTree<long int> tempKDTree(vecPV, 2, LEAF_NODE_SIZE);
-        myTreeMap.insert(std::make_pair(thisEpoch, tempKDTree) );
+    // iterate through the KDTree of each candidate image, where each
+    // KDTree represents a unique MJD
+    for (unsigned int c = 0; c < candidateTrees.size(); c++) {
+            
+        double curMJD = candidateTimes[c];
+        const KDTree<long int> *curTree = candidateTrees[c];
+
+        double maxVelocity = config.maxV;
+        double minVelocity = config.minV;
+            
+        double maxDistance = (curMJD - queryMJD) * maxVelocity;
+        double minDistance = (curMJD - queryMJD) * minVelocity;
+        if (motion != NULL) {
+            trailDistanceRange(*motion, curMJD - queryMJD, config,
+                               minDistance, maxDistance);
+        }
+
+        // don't descend the tree if this detection can't reach
+        // anything in that image.
+        const ImageFootprint &footprint = *(candidateFootprints[c]);
+        if (angularDistanceRADec_deg(queryRA, queryDec, footprint.RA, 
+                                     footprint.Dec) 
+            > footprint.radius + maxDistance) {
+            continue;
+        }
+
+        std::vector<double> queryPt;
+        queryPt.push_back(queryRA);
+        queryPt.push_back(queryDec);
+            
+        // nothing can be both slow and fast enough.
+        if (minDistance >= maxDistance) {
+            continue;
+        }
+
+        // search the annulus between minDistance and maxDistance
+        // around this point; the tree skips anything entirely inside
+        // minDistance, and measures the great-circle distance to
+        // everything else, so all the results are good.
+        std::vector<PointAndValue<long int> > queryResults;
+        queryResults = curTree->RADecAnnulusSearch(queryPt, 
+                                                   maxOfTwo(minDistance, 0.),
+                                                   maxDistance,
+                                                   otherDimsPt, otherDimsTolerances,
+                                                   myGeos, 
+                                                   &(stats.nodesVisited));
+        stats.treeSearches++;
+        stats.candidatesReturned += queryResults.size();
+        // the tree gives its results in an order which depends on its
+        // leaf size; emit them in detection ID order, so the output
+        // (and collapseTracklets, downstream) doesn't.
+        pairedIDs.clear();
+        for (unsigned int ii = 0; ii < queryResults.size(); ii++) {
+            if (motion != NULL) {
+                // a trailed detection only pairs along its trail.
+                const std::vector<double> &resultPt = queryResults[ii].getPoint();
+                double distance = angularDistanceRADec_deg(queryRA, queryDec,
+                                                           resultPt[0], 
+                                                           resultPt[1]);
+                if (!isAlongTrail(*motion, queryRA, queryDec, resultPt[0], 
+                                  resultPt[1], distance, config)) {
+                    continue;
+                }
+            }
+            pairedIDs.push_back(queryResults[ii].getValue());
+        }
+        std::sort(pairedIDs.begin(), pairedIDs.end());
+        for (unsigned int ii = 0; ii < pairedIDs.size(); ii++) {
+            results.push_back(curQuery->getID(), pairedIDs[ii]);
+        }
+        stats.pairsAccepted += pairedIDs.size();
+    }
+}
+
+
+
+void trailDistanceRange(const DetectionMotion &motion, double dt,
+                        const findTrackletsConfig &config,
+                        double &minDistance, double &maxDistance)
+{
+    minDistance = maxOfTwo(minDistance, 
+                           (motion.rate - config.trailRateTolerance) * dt 
+                           - config.trailPositionTolerance);
+    maxDistance = minOfTwo(maxDistance, 
+                           (motion.rate + config.trailRateTolerance) * dt 
+                           + config.trailPositionTolerance);
+}
+
+
+
+bool isAlongTrail(const DetectionMotion &motion, 
+                  double RA0, double Dec0, double RA1, double Dec1,
+                  double distance, const findTrackletsConfig &config)
+{
+    // the position angle (north through east) of the offset, i.e. the
+    // initial bearing of the great circle from the first point.
+    Constants c;
+    double dec0 = c.deg_to_rad() * Dec0;
+    double dec1 = c.deg_to_rad() * Dec1;
+    double dRA = c.deg_to_rad() * (RA1 - RA0);
+    double offsetAngle = c.rad_to_deg() * 
+        atan2(sin(dRA) * cos(dec1), 
+              cos(dec0) * sin(dec1) - sin(dec0) * cos(dec1) * cos(dRA));
+
+    // the trail goes both ways, so only the angle mod 180 matters.
+    double angleDiff = fmod(fabs(offsetAngle - motion.angle), 180.);
+    angleDiff = minOfTwo(angleDiff, 180. - angleDiff);
+    if (angleDiff <= config.trailAngleTolerance) {
+        return true;
+    }
+    // short offsets are dominated by astrometric error, so also take
+    // anything close enough to the line of the trail.
+    return distance * sin(c.deg_to_rad() * angleDiff) 
+        <= config.trailPositionTolerance;
+}
+
+
+
+
+/* hand over a batch of tracklets to the (shared) results. */
+void flushTracklets(PairVector &batch, PairVector &results)
+{
+    results.append(batch);
+    batch.clear();
+}
+
+
+
+
+/******************************************************************
+ * As getTrackletsForDetection, but for every detection of one image
+ * against the given candidate images; the detections are split into
+ * blocks searched in parallel, and the blocks' results are handed
+ * over in order.
+ ******************************************************************/
+void getTrackletsForImage(PairVector &results,
+                          double queryMJD,
+                          const std::vector<MopsDetection> &queryPoints,
+                          const std::vector<DetectionMotion> *queryMotions,
+                          const std::vector<double> &candidateTimes,
+                          const std::vector<const KDTree<long int> *> &candidateTrees,
+                          const std::vector<const ImageFootprint *> &candidateFootprints,
+                          const findTrackletsConfig &config,
+                          findTrackletsStats &stats)
+{
+    unsigned int nQueries = queryPoints.size();
+    unsigned int nBlocks = (nQueries + QUERY_BLOCK_SIZE - 1) / QUERY_BLOCK_SIZE;
+    // PairVector can't be copied (it holds a stream), so hold pointers.
+    std::vector<PairVector *> blockResults(nBlocks);
+    std::vector<findTrackletsStats> blockStats(nBlocks);
+    for (unsigned int block = 0; block < nBlocks; block++) {
+        blockResults[block] = new PairVector();
+    }
+
+    // one image's worth of queries at a time, so look within them.
+#pragma omp parallel for schedule(dynamic, 1)
+    for (unsigned int block = 0; block < nBlocks; block++) {
+        unsigned int blockEnd = std::min(nQueries, (block + 1) * QUERY_BLOCK_SIZE);
+        for (unsigned int i = block * QUERY_BLOCK_SIZE; i < blockEnd; i++) {
+            const DetectionMotion *motion = NULL;
+            if ((queryMotions != NULL) && (queryMotions->at(i).isTrailed())) {
+                motion = &(queryMotions->at(i));
+            }
+            getTrackletsForDetection(queryPoints[i], motion, queryMJD, 
+                                     candidateTimes, candidateTrees, 
+                                     candidateFootprints, config, 
+                                     *(blockResults[block]), blockStats[block]);
+        }
+    }
+
+    for (unsigned int block = 0; block < nBlocks; block++) {
+        flushTracklets(*(blockResults[block]), results);
+        delete blockResults[block];
+        stats.addSearchCounts(blockStats[block]);
     }
 }
 
 
 
+
 /******************************************************************
- * Given a mapping of MJDs to KDTrees of PointAndValue pairs 
- * index by file line number index, generate tracklets for each 
- * query point within a distance determined by maxVelocity.
+ * Given the per-image KDTrees and the detections from each image,
+ * generate tracklets for each query point within a distance
+ * determined by maxVelocity.
  ******************************************************************/
-void getTracklets(TrackletVector &results,  
-		  const std::map<double, KDTree<long int> > &myTreeMap,
-		  const std::vector<MopsDetection> &queryPoints,
-		  findTrackletsConfig config)
+void getTracklets(PairVector &results,  
+                  const std::vector<double> &imageTimes,
+                  const std::vector<KDTree<long int> > &imageTrees,
+                  const std::vector<ImageFootprint> &footprints,
+                  const std::vector<std::vector<unsigned int> > &searchImages,
+                  const std::map<double, std::vector<MopsDetection> > &detectionSets,
+                  const std::map<double, std::vector<DetectionMotion> > &motionSets,
+		  findTrackletsConfig config,
+                  findTrackletsStats &stats)
 {
     int nthreads, tid;
     
@@ -207,96 +1064,121 @@ void getTracklets(TrackletVector &results,
         }	
     }
 
-#pragma omp parallel for schedule(dynamic, chunkSize) 
-    
-    for(unsigned int i=0; i<queryPoints.size(); i++) {
-        
-        std::vector<GeometryType> myGeos;
-        // we search RA, Dec only.
-        myGeos.push_back(RA_DEGREES);
-        myGeos.push_back(DEC_DEGREES);
-        
-        // vectors of RADecRangeSearch parameters we search
-        // exclusively in RA, Dec; the "otherDims" parameters sent to
-        // KDTree range search are empty.
-        std::vector<double> otherDimsTolerances;
-        std::vector<double> otherDimsPt;
-        
-        const MopsDetection * curQuery = &(queryPoints.at(i));
-        double queryRA = convertToStandardDegrees(curQuery->getRA());
-        double queryDec = convertToStandardDegrees(curQuery->getDec());
-        double queryMJD = curQuery->getEpochMJD();
-        
-        // iterate through each KDTree of detections, where each KDTree
-        // represents a unique MJD
-        std::map<double, KDTree<long int> >::const_iterator iter;
-        for(iter = myTreeMap.begin(); iter != myTreeMap.end(); iter++) {
-            
-            double curMJD = iter->first;     //map key
-            const KDTree<long int> *curTree = &(iter->second); //value associated with key
-            
-            //only consider this tree if it contains detections
-            //that occurred after the current one
-            if ((curMJD > queryMJD) && 
-                (curMJD - queryMJD >= config.minDt) && 
-                (curMJD - queryMJD <= config.maxDt)) {
-                
-                double maxVelocity = config.maxV;
-                double minVelocity = config.minV;
-                
-                double maxDistance = (curMJD - queryMJD) * maxVelocity;
-                double minDistance = (curMJD - queryMJD) * minVelocity;
-                std::vector<double> queryPt;
-                queryPt.push_back(queryRA);
-                queryPt.push_back(queryDec);
-                
-                std::vector<PointAndValue<long int> > queryResults;
-                
-                // do a rectangular search around this point. note that we 
-                    // use the haversine great-circle distance in the tree, so we are
-                    // sure that we get any object within maxDistance (and a few others)
-                queryResults = curTree->RADecRangeSearch(queryPt, maxDistance,
-                                                         otherDimsPt, otherDimsTolerances,
-                                                         myGeos);
-                // filter the results, getting the items which are actually within
-                // the circle we are searching, not the rectangle enclosing it.
-                std::vector<long int> closeEnoughResults;
-                
-                for (unsigned int ii = 0; ii < queryResults.size(); ii++) {
-                    PointAndValue<long int> * curResult = &(queryResults.at(ii));
-                    double resultRa = curResult->getPoint().at(0);
-                    double resultDec = curResult->getPoint().at(1);
-                    double properDistance =  angularDistanceRADec_deg(queryRA, 
-                                                                      queryDec, 
-                                                                          resultRa,
-                                                                      resultDec);
-                    if ((properDistance <= maxDistance) && (properDistance >= minDistance)) {
-                        closeEnoughResults.push_back(curResult->getValue());
-                    }
+    // line up the query detections from images with anything to
+    // search, and the candidate images searchImages says to look in
+    // for each image.
+    std::vector<const MopsDetection *> queryPoints;
+    std::vector<const DetectionMotion *> queryMotions;
+    std::vector<unsigned int> queryImages;
+    std::vector<std::vector<double> > candidateTimes(imageTimes.size());
+    std::vector<std::vector<const KDTree<long int> *> > candidateTrees(imageTimes.size());
+    std::vector<std::vector<const ImageFootprint *> > candidateFootprints(imageTimes.size());
+    std::map<double, std::vector<MopsDetection> >::const_iterator imageIter;
+    unsigned int queryImage = 0;
+    for (imageIter = detectionSets.begin(); imageIter != detectionSets.end();
+         imageIter++, queryImage++) {
+        if (searchImages[queryImage].size() == 0) {
+            continue;
+        }
+        for (unsigned int c = 0; c < searchImages[queryImage].size(); c++) {
+            unsigned int image = searchImages[queryImage][c];
+            candidateTimes[queryImage].push_back(imageTimes[image]);
+            candidateTrees[queryImage].push_back(&(imageTrees[image]));
+            candidateFootprints[queryImage].push_back(&(footprints[image]));
+        }
+        const std::vector<DetectionMotion> *imageMotions = NULL;
+        if (motionSets.size() != 0) {
+            imageMotions = &(motionSets.find(imageIter->first)->second);
+        }
+        for (unsigned int i = 0; i < imageIter->second.size(); i++) {
+            queryPoints.push_back(&(imageIter->second[i]));
+            queryImages.push_back(queryImage);
+            if ((imageMotions != NULL) && (imageMotions->at(i).isTrailed())) {
+                queryMotions.push_back(&(imageMotions->at(i)));
+            }
+            else {
+                queryMotions.push_back(NULL);
+            }
+        }
+    }
+
+    if (config.deterministicOutput) {
+        /* 
+         * take the queries a round of blocks at a time. Each block
+         * collects its tracklets privately; once the round is done,
+         * the blocks are handed over in order, so the output comes
+         * out just as findTracklets (serial) would write it.
+         */
+        unsigned int nQueries = queryPoints.size();
+        unsigned int nBlocks = (nQueries + QUERY_BLOCK_SIZE - 1) / QUERY_BLOCK_SIZE;
+        unsigned int blocksPerRound = BLOCKS_PER_THREAD_PER_ROUND * omp_get_max_threads();
+        std::vector<PairVector *> blockResults(blocksPerRound);
+        std::vector<findTrackletsStats> blockStats(blocksPerRound);
+        for (unsigned int block = 0; block < blocksPerRound; block++) {
+            blockResults[block] = new PairVector();
+        }
+
+        for (unsigned int roundStart = 0; roundStart < nBlocks; 
+             roundStart += blocksPerRound) {
+            unsigned int roundEnd = std::min(nBlocks, roundStart + blocksPerRound);
+
+#pragma omp parallel for schedule(dynamic, 1)
+            for (unsigned int block = roundStart; block < roundEnd; block++) {
+                unsigned int blockEnd = std::min(nQueries, 
+                                                 (block + 1) * QUERY_BLOCK_SIZE);
+                for (unsigned int i = block * QUERY_BLOCK_SIZE; i < blockEnd; i++) {
+                    unsigned int q = queryImages[i];
+                    getTrackletsForDetection(*(queryPoints[i]), queryMotions[i],
+                                             imageTimes[q],
+                                             candidateTimes[q], candidateTrees[q],
+                                             candidateFootprints[q], config,
+                                             *(blockResults[block - roundStart]),
+                                             blockStats[block - roundStart]);
                 }
-                
-                for (unsigned int ii = 0; ii < closeEnoughResults.size(); ii++) {
-                    // collect results for each query point's results for each MJD
-                    Tracklet newTracklet;
-                    newTracklet.indices.insert(curQuery->getID());               
-                    newTracklet.indices.insert(closeEnoughResults.at(ii));
-                    // copy results to local vector, avoid overhead of a
-                    // critical section till done searching
+            }
+
+            for (unsigned int block = roundStart; block < roundEnd; block++) {
+                flushTracklets(*(blockResults[block - roundStart]), results);
+                stats.addSearchCounts(blockStats[block - roundStart]);
+                blockStats[block - roundStart] = findTrackletsStats();
+            }
+        }
+        for (unsigned int block = 0; block < blocksPerRound; block++) {
+            delete blockResults[block];
+        }
+    }
+    else {
+        /* each thread collects tracklets (and counts its work) on its
+         * own, and only takes the lock to hand over a full buffer (and
+         * whatever is left at the end). */
+#pragma omp parallel
+        {
+            PairVector localResults;
+            findTrackletsStats localStats;
+
+#pragma omp for schedule(dynamic, chunkSize) 
+            for(unsigned int i=0; i<queryPoints.size(); i++) {
+                unsigned int q = queryImages[i];
+                getTrackletsForDetection(*(queryPoints[i]), queryMotions[i],
+                                         imageTimes[q],
+                                         candidateTimes[q], candidateTrees[q],
+                                         candidateFootprints[q], config, 
+                                         localResults, localStats);
+                if (localResults.size() >= THREAD_OUTPUT_BUFFER_SIZE) {
 #pragma omp critical(writeResults)
                     {
-                        results.push_back(newTracklet);
+                        flushTracklets(localResults, results);
                     }
                 }
-                
-                queryResults.clear();
-                queryPt.clear();
+            }
+
+#pragma omp critical(writeResults)
+            {
+                flushTracklets(localResults, results);
+                stats.addSearchCounts(localStats);
             }
         }
     }
-    
-    
-
-
 }
 
 
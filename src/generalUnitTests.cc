@@ -5,18 +5,29 @@
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <sstream>
 #include <string>
 #include <cmath>
+#include <cstdlib>
+#include <dirent.h>
+#include <unistd.h>
 
 
 #include "lsst/mops/MopsDetection.h"
 #include "lsst/mops/Exceptions.h"
 #include "lsst/mops/Tracklet.h"
+#include "lsst/mops/TrackletVector.h"
 #include "lsst/mops/PointAndValue.h"
 #include "lsst/mops/common.h"
 #include "lsst/mops/KDTree.h"
+#include "lsst/mops/FlatKDTree.h"
 #include "lsst/mops/rmsLineFit.h"
 #include "lsst/mops/removeSubsets.h"
+#include "lsst/mops/DetectionToTrackIndex.h"
+#include "lsst/mops/removeDuplicates.h"
+#include "lsst/mops/removeSubsetsExternal.h"
+#include "lsst/mops/SkyPartitionedDetectionStore.h"
+#include "lsst/mops/fileUtils.h"
 
 
 using namespace lsst::mops;
@@ -49,6 +60,53 @@ void addDetectionAt(double MJD, double RA, double dec,  std::vector<MopsDetectio
 
 
 
+// a fresh directory under /tmp for a test's files, removed (with the
+// files in it) when it goes out of scope, even if the test fails.
+class TempDir {
+public:
+    TempDir(const std::string &prefix)
+        {
+            std::string name = "/tmp/" + prefix + "XXXXXX";
+            std::vector<char> nameTemplate(name.begin(), name.end());
+            nameTemplate.push_back('\0');
+            if (mkdtemp(&nameTemplate[0]) != NULL) {
+                dir = &nameTemplate[0];
+            }
+        }
+
+    ~TempDir()
+        {
+            if (dir.empty()) {
+                return;
+            }
+            DIR *dirHandle = opendir(dir.c_str());
+            if (dirHandle != NULL) {
+                struct dirent *entry;
+                while ((entry = readdir(dirHandle)) != NULL) {
+                    std::string entryName(entry->d_name);
+                    if ((entryName != ".") && (entryName != "..")) {
+                        unlink(path(entryName).c_str());
+                    }
+                }
+                closedir(dirHandle);
+            }
+            rmdir(dir.c_str());
+        }
+
+    bool created() const { return !dir.empty(); }
+
+    std::string path(const std::string &fileName) const { return dir + "/" + fileName; }
+
+    // empty if the directory couldn't be made.
+    std::string dir;
+
+private:
+    TempDir(const TempDir &);
+    TempDir & operator=(const TempDir &);
+};
+
+
+
 
 
 ///////////////////////////////////////////////////////////////////////
@@ -1029,6 +1087,470 @@ BOOST_AUTO_TEST_CASE ( KDTree_RADecRangeSearch_6 )
 
 
 
+BOOST_AUTO_TEST_CASE ( KDTree_hyperRectangleSearch_bruteForce_1 )
+{
+    // mixed geometries, with queries which wrap around 0 on the
+    // circular axes; compare against a brute-force scan.
+    srand(7);
+    std::vector<PointAndValue <int> > pav;
+    int count = 0;
+    for (unsigned int i = 0; i < 2000; i++) {
+        std::vector<double> tmpPt;
+        tmpPt.push_back(360. * rand() / (RAND_MAX + 1.));
+        tmpPt.push_back(2. * M_PI * rand() / (RAND_MAX + 1.));
+        tmpPt.push_back(-10. + 20. * rand() / (RAND_MAX + 1.));
+        insertPoint(tmpPt, count, pav);
+    }
+    std::vector<GeometryType> geos;
+    geos.push_back(CIRCULAR_DEGREES);
+    geos.push_back(CIRCULAR_RADIANS);
+    geos.push_back(EUCLIDEAN);
+
+    KDTree<int> myTree(pav, 3, 8);
+
+    for (unsigned int q = 0; q < 200; q++) {
+        std::vector<double> queryPt, tolerances;
+        queryPt.push_back(360. * rand() / (RAND_MAX + 1.));
+        queryPt.push_back(2. * M_PI * rand() / (RAND_MAX + 1.));
+        queryPt.push_back(-10. + 20. * rand() / (RAND_MAX + 1.));
+        tolerances.push_back(60. * rand() / (RAND_MAX + 1.));
+        tolerances.push_back(1. * rand() / (RAND_MAX + 1.));
+        tolerances.push_back(5. * rand() / (RAND_MAX + 1.));
+        
+        std::vector<PointAndValue<int> > matches = 
+            myTree.hyperRectangleSearch(queryPt, tolerances, geos);
+        std::set<int> found;
+        for (unsigned int i = 0; i < matches.size(); i++) {
+            found.insert(matches[i].getValue());
+        }
+        BOOST_CHECK(found.size() == matches.size());
+
+        std::set<int> expected;
+        for (unsigned int i = 0; i < pav.size(); i++) {
+            bool inRange = true;
+            for (unsigned int d = 0; d < 3; d++) {
+                if (distance1D(pav[i].getPoint()[d], queryPt[d], geos[d]) 
+                    > tolerances[d]) {
+                    inRange = false;
+                }
+            }
+            if (inRange) {
+                expected.insert(pav[i].getValue());
+            }
+        }
+        BOOST_CHECK(found == expected);
+    }
+}
+
+
+
+BOOST_AUTO_TEST_CASE ( KDTree_bigTree_1 )
+{
+    // big enough that (under OpenMP) the tree is built in parallel;
+    // results must be the same as a brute-force scan, in the same order
+    // as a second build of the same tree.
+    srand(11);
+    std::vector<PointAndValue <int> > pav;
+    int count = 0;
+    for (unsigned int i = 0; i < 3 * KDTREE_PARALLEL_BUILD_CUTOFF; i++) {
+        std::vector<double> tmpPt;
+        tmpPt.push_back(100. * rand() / (RAND_MAX + 1.));
+        tmpPt.push_back(100. * rand() / (RAND_MAX + 1.));
+        // lots of ties along this axis
+        tmpPt.push_back(rand() % 10);
+        insertPoint(tmpPt, count, pav);
+    }
+    std::vector<GeometryType> geos(3, EUCLIDEAN);
+    KDTree<int> tree1(pav, 3, 16);
+    KDTree<int> tree2(pav, 3, 16);
+    BOOST_CHECK(tree1.size() == tree2.size());
+    BOOST_CHECK(tree1.myRoot->getId() == 1);
+
+    for (unsigned int q = 0; q < 50; q++) {
+        std::vector<double> queryPt, tolerances;
+        queryPt.push_back(100. * rand() / (RAND_MAX + 1.));
+        queryPt.push_back(100. * rand() / (RAND_MAX + 1.));
+        queryPt.push_back(rand() % 10);
+        tolerances.push_back(3.);
+        tolerances.push_back(3.);
+        tolerances.push_back(1.);
+        std::vector<PointAndValue<int> > matches1 = 
+            tree1.hyperRectangleSearch(queryPt, tolerances, geos);
+        std::vector<PointAndValue<int> > matches2 = 
+            tree2.hyperRectangleSearch(queryPt, tolerances, geos);
+        
+        BOOST_REQUIRE(matches1.size() == matches2.size());
+        std::set<int> found;
+        for (unsigned int i = 0; i < matches1.size(); i++) {
+            BOOST_CHECK(matches1[i].getValue() == matches2[i].getValue());
+            found.insert(matches1[i].getValue());
+        }
+        std::set<int> expected;
+        for (unsigned int i = 0; i < pav.size(); i++) {
+            bool inRange = true;
+            for (unsigned int d = 0; d < 3; d++) {
+                if (fabs(pav[i].getPoint()[d] - queryPt[d]) > tolerances[d]) {
+                    inRange = false;
+                }
+            }
+            if (inRange) {
+                expected.insert(pav[i].getValue());
+            }
+        }
+        BOOST_CHECK(found == expected);
+    }
+}
+
+
+
+BOOST_AUTO_TEST_CASE ( KDTree_nearestNeighbors_1 )
+{
+    // Euclidean k-NN against a brute-force sort of all the distances.
+    srand(13);
+    std::vector<PointAndValue <int> > pav;
+    int count = 0;
+    for (unsigned int i = 0; i < 3000; i++) {
+        std::vector<double> tmpPt;
+        tmpPt.push_back(100. * rand() / (RAND_MAX + 1.));
+        tmpPt.push_back(100. * rand() / (RAND_MAX + 1.));
+        tmpPt.push_back(10. * rand() / (RAND_MAX + 1.));
+        insertPoint(tmpPt, count, pav);
+    }
+    KDTree<int> myTree(pav, 3, 8);
+
+    for (unsigned int q = 0; q < 100; q++) {
+        std::vector<double> queryPt;
+        queryPt.push_back(-10. + 120. * rand() / (RAND_MAX + 1.));
+        queryPt.push_back(-10. + 120. * rand() / (RAND_MAX + 1.));
+        queryPt.push_back(10. * rand() / (RAND_MAX + 1.));
+        unsigned int k = 1 + q % 20;
+        double maxDistance = (q % 3 == 0) ? 3. : HUGE_VAL;
+
+        std::vector<double> allDists;
+        for (unsigned int i = 0; i < pav.size(); i++) {
+            double d = euclideanDistance(queryPt, pav[i].getPoint(), 3);
+            if (d <= maxDistance) {
+                allDists.push_back(d);
+            }
+        }
+        std::sort(allDists.begin(), allDists.end());
+        
+        std::vector<double> dists;
+        std::vector<PointAndValue<int> > results = 
+            myTree.nearestNeighbors(queryPt, k, maxDistance, &dists);
+        BOOST_CHECK(results.size() == minOfTwo(k, allDists.size()));
+        BOOST_CHECK(dists.size() == results.size());
+        for (unsigned int i = 0; i < results.size(); i++) {
+            BOOST_CHECK(areEqual(dists[i], allDists[i]));
+            BOOST_CHECK(areEqual(dists[i], euclideanDistance(
+                                     queryPt, results[i].getPoint(), 3)));
+        }
+    }
+
+    // nothing within range
+    std::vector<double> farPt(3, 1000.);
+    BOOST_CHECK(myTree.nearestNeighbors(farPt, 5, 10.).size() == 0);
+    BOOST_CHECK(myTree.nearestNeighbors(farPt, 0).size() == 0);
+}
+
+
+
+BOOST_AUTO_TEST_CASE ( KDTree_RADecNearestNeighbors_1 )
+{
+    // great-circle k-NN with a cut on time, including queries near the
+    // poles and across RA 0; compare against brute force.
+    srand(17);
+    std::vector<PointAndValue <int> > pav;
+    int count = 0;
+    for (unsigned int i = 0; i < 3000; i++) {
+        std::vector<double> tmpPt;
+        tmpPt.push_back(360. * rand() / (RAND_MAX + 1.));
+        double dec = asin(2. * rand() / (RAND_MAX + 1.) - 1.) * 180. / M_PI;
+        tmpPt.push_back(convertToStandardDegrees(dec));
+        tmpPt.push_back(rand() % 5);
+        insertPoint(tmpPt, count, pav);
+    }
+    std::vector<GeometryType> geos;
+    geos.push_back(RA_DEGREES);
+    geos.push_back(DEC_DEGREES);
+    geos.push_back(EUCLIDEAN);
+    KDTree<int> myTree(pav, 3, 8);
+
+    for (unsigned int q = 0; q < 100; q++) {
+        std::vector<double> queryPt, otherPt, otherTol;
+        queryPt.push_back(360. * rand() / (RAND_MAX + 1.));
+        if (q < 10) {
+            queryPt.push_back(q % 2 == 0 ? 89.5 : -89.5);
+        }
+        else {
+            queryPt.push_back(-90. + 180. * rand() / (RAND_MAX + 1.));
+        }
+        otherPt.push_back(q % 5);
+        otherTol.push_back((q % 2 == 0) ? .5 : 1.5);
+        unsigned int k = 1 + q % 10;
+        double maxDistance = (q % 3 == 0) ? 10. : 180.;
+
+        std::vector<double> allDists;
+        for (unsigned int i = 0; i < pav.size(); i++) {
+            const std::vector<double> &pt = pav[i].getPoint();
+            if (fabs(pt[2] - otherPt[0]) > otherTol[0]) {
+                continue;
+            }
+            double d = angularDistanceRADec_deg(pt[0], pt[1], 
+                                                queryPt[0], queryPt[1]);
+            if (d <= maxDistance) {
+                allDists.push_back(d);
+            }
+        }
+        std::sort(allDists.begin(), allDists.end());
+
+        std::vector<double> dists;
+        std::vector<PointAndValue<int> > results = 
+            myTree.RADecNearestNeighbors(queryPt, k, maxDistance, 
+                                         otherPt, otherTol, geos, &dists);
+        BOOST_CHECK(results.size() == minOfTwo(k, allDists.size()));
+        for (unsigned int i = 0; i < results.size(); i++) {
+            BOOST_CHECK(areEqual(dists[i], allDists[i]));
+            BOOST_CHECK(fabs(results[i].getPoint()[2] - otherPt[0]) 
+                        <= otherTol[0]);
+        }
+    }
+}
+
+
+bool sameResults(const std::vector<PointAndValue <int> > &a,
+                 const std::vector<PointAndValue <int> > &b)
+{
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (unsigned int i = 0; i < a.size(); i++) {
+        if ((a[i].getValue() != b[i].getValue()) ||
+            (a[i].getPoint() != b[i].getPoint())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+
+BOOST_AUTO_TEST_CASE ( KDTree_RADecAnnulusSearch_1 )
+{
+    // an annulus search (with a cut on time) must return just what
+    // RADecRangeSearch on the outer radius does, minus anything
+    // inside the inner radius, in the same order; try queries near the
+    // poles and across RA 0, and thick and thin annuli.
+    srand(36);
+    std::vector<PointAndValue <int> > pav;
+    int count = 0;
+    for (unsigned int i = 0; i < 4000; i++) {
+        std::vector<double> tmpPt;
+        tmpPt.push_back(360. * rand() / (RAND_MAX + 1.));
+        double dec = asin(2. * rand() / (RAND_MAX + 1.) - 1.) * 180. / M_PI;
+        tmpPt.push_back(convertToStandardDegrees(dec));
+        tmpPt.push_back(rand() % 5);
+        insertPoint(tmpPt, count, pav);
+    }
+    std::vector<GeometryType> geos;
+    geos.push_back(RA_DEGREES);
+    geos.push_back(DEC_DEGREES);
+    geos.push_back(EUCLIDEAN);
+    KDTree<int> myTree(pav, 3, 8);
+
+    unsigned int nFound = 0;
+    for (unsigned int q = 0; q < 100; q++) {
+        std::vector<double> queryPt, otherPt, otherTol;
+        queryPt.push_back((q % 7 == 0) ? .1 : 360. * rand() / (RAND_MAX + 1.));
+        if (q < 10) {
+            queryPt.push_back(q % 2 == 0 ? 89.5 : -89.5);
+        }
+        else {
+            queryPt.push_back(-90. + 180. * rand() / (RAND_MAX + 1.));
+        }
+        otherPt.push_back(q % 5);
+        otherTol.push_back(1.5);
+        double outerRadius = 2. + (q % 4) * 6.;
+        double innerRadius = outerRadius * ((q % 3) / 3.);
+
+        std::vector<PointAndValue<int> > inRange = 
+            myTree.RADecRangeSearch(queryPt, outerRadius, otherPt, otherTol, geos);
+        std::vector<PointAndValue<int> > expected;
+        for (unsigned int i = 0; i < inRange.size(); i++) {
+            const std::vector<double> &pt = inRange[i].getPoint();
+            if (angularDistanceRADec_deg(pt[0], pt[1], 
+                                         convertToStandardDegrees(queryPt[0]), 
+                                         convertToStandardDegrees(queryPt[1]))
+                >= innerRadius) {
+                expected.push_back(inRange[i]);
+            }
+        }
+
+        std::vector<PointAndValue<int> > results = 
+            myTree.RADecAnnulusSearch(queryPt, innerRadius, outerRadius, 
+                                      otherPt, otherTol, geos);
+        BOOST_CHECK(sameResults(results, expected));
+        nFound += results.size();
+    }
+    BOOST_CHECK(nFound > 0);
+
+    // both radii are inclusive: points exactly on either circle are
+    // found.
+    std::vector<PointAndValue <int> > edgePav;
+    std::vector<double> edgePt;
+    edgePt.push_back(11.);
+    edgePt.push_back(1.);
+    edgePt.push_back(0.);
+    int edgeCount = 0;
+    insertPoint(edgePt, edgeCount, edgePav);
+    KDTree<int> edgeTree(edgePav, 3, 8);
+    std::vector<double> queryPt, otherPt, otherTol;
+    queryPt.push_back(10.);
+    queryPt.push_back(0.);
+    otherPt.push_back(0.);
+    otherTol.push_back(1.);
+    double edgeDistance = angularDistanceRADec_deg(11., 1., 10., 0.);
+    BOOST_CHECK(edgeTree.RADecAnnulusSearch(queryPt, 0., edgeDistance, 
+                                            otherPt, otherTol, geos).size() == 1);
+    BOOST_CHECK(edgeTree.RADecAnnulusSearch(queryPt, edgeDistance, 2., 
+                                            otherPt, otherTol, geos).size() == 1);
+}
+
+
+
+BOOST_AUTO_TEST_CASE ( FlatKDTree_1 )
+{
+    // a snapshot must answer every kind of query exactly as the tree
+    // it was taken from, in the same order.
+    srand(19);
+    std::vector<PointAndValue <int> > pav;
+    int count = 0;
+    for (unsigned int i = 0; i < 3000; i++) {
+        std::vector<double> tmpPt;
+        tmpPt.push_back(360. * rand() / (RAND_MAX + 1.));
+        double dec = -30. + 60. * rand() / (RAND_MAX + 1.);
+        tmpPt.push_back(convertToStandardDegrees(dec));
+        tmpPt.push_back(rand() % 5);
+        insertPoint(tmpPt, count, pav);
+    }
+    std::vector<GeometryType> RADecGeos;
+    RADecGeos.push_back(RA_DEGREES);
+    RADecGeos.push_back(DEC_DEGREES);
+    RADecGeos.push_back(EUCLIDEAN);
+    std::vector<GeometryType> rectGeos;
+    rectGeos.push_back(CIRCULAR_DEGREES);
+    rectGeos.push_back(CIRCULAR_DEGREES);
+    rectGeos.push_back(EUCLIDEAN);
+    KDTree<int> myTree(pav, 3, 8);
+
+    TempDir tempDir("mopsFlatKDTree");
+    BOOST_REQUIRE(tempDir.created());
+    std::string fileName = tempDir.path("tree.kdt");
+    FlatKDTree<int>::writeSnapshot(myTree, fileName);
+
+    FlatKDTree<int> flatTree(fileName);
+    BOOST_CHECK(flatTree.getK() == 3);
+    BOOST_CHECK(flatTree.size() == myTree.size());
+    BOOST_CHECK(flatTree.numPoints() == pav.size());
+
+    for (unsigned int q = 0; q < 50; q++) {
+        std::vector<double> queryPt, tolerances, RADecPt, otherPt, otherTol;
+        RADecPt.push_back(360. * rand() / (RAND_MAX + 1.));
+        RADecPt.push_back(-30. + 60. * rand() / (RAND_MAX + 1.));
+        otherPt.push_back(q % 5);
+        otherTol.push_back(.5);
+        queryPt.push_back(RADecPt[0]);
+        queryPt.push_back(convertToStandardDegrees(RADecPt[1]));
+        queryPt.push_back(otherPt[0]);
+        tolerances.push_back(10.);
+        tolerances.push_back(5.);
+        tolerances.push_back(1.);
+
+        BOOST_CHECK(sameResults(
+                        myTree.hyperRectangleSearch(queryPt, tolerances, rectGeos),
+                        flatTree.hyperRectangleSearch(queryPt, tolerances, rectGeos)));
+        BOOST_CHECK(sameResults(
+                        myTree.RADecRangeSearch(RADecPt, 5., otherPt, otherTol, 
+                                                RADecGeos),
+                        flatTree.RADecRangeSearch(RADecPt, 5., otherPt, otherTol, 
+                                                  RADecGeos)));
+        BOOST_CHECK(sameResults(
+                        myTree.nearestNeighbors(queryPt, 7),
+                        flatTree.nearestNeighbors(queryPt, 7)));
+        BOOST_CHECK(sameResults(
+                        myTree.RADecNearestNeighbors(RADecPt, 7, 180., otherPt, 
+                                                     otherTol, RADecGeos),
+                        flatTree.RADecNearestNeighbors(RADecPt, 7, 180., otherPt, 
+                                                       otherTol, RADecGeos)));
+    }
+
+    // an empty tree makes an empty snapshot.
+    KDTree<int> emptyTree;
+    std::string emptyFileName = tempDir.path("empty.kdt");
+    FlatKDTree<int>::writeSnapshot(emptyTree, emptyFileName);
+    FlatKDTree<int> emptyFlatTree(emptyFileName);
+    BOOST_CHECK(emptyFlatTree.size() == 0);
+    BOOST_CHECK(emptyFlatTree.nearestNeighbors(std::vector<double>(), 3).size() == 0);
+}
+
+
+
+
+
+///////////////////////////////////////////////////////////////////////
+//    PAIRVECTOR TESTS
+///////////////////////////////////////////////////////////////////////
+
+BOOST_AUTO_TEST_CASE( PairVector_1 )
+{
+    // pairs must come back (and be written) just as the equivalent
+    // Tracklets would.
+    PairVector pairs;
+    std::vector<Tracklet> tracklets;
+    for (unsigned int i = 0; i < 20; i++) {
+        unsigned int id1 = (i * 7) % 13 + 100 * i;
+        unsigned int id2 = (i * 5) % 11 + 50 * i;
+        pairs.push_back(id1, id2);
+        Tracklet t;
+        t.indices.insert(id1);
+        t.indices.insert(id2);
+        tracklets.push_back(t);
+    }
+    BOOST_CHECK(pairs.size() == 20);
+    BOOST_CHECK(pairs.at(1).first == 55);
+    BOOST_CHECK(pairs.at(1).second == 107);
+
+    TrackletVector converted;
+    pairs.toTracklets(converted);
+    BOOST_REQUIRE(converted.size() == tracklets.size());
+    for (unsigned int i = 0; i < tracklets.size(); i++) {
+        BOOST_CHECK(converted.at(i) == tracklets.at(i));
+    }
+
+    TempDir tempDir("mopsPairVector");
+    BOOST_REQUIRE(tempDir.created());
+    std::string pairsFileName = tempDir.path("pairs");
+    std::string trackletsFileName = tempDir.path("tracklets");
+    {
+        // use a small cache, so we purge to file along the way.
+        PairVector pairsOut(pairsFileName, true, 3);
+        pairsOut.append(pairs);
+    }
+    writeTrackletsToOutFile(&tracklets, trackletsFileName);
+
+    std::ifstream pairsFile(pairsFileName.c_str());
+    std::ifstream trackletsFile(trackletsFileName.c_str());
+    std::stringstream pairsContents;
+    std::stringstream trackletsContents;
+    pairsContents << pairsFile.rdbuf();
+    trackletsContents << trackletsFile.rdbuf();
+    BOOST_CHECK(pairsContents.str().size() > 0);
+    BOOST_CHECK(pairsContents.str() == trackletsContents.str());
+}
+
+
+
+
 
 //TBD: whitebox tests, probably after integrating exceptions
 
@@ -1142,6 +1664,83 @@ BOOST_AUTO_TEST_CASE( rmsForTracklet_blackbox_4 )
 
 
 
+BOOST_AUTO_TEST_CASE( LinearFitAccumulator_1 )
+{
+    // the running-sums fit should agree with rmsForTracklet, adding
+    // detections one at a time and in any order, across RA 0 too.
+    std::vector<MopsDetection> dets;
+    addDetectionAt(5330.0, 10.0, 9.9, dets);
+    addDetectionAt(5330.1, 11.0, 11.1, dets);
+    addDetectionAt(5330.2, 12.0, 11.9, dets);
+    addDetectionAt(5330.3, 13.0, 13.1, dets);
+    addDetectionAt(5330.0, 359.5, 10.0, dets);
+    addDetectionAt(5330.1, 359.9, 10.1, dets);
+    addDetectionAt(5330.2, 0.31, 10.2, dets);
+
+    unsigned int order[] = {2, 0, 3, 1};
+    LinearFitAccumulator fit;
+    Tracklet t;
+    for (unsigned int i = 0; i < 4; i++) {
+        fit.add(dets[order[i]]);
+        t.indices.insert(order[i]);
+        BOOST_CHECK(fit.size() == i + 1);
+        if (i > 0) {
+            BOOST_CHECK(fabs(fit.rms() - rmsForTracklet(t, &dets)) < 1e-12);
+        }
+    }
+    std::vector<double> perDetSqDist;
+    rmsForTracklet(t, &dets, &perDetSqDist);
+    for (unsigned int i = 0; i < 4; i++) {
+        BOOST_CHECK(fabs(fit.sqDist(dets[i]) - perDetSqDist[i]) < 1e-12);
+    }
+
+    LinearFitAccumulator wrapped;
+    Tracklet t2;
+    for (unsigned int i = 4; i < 7; i++) {
+        wrapped.add(dets[i]);
+        t2.indices.insert(i);
+    }
+    BOOST_CHECK(fabs(wrapped.rms() - rmsForTracklet(t2, &dets)) < 1e-12);
+    BOOST_CHECK(wrapped.rms() > 0.);
+}
+
+
+
+BOOST_AUTO_TEST_CASE( LinearFitAccumulator_remove_1 )
+{
+    // removing detections, including the first added, should leave
+    // the fit to the rest.
+    std::vector<MopsDetection> dets;
+    addDetectionAt(5330.0, 10.0, 9.9, dets);
+    addDetectionAt(5330.1, 11.0, 11.1, dets);
+    addDetectionAt(5330.2, 12.0, 11.9, dets);
+    addDetectionAt(5330.3, 13.0, 13.1, dets);
+    addDetectionAt(5330.4, 14.5, 14.0, dets);
+
+    LinearFitAccumulator fit;
+    Tracklet t;
+    for (unsigned int i = 0; i < dets.size(); i++) {
+        fit.add(dets[i]);
+        t.indices.insert(i);
+    }
+    unsigned int toRemove[] = {4, 0};
+    for (unsigned int r = 0; r < 2; r++) {
+        fit.remove(dets[toRemove[r]]);
+        t.indices.erase(toRemove[r]);
+        BOOST_CHECK(fit.size() == t.indices.size());
+        BOOST_CHECK(fabs(fit.rms() - rmsForTracklet(t, &dets)) < 1e-12);
+        std::vector<double> perDetSqDist;
+        rmsForTracklet(t, &dets, &perDetSqDist);
+        unsigned int i = 0;
+        for (std::set<unsigned int>::iterator detIter = t.indices.begin();
+             detIter != t.indices.end(); detIter++, i++) {
+            BOOST_CHECK(fabs(fit.sqDist(dets[*detIter]) - perDetSqDist[i]) < 1e-12);
+        }
+    }
+}
+
+
+
 
 
 
@@ -1291,6 +1890,247 @@ BOOST_AUTO_TEST_CASE( putLongestOnlyInOutputVector_blackbox_2 )
 
 
 
+BOOST_AUTO_TEST_CASE( DetectionToTrackIndex_1 )
+{
+    // tracks 0: 0 1 2,  1: 0 4,  2: 4 5 6,  3: 0 1 2
+    std::vector<Tracklet> tracks(4);
+    tracks[0].indices.insert(0);
+    tracks[0].indices.insert(1);
+    tracks[0].indices.insert(2);
+    tracks[1].indices.insert(0);
+    tracks[1].indices.insert(4);
+    tracks[2].indices.insert(4);
+    tracks[2].indices.insert(5);
+    tracks[2].indices.insert(6);
+    tracks[3] = tracks[0];
+
+    DetectionToTrackIndex index(tracks);
+    // dense: 7 slots, one per detection 0..6, 3 unused.
+    BOOST_CHECK(index.numSlots() == 7);
+    BOOST_CHECK(index.slotOf(4) == 4);
+    BOOST_CHECK(index.slotOf(7) == DetectionToTrackIndex::NO_SLOT);
+    BOOST_CHECK(index.size(index.slotOf(3)) == 0);
+
+    std::vector<unsigned int> got(index.begin(0), index.end(0));
+    BOOST_REQUIRE(got.size() == 3);
+    BOOST_CHECK(got[0] == 0);
+    BOOST_CHECK(got[1] == 1);
+    BOOST_CHECK(got[2] == 3);
+
+    got.assign(index.begin(4), index.end(4));
+    BOOST_REQUIRE(got.size() == 2);
+    BOOST_CHECK(got[0] == 1);
+    BOOST_CHECK(got[1] == 2);
+}
+
+
+
+BOOST_AUTO_TEST_CASE( DetectionToTrackIndex_2 )
+{
+    // detection IDs rather than indices: far too sparse to give every
+    // possible ID a slot.
+    std::vector<std::set<unsigned int> > tracks(3);
+    tracks[0].insert(1000000);
+    tracks[0].insert(3000000);
+    tracks[1].insert(2000000);
+    tracks[1].insert(3000000);
+    tracks[2].insert(5);
+
+    DetectionToTrackIndex index(tracks);
+    BOOST_CHECK(index.numSlots() == 4);
+    BOOST_CHECK(index.slotOf(4) == DetectionToTrackIndex::NO_SLOT);
+    BOOST_CHECK(index.slotOf(2500000) == DetectionToTrackIndex::NO_SLOT);
+
+    unsigned int slot = index.slotOf(3000000);
+    BOOST_REQUIRE(slot != DetectionToTrackIndex::NO_SLOT);
+    std::vector<unsigned int> got(index.begin(slot), index.end(slot));
+    BOOST_REQUIRE(got.size() == 2);
+    BOOST_CHECK(got[0] == 0);
+    BOOST_CHECK(got[1] == 1);
+
+    slot = index.slotOf(5);
+    BOOST_REQUIRE(slot != DetectionToTrackIndex::NO_SLOT);
+    BOOST_CHECK(index.size(slot) == 1);
+    BOOST_CHECK(*index.begin(slot) == 2);
+}
+
+
+
+BOOST_AUTO_TEST_CASE( DetectionToTrackIndex_intersectWith_1 )
+{
+    // 8000 tracks; track t uses detection 0 iff t is even, detection
+    // 1 iff t % 100 == 0 and detection 2 iff t % 1000 == 0, and every
+    // track uses a detection of its own (3 + t).  Detection 0 gets a
+    // bitmap, detection 1 does not, and intersecting a list of 8 or
+    // fewer with detection 1 gallops.
+    std::vector<Tracklet> tracks(8000);
+    for (unsigned int t = 0; t < tracks.size(); t++) {
+        if (t % 2 == 0) {
+            tracks[t].indices.insert(0);
+        }
+        if (t % 100 == 0) {
+            tracks[t].indices.insert(1);
+        }
+        if (t % 1000 == 0) {
+            tracks[t].indices.insert(2);
+        }
+        tracks[t].indices.insert(3 + t);
+    }
+    DetectionToTrackIndex index(tracks);
+
+    for (unsigned int a = 0; a < 3; a++) {
+        for (unsigned int b = 0; b < 3; b++) {
+            std::vector<unsigned int> got(index.begin(a), index.end(a));
+            index.intersectWith(b, got);
+            std::vector<unsigned int> expected;
+            std::set_intersection(index.begin(a), index.end(a),
+                                  index.begin(b), index.end(b),
+                                  std::back_inserter(expected));
+            BOOST_CHECK(got == expected);
+        }
+    }
+
+    std::vector<unsigned int> got;
+    got.push_back(0);
+    got.push_back(50);
+    got.push_back(150);
+    got.push_back(300);
+    got.push_back(7900);
+    got.push_back(7999);
+    index.intersectWith(1, got);
+    BOOST_REQUIRE(got.size() == 3);
+    BOOST_CHECK(got[0] == 0);
+    BOOST_CHECK(got[1] == 300);
+    BOOST_CHECK(got[2] == 7900);
+    index.intersectWith(0, got);
+    BOOST_CHECK(got.size() == 3);
+    index.intersectWith(3 + 300, got);
+    BOOST_REQUIRE(got.size() == 1);
+    BOOST_CHECK(got[0] == 300);
+}
+
+
+
+BOOST_AUTO_TEST_CASE( trackSignature_1 )
+{
+    std::set<unsigned int> a;
+    a.insert(3);
+    a.insert(17);
+    a.insert(400);
+    std::set<unsigned int> b(a);
+    BOOST_CHECK(trackSignature(a) == trackSignature(b));
+    b.insert(401);
+    BOOST_CHECK(!(trackSignature(a) == trackSignature(b)));
+    b.erase(401);
+    b.erase(400);
+    b.insert(399);
+    BOOST_CHECK(!(trackSignature(a) == trackSignature(b)));
+    // prefixes differ from the whole.
+    b.erase(399);
+    BOOST_CHECK(!(trackSignature(a) == trackSignature(b)));
+}
+
+
+
+BOOST_AUTO_TEST_CASE( removeDuplicateTracksFromFile_1 )
+{
+    // 3000 tracks, track i being (i % 1000, 1000 + i % 1000) and
+    // every fourth line also with detection 5000.  So only the first
+    // copy of each is kept, in the order they came in.  With the
+    // smallest memory limit (1024 signatures), signatures are
+    // spilled to disk and merged.
+    TempDir tempDir("mopsRemoveDuplicates");
+    BOOST_REQUIRE(tempDir.created());
+    std::string inFileName = tempDir.path("in");
+    std::string outFileName = tempDir.path("out");
+    std::vector<Tracklet> expected;
+    std::set<std::set<unsigned int> > seen;
+    std::ofstream inFile(inFileName.c_str());
+    for (unsigned int i = 0; i < 3000; i++) {
+        Tracklet t;
+        t.indices.insert(i % 1000);
+        t.indices.insert(1000 + i % 1000);
+        if (i % 4 == 0) {
+            t.indices.insert(5000);
+        }
+        inFile << 1000 + i % 1000 << " " << i % 1000 << " ";
+        if (i % 4 == 0) {
+            inFile << 5000 << " ";
+        }
+        inFile << std::endl;
+        if (seen.insert(t.indices).second) {
+            expected.push_back(t);
+        }
+    }
+    inFile.close();
+
+    for (unsigned int memory = 0; memory <= 1000000; memory += 1000000) {
+        unsigned int numDuplicates = 
+            removeDuplicateTracksFromFile(inFileName, outFileName, memory);
+        BOOST_CHECK(numDuplicates == 3000 - expected.size());
+
+        std::vector<Tracklet> got;
+        populatePairsVectorFromFile(outFileName, got);
+        BOOST_REQUIRE(got.size() == expected.size());
+        for (unsigned int i = 0; i < got.size(); i++) {
+            BOOST_CHECK(got[i].indices == expected[i].indices);
+        }
+    }
+}
+
+
+
+BOOST_AUTO_TEST_CASE( removeSubsetsFromFile_1 )
+{
+    // random tracks over 3000 detections, with some of them repeated
+    // and some cut down to subsets of others; the output should
+    // match removeSubsets in memory, whether everything fits in one
+    // bucket or each bin of detections is its own bucket.
+    TempDir tempDir("mopsRemoveSubsets");
+    BOOST_REQUIRE(tempDir.created());
+    std::string inFileName = tempDir.path("in");
+    std::string outFileName = tempDir.path("out");
+    std::vector<Tracklet> tracks;
+    srand(42);
+    for (unsigned int i = 0; i < 4000; i++) {
+        Tracklet t;
+        if ((i > 0) && (i % 5 == 0)) {
+            t = tracks[rand() % tracks.size()];
+            if ((i % 10 == 0) && (t.indices.size() > 2)) {
+                t.indices.erase(t.indices.begin());
+            }
+        }
+        else {
+            unsigned int numDets = 2 + rand() % 5;
+            while (t.indices.size() < numDets) {
+                t.indices.insert(rand() % 3000);
+            }
+        }
+        tracks.push_back(t);
+    }
+    std::ofstream inFile(inFileName.c_str());
+    writeTrackletsToOutFile(&tracks, inFile);
+    inFile.close();
+
+    std::vector<Tracklet> expected;
+    SubsetRemover mySR;
+    mySR.removeSubsetsPopulateOutputVector(&tracks, expected);
+    BOOST_REQUIRE(expected.size() < tracks.size());
+
+    for (unsigned int memory = 0; memory <= 100000000; memory += 100000000) {
+        unsigned int numBuckets = removeSubsetsFromFile(inFileName, outFileName, memory);
+        BOOST_CHECK((memory == 0) ? (numBuckets > 1) : (numBuckets == 1));
+
+        std::vector<Tracklet> got;
+        populatePairsVectorFromFile(outFileName, got);
+        BOOST_REQUIRE(got.size() == expected.size());
+        for (unsigned int i = 0; i < got.size(); i++) {
+            BOOST_CHECK(got[i].indices == expected[i].indices);
+        }
+    }
+}
+
+
 // TBD: removeSubsetsMain.  This will also require some external files.  Probably 
 // better accomplished with some shell scripts...
 
@@ -1298,3 +2138,130 @@ BOOST_AUTO_TEST_CASE( putLongestOnlyInOutputVector_blackbox_2 )
 
 
 
+
+///////////////////////////////////////////////////////////////////////
+//    SKYPARTITIONEDDETECTIONSTORE TESTS
+///////////////////////////////////////////////////////////////////////
+
+
+
+BOOST_AUTO_TEST_CASE( healpix_1 )
+{
+    // nside 1: pixel 0 is centered at RA 45, z = 2/3.
+    double RA, Dec;
+    healpixPix2AngNest(1, 0, RA, Dec);
+    BOOST_CHECK(Eq(RA, 45.));
+    BOOST_CHECK(Eq(Dec, asin(2./3.) * 180. / M_PI));
+    BOOST_CHECK(healpixAng2PixNest(1, 45., 80.) == 0);
+    BOOST_CHECK(healpixAng2PixNest(1, 0., 0.) == 4);
+    BOOST_CHECK(healpixAng2PixNest(1, 45., -80.) == 8);
+    BOOST_CHECK(healpixNPix(8) == 768);
+    BOOST_CHECK(isValidNside(64));
+    BOOST_CHECK(!isValidNside(0));
+    BOOST_CHECK(!isValidNside(3));
+}
+
+
+
+BOOST_AUTO_TEST_CASE( healpix_2 )
+{
+    // every pixel center maps back to its own pixel.
+    unsigned int nsides[3] = {1, 8, 64};
+    for (unsigned int n = 0; n < 3; n++) {
+        for (long int pix = 0; pix < healpixNPix(nsides[n]); pix++) {
+            double RA, Dec;
+            healpixPix2AngNest(nsides[n], pix, RA, Dec);
+            BOOST_CHECK(healpixAng2PixNest(nsides[n], RA, Dec) == pix);
+        }
+    }
+}
+
+
+
+BOOST_AUTO_TEST_CASE( healpix_3 )
+{
+    // no point is further from its pixel's center than maxPixRad.
+    srand(42);
+    unsigned int nside = 16;
+    double maxRad = healpixMaxPixRad(nside);
+    BOOST_CHECK(maxRad > 0. && maxRad < 5.);
+    for (unsigned int i = 0; i < 20000; i++) {
+        double RA = 360. * rand() / (RAND_MAX + 1.);
+        double Dec = asin(2. * rand() / (RAND_MAX + 1.) - 1.) * 180. / M_PI;
+        double cRA, cDec;
+        healpixPix2AngNest(nside, healpixAng2PixNest(nside, RA, Dec), cRA, cDec);
+        BOOST_CHECK(angularDistanceRADec_deg(RA, Dec, cRA, cDec) <= maxRad);
+    }
+}
+
+
+
+BOOST_AUTO_TEST_CASE( detStore_1 )
+{
+    std::vector<MopsDetection> dets;
+    // two exposures of a field near RA 0, plus one far away.
+    addDetectionAt(5300.0, 359.9, 0.1, dets);
+    addDetectionAt(5300.0, 0.1, 0.1, dets);
+    addDetectionAt(5300.0, 0.15, -0.05, dets);
+    addDetectionAt(5300.5, 359.95, 0.12, dets);
+    addDetectionAt(5300.5, 180., 45., dets);
+    for (unsigned int i = 0; i < dets.size(); i++) {
+        dets[i].setImageID(dets[i].getEpochMJD() < 5300.2 ? 1 : 2);
+    }
+
+    TempDir tempDir("mopsDetStore");
+    BOOST_REQUIRE(tempDir.created());
+    std::string dir(tempDir.dir);
+
+    SkyPartitionedDetectionStore::build(dets, 32, dir);
+
+    SkyPartitionedDetectionStore store(dir);
+    BOOST_CHECK(store.getNside() == 32);
+    unsigned int total = 0;
+    for (unsigned int i = 0; i < store.getBuckets().size(); i++) {
+        total += store.getBuckets()[i].nDets;
+    }
+    BOOST_CHECK(total == dets.size());
+
+    std::vector<MopsDetection> all;
+    store.loadPixels(store.getPixels(), all);
+    BOOST_CHECK(all.size() == dets.size());
+
+    // a small cap around RA 0 should bring in exactly the four nearby
+    // detections, across the RA wrap.
+    std::vector<MopsDetection> nearZero;
+    store.loadCap(0., 0., .5, nearZero);
+    BOOST_CHECK(nearZero.size() == 4);
+
+    std::vector<MopsDetection> secondExposure;
+    store.loadCap(0., 0., .5, secondExposure, 5300.4, 5300.6);
+    BOOST_REQUIRE(secondExposure.size() == 1);
+    BOOST_CHECK(secondExposure[0].getID() == 3);
+    BOOST_CHECK(Eq(secondExposure[0].getRA(), 359.95));
+
+    // each detection is owned by exactly one region, and loading that
+    // region returns the detection.
+    std::vector<long int> pixels = store.getPixels();
+    for (unsigned int i = 0; i < dets.size(); i++) {
+        unsigned int owners = 0;
+        for (unsigned int p = 0; p < pixels.size(); p++) {
+            if (store.ownsDetection(pixels[p], dets[i])) {
+                owners++;
+                std::vector<MopsDetection> region;
+                store.loadRegion(pixels[p], .1, region);
+                bool found = false;
+                for (unsigned int j = 0; j < region.size(); j++) {
+                    found = found || (region[j].getID() == dets[i].getID());
+                }
+                BOOST_CHECK(found);
+            }
+        }
+        BOOST_CHECK(owners == 1);
+    }
+}
+
+
+
+
+
+
@@ -117,15 +117,27 @@ void TrackletTree::buildFromData(
         /* create the root of the tree (and the rest of the tree
          * recursively), save it to private var. */
         unsigned int idCounter = 0;
-        myRoot = new TrackletTreeNode(parameterizedTracklets, 
-                                      positionalErrorRa, 
-                                      positionalErrorDec,
-                                      maxLeafSize, 
-                                      0,
-				      widthsToSend,
-                                      idCounter,
-				      false, 
-				      true);
+        // big trees build their subtrees as OpenMP tasks; see
+        // BaseKDTreeNode.h
+#ifdef _OPENMP
+#pragma omp parallel if(parameterizedTracklets.size() >= KDTREE_PARALLEL_BUILD_CUTOFF)
+#endif
+        {
+#ifdef _OPENMP
+#pragma omp single
+#endif
+            {
+                myRoot = new TrackletTreeNode(parameterizedTracklets, 
+                                              positionalErrorRa, 
+                                              positionalErrorDec,
+                                              maxLeafSize, 
+                                              0,
+                                              widthsToSend,
+                                              idCounter,
+                                              false, 
+                                              true);
+            }
+        }
         // don't set hasData until now, when the tree is actually built.
         mySize = idCounter;
 
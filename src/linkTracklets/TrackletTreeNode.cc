@@ -97,16 +97,8 @@ TrackletTreeNode::TrackletTreeNode(
         }
 
         // try to partition data
-        for (uint i = 0; i < tracklets.size(); i++) {
-            double val = tracklets[i].getPoint()[myAxisToSplit];
-            
-            if (val < pivot) {
-                leftPointsAndValues.push_back(tracklets[i]);
-            }
-            else {
-                rightPointsAndValues.push_back(tracklets[i]);
-            }
-        }
+        partitionPointsByAxis(tracklets, myAxisToSplit, pivot, false,
+                              leftPointsAndValues, rightPointsAndValues);
         
         // like in C linkTracklets, partition up data and if it doesn't work well
         // just partition arbitrarily...
@@ -127,19 +119,48 @@ TrackletTreeNode::TrackletTreeNode(
 
         nextAxis = (myAxisToSplit + 1) % (myK);
         
-        TrackletTreeNode leftChild(leftPointsAndValues,
-                                   positionalErrorRa, positionalErrorDec,
-                                   maxLeafSize, nextAxis, widths, lastId, 
-                                   useMedian, splitWidest);
+        // build the children in temporaries and swap them into place
+        // rather than copying whole subtrees. Big subtrees are built
+        // as concurrent tasks; see BaseKDTreeNode.h.
+        myChildren.resize(2);
+        if (tracklets.size() < KDTREE_PARALLEL_BUILD_CUTOFF) {
+            TrackletTreeNode leftChild(leftPointsAndValues,
+                                       positionalErrorRa, positionalErrorDec,
+                                       maxLeafSize, nextAxis, widths, lastId, 
+                                       useMedian, splitWidest);
+            myChildren[0].swapContents(leftChild);
         
-        myChildren.push_back(leftChild);
-        
-        TrackletTreeNode rightChild(rightPointsAndValues, 
-                                    positionalErrorRa, positionalErrorDec,
-                                    maxLeafSize, nextAxis, widths, lastId, 
-                                    useMedian, splitWidest);
-
-        myChildren.push_back(rightChild);
+            TrackletTreeNode rightChild(rightPointsAndValues, 
+                                        positionalErrorRa, positionalErrorDec,
+                                        maxLeafSize, nextAxis, widths, lastId, 
+                                        useMedian, splitWidest);
+            myChildren[1].swapContents(rightChild);
+        }
+        else {
+            // right subtree ids are counted from 0 and shifted after,
+            // so the ids match a serial build.
+            uint rightIds = 0;
+#ifdef _OPENMP
+#pragma omp task shared(leftPointsAndValues, widths, lastId)
+#endif
+            {
+                TrackletTreeNode leftChild(leftPointsAndValues,
+                                           positionalErrorRa, positionalErrorDec,
+                                           maxLeafSize, nextAxis, widths, lastId, 
+                                           useMedian, splitWidest);
+                myChildren[0].swapContents(leftChild);
+            }
+            TrackletTreeNode rightChild(rightPointsAndValues, 
+                                        positionalErrorRa, positionalErrorDec,
+                                        maxLeafSize, nextAxis, widths, rightIds, 
+                                        useMedian, splitWidest);
+            myChildren[1].swapContents(rightChild);
+#ifdef _OPENMP
+#pragma omp taskwait
+#endif
+            myChildren[1].shiftIds(lastId);
+            lastId += rightIds;
+        }
     }
 
 
@@ -149,6 +170,14 @@ TrackletTreeNode::TrackletTreeNode(
 }
         
 
+void TrackletTreeNode::swapContents(TrackletTreeNode &other)
+{
+    BaseKDTreeNode<unsigned int, TrackletTreeNode>::swapContents(other);
+    std::swap(numVisits, other.numVisits);
+}
+
+
+
 // these are to be used by linkTracklets.
 const unsigned int TrackletTreeNode::getNumVisits() const
 {
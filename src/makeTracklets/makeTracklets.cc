@@ -0,0 +1,150 @@
+// -*- LSST-C++ -*-
+/*
+ * see makeTracklets.h.
+ */
+
+#include <iomanip>
+#include <iostream>
+
+#include "lsst/mops/common.h"
+#include "lsst/mops/Exceptions.h"
+#include "lsst/mops/removeSubsets.h"
+#include "lsst/mops/daymops/collapseTrackletsAndPostfilters/collapseTracklets.h"
+#include "lsst/mops/daymops/collapseTrackletsAndPostfilters/purifyTracklets.h"
+#include "lsst/mops/daymops/makeTracklets/makeTracklets.h"
+
+
+namespace lsst {
+    namespace mops {
+
+
+
+/* collapseTracklets has nothing to do unless there are more than two
+ * distinct exposure times (as in collapseTrackletsMain). */
+static bool hasGT2UniqueTimes(const std::vector<MopsDetection> &dets)
+{
+    std::vector<double> observedMJDs;
+    for (unsigned int i = 0; i < dets.size(); i++) {
+        double curMJD = dets[i].getEpochMJD();
+        bool isInList = false;
+        for (unsigned int j = 0; (j < observedMJDs.size()) && !isInList; j++) {
+            isInList = areEqual(observedMJDs[j], curMJD);
+        }
+        if (!isInList) {
+            observedMJDs.push_back(curMJD);
+            if (observedMJDs.size() > 2) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+
+
+/* turn findTrackletPairs' pairs (of indices into dets, as everything
+ * downstream of it wants) into Tracklets. */
+static void pairsToTracklets(const PairVector &pairs,
+                             std::vector<Tracklet> &output)
+{
+    output.resize(pairs.size());
+    for (unsigned int i = 0; i < pairs.size(); i++) {
+        const PairVector::Pair &pair = pairs.at(i);
+        output[i].indices.insert(pair.first);
+        output[i].indices.insert(pair.second);
+    }
+}
+
+
+
+static void reportStage(const std::string &stage, unsigned int nTracklets,
+                        double startTime)
+{
+    std::cout << std::left << std::setw(20) << stage << std::right
+              << std::setw(10) << nTracklets << " tracklets  "
+              << std::fixed << std::setprecision(3)
+              << wallClockSeconds() - startTime << " s" << std::endl;
+}
+
+
+
+void makeTracklets(const std::vector<MopsDetection> &dets,
+                   const makeTrackletsConfig &config,
+                   std::vector<Tracklet> &output)
+{
+    if (output.size() != 0) {
+        throw LSST_EXCEPT(BadParameterException,
+                          "makeTracklets: output vector not empty\n");
+    }
+
+    double stageStart = wallClockSeconds();
+
+    std::vector<Tracklet> tracklets;
+    {
+        PairVector pairs;
+        findTrackletPairs(dets, config.findConfig, pairs);
+        pairsToTracklets(pairs, tracklets);
+    }
+    if (config.beVerbose) {
+        reportStage("findTracklets", tracklets.size(), stageStart);
+    }
+
+    // each stage leaves its results in tracklets for the next; swap
+    // rather than copy.
+    if (config.collapse && (tracklets.size() > 1) &&
+        hasGT2UniqueTimes(dets)) {
+        stageStart = wallClockSeconds();
+        std::vector<Tracklet> collapsed;
+        doCollapsingPopulateOutputVector(&dets, tracklets,
+                                         config.collapseTolerances,
+                                         collapsed,
+                                         config.useMinimumRMS,
+                                         config.useBestFit,
+                                         config.useRMSFilt,
+                                         config.collapseMaxRMS,
+                                         false, config.collapseLeafSize);
+        tracklets.swap(collapsed);
+        if (config.beVerbose) {
+            reportStage("collapseTracklets", tracklets.size(), stageStart);
+        }
+    }
+
+    if (config.purify) {
+        stageStart = wallClockSeconds();
+        std::vector<Tracklet> pure;
+        purifyTracklets(&tracklets, &dets, config.purifyMaxRMS,
+                        config.purifyMinObs, pure);
+        tracklets.swap(pure);
+        if (config.beVerbose) {
+            reportStage("purifyTracklets", tracklets.size(), stageStart);
+        }
+    }
+
+    if (config.keepOnlyLongestPerDet) {
+        stageStart = wallClockSeconds();
+        std::vector<Tracklet> longest;
+        putLongestPerDetInOutputVector(&tracklets, longest);
+        tracklets.swap(longest);
+        if (config.beVerbose) {
+            reportStage("keepOnlyLongest", tracklets.size(), stageStart);
+        }
+    }
+
+    if (config.removeSubsets) {
+        stageStart = wallClockSeconds();
+        SubsetRemover remover;
+        remover.removeSubsetsPopulateOutputVector(&tracklets, output,
+                                                  config.shortCircuit,
+                                                  config.sortBeforeIntersect);
+        if (config.beVerbose) {
+            reportStage("removeSubsets", output.size(), stageStart);
+        }
+    }
+    else {
+        output.swap(tracklets);
+    }
+}
+
+
+
+    }} // close lsst::mops
@@ -0,0 +1,215 @@
+// -*- LSST-C++ -*-
+/*
+ * Command-line front end to makeTracklets: run findTracklets,
+ * collapseTracklets, purifyTracklets and removeSubsets on a dets file
+ * in one process, writing only the final tracklets.  With the
+ * defaults, the output is the same as that of runCollapseTracklets.sh
+ * run on the pairs findTracklets writes, but nothing in between is
+ * ever written to disk.
+ */
+
+#include <cstdlib>
+#include <iomanip>
+#include <sstream>
+
+#include <unistd.h>
+#include <getopt.h>
+
+#include "lsst/mops/common.h"
+#include "lsst/mops/fileUtils.h"
+#include "lsst/mops/daymops/makeTracklets/makeTracklets.h"
+
+
+
+namespace lsst {
+namespace mops {
+
+int makeTrackletsMain(int argc, char** argv)
+{
+    time_t start = time(NULL);
+    std::string USAGE(
+        "USAGE: makeTracklets --detsFile <dets> --outFile <tracklets> [options]\n"
+        "options:\n"
+        "  findTracklets:     --maxVelocity <deg/day> (2.0) --minVelocity <deg/day> (0.0)\n"
+        "                     --leafSize <n> (16; 0 to tune automatically)\n"
+        "  collapseTracklets: --collapse <true/false> (true)\n"
+        "                     --raTolerance <deg> (.002) --decTolerance <deg> (.002)\n"
+        "                     --angleTolerance <deg> (5) --velocityTolerance <deg/day> (.05)\n"
+        "                     --method <greedy|minimumRMS|bestFit> (greedy)\n"
+        "  purifyTracklets:   --purify <true/false> (true) --maxRMS <deg> (.001)\n"
+        "                     --minObs <n> (2)\n"
+        "  removeSubsets:     --removeSubsets <true/false> (true)\n"
+        "                     --keepOnlyLongest <true/false> (false)\n"
+        "  --writeIndices:    write indices into the dets file rather than detection IDs\n");
+
+    char* detsFileName = NULL;
+    char* outFileName = NULL;
+    bool writeIndices = false;
+    unsigned int leafSize = 16;
+    makeTrackletsConfig config;
+    config.beVerbose = true;
+
+    static const struct option longOpts[] = {
+        { "detsFile", required_argument, NULL, 'i' },
+        { "outFile", required_argument, NULL, 'o' },
+        { "maxVelocity", required_argument, NULL, 'v' },
+        { "minVelocity", required_argument, NULL, 'm' },
+        { "leafSize", required_argument, NULL, 'l' },
+        { "collapse", required_argument, NULL, 'c' },
+        { "raTolerance", required_argument, NULL, 'R' },
+        { "decTolerance", required_argument, NULL, 'D' },
+        { "angleTolerance", required_argument, NULL, 'A' },
+        { "velocityTolerance", required_argument, NULL, 'V' },
+        { "method", required_argument, NULL, 'e' },
+        { "purify", required_argument, NULL, 'p' },
+        { "maxRMS", required_argument, NULL, 'x' },
+        { "minObs", required_argument, NULL, 'n' },
+        { "removeSubsets", required_argument, NULL, 'r' },
+        { "keepOnlyLongest", required_argument, NULL, 'k' },
+        { "writeIndices", no_argument, NULL, 'w' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, no_argument, NULL, 0 }
+    };
+
+    int longIndex = -1;
+    const char* optString = "i:o:v:m:l:c:R:D:A:V:e:p:x:n:r:k:wh";
+    int opt = getopt_long( argc, argv, optString, longOpts, &longIndex );
+    while( opt != -1 ) {
+        switch( opt ) {
+        case 'i':
+            detsFileName = optarg;
+            break;
+        case 'o':
+            outFileName = optarg;
+            break;
+        case 'v':
+            config.findConfig.maxV = atof(optarg);
+            break;
+        case 'm':
+            config.findConfig.minV = atof(optarg);
+            break;
+        case 'l':
+            leafSize = atoi(optarg);
+            break;
+        case 'c':
+            config.collapse = guessBoolFromStringOrGiveErr(optarg, USAGE);
+            break;
+        case 'R':
+            config.collapseTolerances[0] = atof(optarg);
+            break;
+        case 'D':
+            config.collapseTolerances[1] = atof(optarg);
+            break;
+        case 'A':
+            config.collapseTolerances[2] = atof(optarg);
+            break;
+        case 'V':
+            config.collapseTolerances[3] = atof(optarg);
+            break;
+        case 'e':
+            if (std::string(optarg) == std::string("greedy")) {
+                config.useMinimumRMS = false;
+                config.useBestFit = false;
+            }
+            else if (std::string(optarg) == std::string("minimumRMS")) {
+                config.useMinimumRMS = true;
+                config.useBestFit = false;
+            }
+            else if (std::string(optarg) == std::string("bestFit")) {
+                config.useMinimumRMS = false;
+                config.useBestFit = true;
+            }
+            else {
+                throw LSST_EXCEPT(CommandlineParseErrorException,
+                                  "ERROR: options for method are: greedy, minimumRMS, bestFit\n\n" +
+                                  USAGE);
+            }
+            break;
+        case 'p':
+            config.purify = guessBoolFromStringOrGiveErr(optarg, USAGE);
+            break;
+        case 'x':
+            config.purifyMaxRMS = atof(optarg);
+            break;
+        case 'n':
+            config.purifyMinObs = atoi(optarg);
+            break;
+        case 'r':
+            config.removeSubsets = guessBoolFromStringOrGiveErr(optarg, USAGE);
+            break;
+        case 'k':
+            config.keepOnlyLongestPerDet = guessBoolFromStringOrGiveErr(optarg, USAGE);
+            break;
+        case 'w':
+            writeIndices = true;
+            break;
+        case 'h':   /* fall-through is intentional */
+        case '?':
+            std::cout<<USAGE<<std::endl;
+            return 0;
+            break;
+        default:
+            throw LSST_EXCEPT(ProgrammerErrorException, "Programmer error in parsing of command-line options\n");
+            break;
+        }
+        opt = getopt_long( argc, argv, optString, longOpts, &longIndex );
+    }
+
+    if ((detsFileName == NULL) || (outFileName == NULL)) {
+        throw LSST_EXCEPT(CommandlineParseErrorException,
+                          "Please specify input and output filenames.\n\n" + USAGE);
+    }
+    if (leafSize == 0) {
+        config.findConfig.autoTuneLeafSize = true;
+    }
+    else {
+        config.findConfig.leafSize = leafSize;
+    }
+
+    std::ofstream outFile(outFileName);
+    if (!outFile.is_open()) {
+        throw LSST_EXCEPT(FileException,
+                          "Failed to open output file " +
+                          std::string(outFileName) + " - do you have write permissions?\n");
+    }
+
+    std::vector<MopsDetection> dets;
+    populateDetVectorFromFile(std::string(detsFileName), dets);
+    std::cout << "Read " << dets.size() << " detections in "
+              << std::fixed << std::setprecision(3)
+              << timeElapsed(start) << " seconds." << std::endl;
+
+    std::vector<Tracklet> tracklets;
+    makeTracklets(dets, config, tracklets);
+
+    if (!writeIndices) {
+        for (unsigned int i = 0; i < tracklets.size(); i++) {
+            std::set<unsigned int> ids;
+            std::set<unsigned int>::const_iterator indexIter;
+            for (indexIter = tracklets[i].indices.begin();
+                 indexIter != tracklets[i].indices.end();
+                 indexIter++) {
+                ids.insert(dets[*indexIter].getID());
+            }
+            tracklets[i].indices.swap(ids);
+        }
+    }
+    writeTrackletsToOutFile(&tracklets, outFile);
+    outFile.close();
+    if (outFile.fail()) {
+        std::cout << "ERROR writing/closing file." << std::endl;
+        return 1;
+    }
+
+    std::cout << "Wrote " << tracklets.size() << " tracklets." << std::endl;
+    std::cout << "Completed after " << std::fixed << std::setprecision(3)
+              << timeElapsed(start) << " seconds." << std::endl;
+    printMemUse();
+    return 0;
+}
+
+}} // close lsst::mops
+
+int main(int argc, char** argv) {
+    return lsst::mops::makeTrackletsMain(argc, argv);
+}
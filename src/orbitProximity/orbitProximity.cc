@@ -17,7 +17,8 @@ namespace lsst {
 
 // "internal" declarations
 
-KDTree<unsigned int> buildKDTree(const std::vector<Orbit>);
+KDTree<unsigned int> buildKDTree(const std::vector<Orbit>, 
+                                 unsigned int maxLeafSize);
 
 
 
@@ -45,11 +46,12 @@ orbitProximity(std::vector<Orbit> dataOrbits,
                double inclinationTolerance,
                double perihelionArgTolerance,
                double longitudeArgTolerance,
-               double perihelionTimeTolerance)
+               double perihelionTimeTolerance,
+               unsigned int maxLeafSize)
 {
     //build KDTrees from Orbit vectors
     KDTree<unsigned int> dataTree;
-    dataTree = buildKDTree(dataOrbits);
+    dataTree = buildKDTree(dataOrbits, maxLeafSize);
     
     if (DEBUG) {
         std::cerr << "dataOrbits size: " << dataOrbits.size() << std::endl;
@@ -79,7 +81,8 @@ orbitProximity(std::vector<Orbit> dataOrbits,
 /**********************************************************************
  * Populate a KDTree 'tree' from the Orbits in vector 'orbits'
  ***********************************************************************/
-KDTree<unsigned int> buildKDTree(const std::vector<Orbit> orbits)
+KDTree<unsigned int> buildKDTree(const std::vector<Orbit> orbits,
+                                 unsigned int maxLeafSize)
 {
     
     std::vector<PointAndValue<unsigned int> > vecPV;
@@ -103,7 +106,7 @@ KDTree<unsigned int> buildKDTree(const std::vector<Orbit> orbits)
 	vecPV.push_back(tempPV);
     }
     
-    KDTree<unsigned int> toReturn(vecPV, orbitDimensions, 100);
+    KDTree<unsigned int> toReturn(vecPV, orbitDimensions, maxLeafSize);
     return toReturn;
 }
 
@@ -0,0 +1,165 @@
+// -*- LSST-C++ -*-
+/*
+ * Command-line front end to SkyPartitionedDetectionStore.
+ *
+ * Build a store from a dets file:
+ *
+ *   partitionDetections --detsFile <dets> --storeDir <dir> [--nside <n>]
+ *
+ * Then, for each populated pixel (see --listPixels), write out the
+ * detections needed to process that region to an ordinary dets file
+ * which findTracklets, collapseTracklets, linkTracklets etc. accept
+ * unchanged:
+ *
+ *   partitionDetections --storeDir <dir> --pixel <p> --margin <deg>
+ *        --outFile <dets> [--minMJD <mjd> --maxMJD <mjd>]
+ *
+ * The margin should cover however far objects can move during the
+ * time window in question (e.g. maxV * maxDt for findTracklets).
+ */
+
+#include <cstdlib>
+
+#include <unistd.h>
+#include <getopt.h>
+
+#include "lsst/mops/fileUtils.h"
+#include "lsst/mops/SkyPartitionedDetectionStore.h"
+
+
+
+namespace lsst {
+namespace mops {
+
+int partitionDetectionsMain(int argc, char** argv)
+{
+    std::string USAGE(
+        "USAGE: partitionDetections --detsFile <dets> --storeDir <dir> [--nside <n>]\n"
+        "   or: partitionDetections --storeDir <dir> --listPixels\n"
+        "   or: partitionDetections --storeDir <dir> --pixel <pixel> --outFile <dets>\n"
+        "              [--margin <degrees> --minMJD <mjd> --maxMJD <mjd>]\n");
+
+    char* detsFileName = NULL;
+    char* storeDir = NULL;
+    char* outFileName = NULL;
+    unsigned int nside = 16;
+    long int pixel = -1;
+    double margin = 0.;
+    double minMJD = -1e30;
+    double maxMJD = 1e30;
+    bool listPixels = false;
+
+    static const struct option longOpts[] = {
+        { "detsFile", required_argument, NULL, 'd' },
+        { "storeDir", required_argument, NULL, 's' },
+        { "nside", required_argument, NULL, 'n' },
+        { "listPixels", no_argument, NULL, 'l' },
+        { "pixel", required_argument, NULL, 'p' },
+        { "margin", required_argument, NULL, 'm' },
+        { "minMJD", required_argument, NULL, 'a' },
+        { "maxMJD", required_argument, NULL, 'b' },
+        { "outFile", required_argument, NULL, 'o' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, no_argument, NULL, 0 }
+    };
+
+    int longIndex = -1;
+    const char* optString = "d:s:n:lp:m:a:b:o:h";
+    int opt = getopt_long( argc, argv, optString, longOpts, &longIndex );
+    while( opt != -1 ) {
+        switch( opt ) {
+        case 'd':
+            detsFileName = optarg;
+            break;
+        case 's':
+            storeDir = optarg;
+            break;
+        case 'n':
+            nside = atoi(optarg);
+            break;
+        case 'l':
+            listPixels = true;
+            break;
+        case 'p':
+            pixel = atol(optarg);
+            break;
+        case 'm':
+            margin = atof(optarg);
+            break;
+        case 'a':
+            minMJD = atof(optarg);
+            break;
+        case 'b':
+            maxMJD = atof(optarg);
+            break;
+        case 'o':
+            outFileName = optarg;
+            break;
+        case 'h':   /* fall-through is intentional */
+        case '?':
+            std::cout<<USAGE<<std::endl;
+            return 0;
+            break;
+        default:
+            throw LSST_EXCEPT(ProgrammerErrorException, "Programmer error in parsing of command-line options\n");
+            break;
+        }
+        opt = getopt_long( argc, argv, optString, longOpts, &longIndex );
+    }
+
+    if (storeDir == NULL) {
+        throw LSST_EXCEPT(CommandlineParseErrorException,
+                          "Please specify a store directory.\n\n" + USAGE);
+    }
+
+    if (detsFileName != NULL) {
+        if (!isValidNside(nside)) {
+            throw LSST_EXCEPT(CommandlineParseErrorException,
+                              "nside must be a positive power of two.\n\n" + USAGE);
+        }
+        std::vector<MopsDetection> dets;
+        populateDetVectorFromFile(std::string(detsFileName), dets);
+        SkyPartitionedDetectionStore::build(dets, nside, storeDir);
+        SkyPartitionedDetectionStore store(storeDir);
+        std::cout << "Wrote " << dets.size() << " detections into "
+                  << store.getBuckets().size() << " buckets covering "
+                  << store.getPixels().size() << " pixels (nside "
+                  << nside << ")." << std::endl;
+        return 0;
+    }
+
+    SkyPartitionedDetectionStore store(storeDir);
+
+    if (listPixels) {
+        std::vector<long int> pixels = store.getPixels();
+        for (unsigned int i = 0; i < pixels.size(); i++) {
+            std::cout << pixels[i] << std::endl;
+        }
+        return 0;
+    }
+
+    if ((pixel < 0) || (outFileName == NULL)) {
+        throw LSST_EXCEPT(CommandlineParseErrorException,
+                          "Please specify a pixel and an output file.\n\n" + USAGE);
+    }
+
+    std::vector<MopsDetection> dets;
+    store.loadRegion(pixel, margin, dets, minMJD, maxMJD);
+
+    std::ofstream outFile(outFileName);
+    writeDetsToOutFile(&dets, outFile);
+    outFile.close();
+    if (outFile.fail()) {
+        std::cout << "ERROR writing/closing file." << std::endl;
+        return 1;
+    }
+    std::cout << "Wrote " << dets.size() << " detections for pixel "
+              << pixel << " (margin " << margin << " deg)." << std::endl;
+    return 0;
+}
+
+}} // close lsst::mops
+
+int main(int argc, char** argv) {
+    return lsst::mops::partitionDetectionsMain(argc, argv);
+}
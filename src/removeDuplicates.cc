@@ -0,0 +1,282 @@
+// -*- LSST-C++ -*-
+/*
+ * see removeDuplicates.h.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <queue>
+#include <sstream>
+#include <vector>
+
+#include "lsst/mops/removeDuplicates.h"
+#include "lsst/mops/fileUtils.h"
+#include "lsst/mops/Exceptions.h"
+
+
+
+namespace lsst {
+    namespace mops {
+
+
+
+/* the splitmix64 finalizer: every input bit affects every output bit. */
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+
+
+/* DetIter runs over the detections in ascending order, each once. */
+template <class DetIter>
+static TrackSignature signatureOf(DetIter first, DetIter last, uint64_t numDets)
+{
+    // two independently-seeded hash chains over the detections, each
+    // finished with the number of detections.
+    TrackSignature sig;
+    sig.hi = 0x9e3779b97f4a7c15ULL;
+    sig.lo = 0xc2b2ae3d27d4eb4fULL;
+    for (DetIter detIter = first; detIter != last; detIter++) {
+        sig.hi = mix64(sig.hi + *detIter);
+        sig.lo = mix64(sig.lo ^ ((uint64_t)(*detIter) * 0xff51afd7ed558ccdULL));
+    }
+    sig.hi = mix64(sig.hi + numDets);
+    sig.lo = mix64(sig.lo ^ numDets);
+    return sig;
+}
+
+
+
+TrackSignature trackSignature(const std::set<unsigned int> &dets)
+{
+    return signatureOf(dets.begin(), dets.end(), dets.size());
+}
+
+
+
+/* the signature of the track on a line of a tracks file. */
+static TrackSignature signatureOfLine(const std::string &line,
+                                      std::vector<unsigned int> &dets)
+{
+    parseTrackletLine(line, dets);
+    return signatureOf(dets.begin(), dets.end(), dets.size());
+}
+
+
+
+/* what we keep of each track: its signature and where it was. */
+class SignatureRecord {
+public:
+    TrackSignature sig;
+    unsigned int lineNum;
+
+    // order by signature, then by line, so the first copy of each
+    // track comes first.
+    bool operator<(const SignatureRecord &other) const {
+        return (sig < other.sig) || ((sig == other.sig) && (lineNum < other.lineNum));
+    }
+};
+
+
+
+/* read back a run written by writeRun, a few records at a time. */
+class SignatureRunReader {
+public:
+    SignatureRunReader(const std::string &fileName, unsigned int bufferRecords)
+        : file(fileName.c_str(), std::ios::in | std::ios::binary),
+          buffer(bufferRecords), pos(0), numInBuffer(0) {
+        if (!file.is_open()) {
+            throw LSST_EXCEPT(FileException, "Failed to re-open " + fileName + "\n");
+        }
+    }
+
+    bool next(SignatureRecord &rec) {
+        if (pos == numInBuffer) {
+            file.read(reinterpret_cast<char*>(&buffer[0]),
+                      buffer.size() * sizeof(SignatureRecord));
+            numInBuffer = file.gcount() / sizeof(SignatureRecord);
+            pos = 0;
+            if (numInBuffer == 0) {
+                return false;
+            }
+        }
+        rec = buffer[pos++];
+        return true;
+    }
+
+private:
+    std::ifstream file;
+    std::vector<SignatureRecord> buffer;
+    unsigned int pos;
+    unsigned int numInBuffer;
+};
+
+
+
+static std::string runFileName(const std::string &outFileName, unsigned int runNum)
+{
+    std::ostringstream name;
+    name << outFileName << ".sigRun" << runNum;
+    return name.str();
+}
+
+
+
+static void writeRun(std::vector<SignatureRecord> &records, const std::string &fileName)
+{
+    std::sort(records.begin(), records.end());
+    std::ofstream run(fileName.c_str(), std::ios::out | std::ios::binary);
+    run.write(reinterpret_cast<const char*>(&records[0]),
+              records.size() * sizeof(SignatureRecord));
+    run.close();
+    if (run.fail()) {
+        throw LSST_EXCEPT(FileException, "Failed to write " + fileName +
+                          " - is there space on the disk?\n");
+    }
+    records.clear();
+}
+
+
+
+/* given the records in signature order, mark every one but the
+ * first of each signature as a duplicate. */
+class DuplicateMarker {
+public:
+    DuplicateMarker(std::vector<bool> &isDuplicateOut)
+        : isDuplicate(isDuplicateOut), haveLast(false), numDuplicates(0) {}
+
+    void operator()(const SignatureRecord &rec) {
+        if (haveLast && (rec.sig == lastSig)) {
+            isDuplicate[rec.lineNum] = true;
+            numDuplicates++;
+        }
+        lastSig = rec.sig;
+        haveLast = true;
+    }
+
+    std::vector<bool> &isDuplicate;
+    TrackSignature lastSig;
+    bool haveLast;
+    unsigned int numDuplicates;
+};
+
+
+
+unsigned int removeDuplicateTracksFromFile(const std::string &inFileName,
+                                           const std::string &outFileName,
+                                           uint64_t maxMemoryBytes)
+{
+    unsigned int maxRecords = maxMemoryBytes / sizeof(SignatureRecord);
+    if (maxRecords < 1024) {
+        maxRecords = 1024;
+    }
+
+    std::ifstream inFile(inFileName.c_str());
+    if (!inFile.is_open()) {
+        throw LSST_EXCEPT(FileException, "Failed to open tracks file " +
+                          inFileName + " - does this file exist?\n");
+    }
+
+    /* sign every track, spilling sorted runs of signatures to disk
+     * as memory fills. */
+    std::vector<SignatureRecord> records;
+    unsigned int numRuns = 0;
+    unsigned int numLines = 0;
+    std::string line;
+    std::vector<unsigned int> dets;
+    std::getline(inFile, line);
+    while (inFile.fail() == false) {
+        SignatureRecord rec;
+        rec.sig = signatureOfLine(line, dets);
+        rec.lineNum = numLines;
+        records.push_back(rec);
+        numLines++;
+        if (records.size() >= maxRecords) {
+            writeRun(records, runFileName(outFileName, numRuns));
+            numRuns++;
+        }
+        std::getline(inFile, line);
+    }
+    inFile.close();
+
+    /* find the duplicates: in signature order, every record but the
+     * first of its signature. */
+    std::vector<bool> isDuplicate(numLines, false);
+    DuplicateMarker marker(isDuplicate);
+    if (numRuns == 0) {
+        std::sort(records.begin(), records.end());
+        for (unsigned int i = 0; i < records.size(); i++) {
+            marker(records[i]);
+        }
+    }
+    else {
+        if (records.size() > 0) {
+            writeRun(records, runFileName(outFileName, numRuns));
+            numRuns++;
+        }
+        std::vector<SignatureRecord>().swap(records);
+
+        // k-way merge of the runs.
+        unsigned int bufferRecords = std::max(maxRecords / numRuns, 256u);
+        std::vector<SignatureRunReader*> runs;
+        typedef std::pair<SignatureRecord, unsigned int> RecordAndRun;
+        std::priority_queue<RecordAndRun, std::vector<RecordAndRun>,
+            std::greater<RecordAndRun> > heads;
+        for (unsigned int r = 0; r < numRuns; r++) {
+            runs.push_back(new SignatureRunReader(runFileName(outFileName, r),
+                                                  bufferRecords));
+            SignatureRecord rec;
+            if (runs[r]->next(rec)) {
+                heads.push(RecordAndRun(rec, r));
+            }
+        }
+        while (!heads.empty()) {
+            RecordAndRun head = heads.top();
+            heads.pop();
+            marker(head.first);
+            SignatureRecord rec;
+            if (runs[head.second]->next(rec)) {
+                heads.push(RecordAndRun(rec, head.second));
+            }
+        }
+        for (unsigned int r = 0; r < numRuns; r++) {
+            delete runs[r];
+            std::remove(runFileName(outFileName, r).c_str());
+        }
+    }
+
+    /* copy over the tracks which aren't duplicates. */
+    inFile.clear();
+    inFile.open(inFileName.c_str());
+    std::ofstream outFile(outFileName.c_str());
+    if (!outFile.is_open()) {
+        throw LSST_EXCEPT(FileException, "Failed to open output file " +
+                          outFileName + " - do you have write permissions?\n");
+    }
+    unsigned int lineNum = 0;
+    std::getline(inFile, line);
+    while (inFile.fail() == false) {
+        if ((lineNum < numLines) && !isDuplicate[lineNum]) {
+            outFile << line << std::endl;
+        }
+        lineNum++;
+        std::getline(inFile, line);
+    }
+    outFile.close();
+    if (outFile.fail()) {
+        throw LSST_EXCEPT(FileException, "Failed writing " + outFileName + "\n");
+    }
+    return marker.numDuplicates;
+}
+
+
+
+    }} // close lsst::mops
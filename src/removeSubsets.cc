@@ -16,6 +16,7 @@
 #include <time.h>
 
 #include "lsst/mops/removeSubsets.h"
+#include "lsst/mops/DetectionToTrackIndex.h"
 #include "lsst/mops/Exceptions.h"
 
 
@@ -38,103 +39,48 @@ bool trackContains(unsigned int ind, const Tracklet &t)
 }
 
 
-// return common elements in sorted vectors A and B.  A
-// AND B MUST BE SORTED.
-std::vector<unsigned int> intersect(const std::vector<unsigned int> &A, 
-                                    const std::vector<unsigned int> &B) 
-{
-    std::vector<unsigned int> res;
-    int n1 = A.size();
-    int n2 = B.size();
-    int i = 0, j = 0;
-    while (i < n1 && j < n2) {
-        if (A[i] > B[j]) {
-            j++;
-        } else if (B[j] > A[i]) {
-            i++;
-        } else {
-            res.push_back(A[i]);
-            i++;
-            j++;
-        }
-    }
-    return res;
-}
-
-
 
 void getSupersetOrIdenticalTracks(const Tracklet* curTrack, 
-                                  std::map<unsigned int, std::vector<unsigned int> > & reverseMap,
+                                  const DetectionToTrackIndex & reverseMap,
                                   bool shortCircuit,
                                   bool sortBeforeIntersect,
                                   std::vector<unsigned int> & results)
 {
+    /* the tracks using every detection of curTrack are the
+     * intersection of the tracks using each of them.  Gather the
+     * detections' track lists; we start from the shortest, as the
+     * intersection can only shrink from there.  If
+     * sortBeforeIntersect, intersect the rest in order of length too;
+     * otherwise in order of detection. */
+    std::vector<std::pair<unsigned int, unsigned int> > sizesAndSlots;
     std::set<unsigned int>::const_iterator indexIter;
-    bool quitNow = false;
-    if (!sortBeforeIntersect) 
-    {
-        // initialize results set
-        results = reverseMap[*(curTrack->indices.begin())]; 
-
-        // if not sorting, read elements from reverse-map as needed;
-        // if we short-circuit we can avoid some memory accesses.
-        for (indexIter = (curTrack->indices.begin())++; 
-             indexIter != curTrack->indices.end() && (quitNow == false);
-             indexIter++) {
-            std::vector<unsigned int> tmpResults;
-            const std::vector<unsigned int> * detIDSet = &(reverseMap[*indexIter]);
-            tmpResults = intersect(*detIDSet, results);
-            results = tmpResults;
-            
-            if (shortCircuit && (results.size() == 1)) {
-                // we are not a subset track(let); end this for loop
-                quitNow = true;
-            }
-            
-        }
+    for (indexIter = curTrack->indices.begin(); 
+         indexIter != curTrack->indices.end();
+         indexIter++) {
+        unsigned int slot = reverseMap.slotOf(*indexIter);
+        sizesAndSlots.push_back(std::make_pair(reverseMap.size(slot), slot));
+    }
+    if (sortBeforeIntersect) {
+        std::sort(sizesAndSlots.begin(), sizesAndSlots.end());
     }
-
-
     else {
+        std::iter_swap(sizesAndSlots.begin(), 
+                       std::min_element(sizesAndSlots.begin(), sizesAndSlots.end()));
+    }
 
-        /* we're sorting the sets read from reverseMap by size before
-         * doing intersection; so first we need to read all the
-         * elements from the reverse map, sort them by size and THEN
-         * do the intersection */
-        std::multimap<unsigned int, const std::vector<unsigned int>* > reverseMapEntries;
-        for (indexIter = (curTrack->indices.begin()); 
-             indexIter != curTrack->indices.end();
-             indexIter++) {
-            const std::vector<unsigned int>* detIDSet = &(reverseMap[*indexIter]);
-            std::pair<unsigned int, const std::vector<unsigned int> * > toInsert(detIDSet->size(), detIDSet);
-            reverseMapEntries.insert(toInsert);
-        }
-
-        /* std::multimap sorts automatically so we'll be using smallest
-           element first */
-        std::multimap<unsigned int, const std::vector<unsigned int>* >::const_iterator entryIter;
-        // initialize results set
-        results = *(reverseMapEntries.begin()->second);
+    // initialize results set
+    unsigned int firstSlot = sizesAndSlots[0].second;
+    results.assign(reverseMap.begin(firstSlot), reverseMap.end(firstSlot));
 
-        for (entryIter = reverseMapEntries.begin()++; 
-             entryIter != reverseMapEntries.end() && (quitNow == false);
-             entryIter++) {
-            
-            std::vector<unsigned int> tmpResults;
-            const std::vector<unsigned int> * detIDSet = &(reverseMap[*indexIter]);
-            tmpResults = intersect(*detIDSet, results);
-            results = tmpResults;
-
-            if (shortCircuit && (results.size() == 1)) {
-                // we are not a subset track(let); end this for loop
-                quitNow = true;
-            }
+    bool quitNow = (shortCircuit && (results.size() == 1));
+    for (unsigned int i = 1; (i < sizesAndSlots.size()) && (quitNow == false); i++) {
+        reverseMap.intersectWith(sizesAndSlots[i].second, results);
             
+        if (shortCircuit && (results.size() == 1)) {
+            // we are not a subset track(let); end this for loop
+            quitNow = true;
         }
-           
     }
-
-
 }
 
 
@@ -149,27 +95,8 @@ void SubsetRemover::removeSubsetsPopulateOutputVector(const std::vector<Tracklet
                                                       bool sortBeforeIntersect) {
     /* build a map which maps each detection to each tracklet which uses it. */
     
-    std::map<unsigned int, std::vector<unsigned int> > reverseMap;
-    std::set<unsigned int>::iterator indicesIter;
-    
     std::cout << "Building detection-to-track map, starting at " << curTime() << std::endl;
-    for (unsigned int curTrackIndex = 0; curTrackIndex < tracksVector->size(); curTrackIndex++) {
-        
-        const Tracklet *curTrack = &(*tracksVector)[curTrackIndex];
-        
-        for (indicesIter = curTrack->indices.begin(); 
-             indicesIter != curTrack->indices.end();
-             indicesIter++) {
-            /* indicesIter now points to an index into the detections file (i.e. detection ID) */
-            reverseMap[*indicesIter].push_back(curTrackIndex);
-        }
-    }
-    // now sort the entries in the reverse map.
-    std::map<unsigned int, std::vector<unsigned int> >::iterator rMapIter;
-    for (rMapIter = reverseMap.begin(); rMapIter != reverseMap.end(); rMapIter++) {
-        unsigned int cur=rMapIter->first;
-        sort(reverseMap[cur].begin(), reverseMap[cur].end());
-    }
+    DetectionToTrackIndex reverseMap(*tracksVector);
         
     std::cout << "Finished detection-to-track map, filtering tracks starting at " << curTime() << std::endl;
 
@@ -257,37 +184,24 @@ void SubsetRemover::removeSubsetsPopulateOutputVector(const std::vector<Tracklet
 void putLongestPerDetInOutputVector(const std::vector<Tracklet> *pairsVector, 
                                     std::vector<Tracklet> &outputVector) {
     
-    std::map<unsigned int, std::set<unsigned int> > detectionIndexToPairsVectorIndexSet;
-    std::set<unsigned int>::iterator indicesIter;
-    
     /* make a mapping from each detID to the tracklet IDs which contain that det */
-    
-    for (unsigned int curPairIndex = 0; curPairIndex < pairsVector->size(); curPairIndex++) {
-        
-        const Tracklet *curPair = &(*pairsVector)[curPairIndex];
-        
-        for (indicesIter = curPair->indices.begin(); 
-             indicesIter != curPair->indices.end();
-             indicesIter++) {
-            /* indicesIter now points to an index into the detections file (i.e. detection ID) */
-            detectionIndexToPairsVectorIndexSet[*indicesIter].insert(curPairIndex);
-        }
-    }
+    DetectionToTrackIndex detectionIndexToPairsVectorIndices(*pairsVector);
+
     /* now for each det, find the longest associated tracklet.  Add that one
      * to outputVector. (if not already added). */
     
     std::vector<bool> writeThisIndex(pairsVector->size(), false);
     
     /* for each detection... */
-    std::map<unsigned int, std::set<unsigned int> >::iterator detIter;
-    for (detIter = detectionIndexToPairsVectorIndexSet.begin();
-         detIter != detectionIndexToPairsVectorIndexSet.end();
-         detIter++) {
+    for (unsigned int slot = 0; 
+         slot < detectionIndexToPairsVectorIndices.numSlots();
+         slot++) {
         unsigned int maxLen = 0;
         unsigned int longestTrackletIndex = 0;
         /* for each tracklet associated with that detection... */
-        for (indicesIter = detIter->second.begin(); 
-             indicesIter != detIter->second.end();
+        const unsigned int *indicesIter;
+        for (indicesIter = detectionIndexToPairsVectorIndices.begin(slot); 
+             indicesIter != detectionIndexToPairsVectorIndices.end(slot);
              indicesIter++) {
             /*indicesiter points at an int which is an index into pairsVector. */
             unsigned int curTrackletLen = (*pairsVector)[*indicesIter].indices.size();
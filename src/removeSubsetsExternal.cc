@@ -0,0 +1,268 @@
+// -*- LSST-C++ -*-
+/*
+ * see removeSubsetsExternal.h.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <vector>
+
+#include "lsst/mops/removeSubsetsExternal.h"
+#include "lsst/mops/removeSubsets.h"
+#include "lsst/mops/fileUtils.h"
+#include "lsst/mops/Exceptions.h"
+
+// the range of detection indices is cut into this many bins, which
+// are grouped into buckets.
+#define EXTERNAL_SUBSETS_NUM_BINS 65536u
+// the most bucket files we write at once; more buckets take more
+// passes over the input.
+#define EXTERNAL_SUBSETS_MAX_OPEN_FILES 512u
+
+
+
+namespace lsst {
+    namespace mops {
+
+
+
+/* rough bytes of memory a track of numDets detections takes while
+ * SubsetRemover works on it: the Tracklet and the nodes of its set,
+ * the same again if it's copied to the output, and its entries in the
+ * detection-to-track index. */
+static uint64_t trackMemoryCost(unsigned int numDets)
+{
+    return 2 * (sizeof(Tracklet) + 48 * (uint64_t)numDets) + 8 * (uint64_t)numDets;
+}
+
+
+
+static std::string bucketFileName(const std::string &outFileName, unsigned int bucket)
+{
+    std::ostringstream name;
+    name << outFileName << ".part" << bucket;
+    return name.str();
+}
+
+
+
+static void openTracksFile(std::ifstream &inFile, const std::string &inFileName)
+{
+    inFile.clear();
+    inFile.open(inFileName.c_str());
+    if (!inFile.is_open()) {
+        throw LSST_EXCEPT(FileException, "Failed to open tracks file " +
+                          inFileName + " - does this file exist?\n");
+    }
+}
+
+
+
+/* which bucket holds each detection. */
+class DetectionBuckets {
+public:
+    DetectionBuckets() : binWidth(1), numBuckets(0) {}
+
+    unsigned int binOf(unsigned int det) const { return det / binWidth; }
+    unsigned int bucketOf(unsigned int det) const { return bucketOfBin[binOf(det)]; }
+
+    unsigned int binWidth;
+    unsigned int numBuckets;
+    std::vector<unsigned int> bucketOfBin;
+};
+
+
+
+/* read a bucket file back in as Tracklets, each with its line number
+ * in the tracks file as its ID. */
+static void readBucket(const std::string &fileName, std::vector<Tracklet> &tracks)
+{
+    std::ifstream bucketFile(fileName.c_str(), std::ios::in | std::ios::binary);
+    if (!bucketFile.is_open()) {
+        throw LSST_EXCEPT(FileException, "Failed to re-open " + fileName + "\n");
+    }
+    std::vector<unsigned int> dets;
+    unsigned int header[2];
+    while (bucketFile.read(reinterpret_cast<char*>(header), sizeof(header))) {
+        dets.resize(header[1]);
+        bucketFile.read(reinterpret_cast<char*>(&dets[0]),
+                        header[1] * sizeof(unsigned int));
+        if (!bucketFile) {
+            throw LSST_EXCEPT(FileException, "Truncated bucket file " + fileName + "\n");
+        }
+        tracks.push_back(Tracklet());
+        Tracklet &t = tracks.back();
+        for (unsigned int d = 0; d < dets.size(); d++) {
+            t.indices.insert(t.indices.end(), dets[d]);
+        }
+        t.setId(header[0]);
+    }
+}
+
+
+
+unsigned int removeSubsetsFromFile(const std::string &inFileName,
+                                   const std::string &outFileName,
+                                   uint64_t maxMemoryBytes,
+                                   bool shortCircuit,
+                                   bool sortBeforeIntersect)
+{
+    std::ifstream inFile;
+    std::string line;
+    std::vector<unsigned int> dets;
+
+    /* find the largest detection index, and check the tracks as
+     * populatePairsVectorFromFile would. */
+    unsigned int numLines = 0;
+    unsigned int maxDet = 0;
+    openTracksFile(inFile, inFileName);
+    std::getline(inFile, line);
+    while (inFile.fail() == false) {
+        parseTrackletLine(line, dets);
+        if (dets.size() < 2) {
+            throw LSST_EXCEPT(InputFileFormatErrorException, "EE: CollapseTracklets: pairs in pairs file must be length >= 2!\n");
+        }
+        maxDet = std::max(maxDet, dets.back());
+        numLines++;
+        std::getline(inFile, line);
+    }
+    inFile.close();
+
+    /* add up the memory cost of the tracks using each bin of
+     * detections, and group the bins into buckets which fit in
+     * memory. */
+    DetectionBuckets buckets;
+    buckets.binWidth = maxDet / EXTERNAL_SUBSETS_NUM_BINS + 1;
+    std::vector<uint64_t> binCost(buckets.binOf(maxDet) + 1, 0);
+    openTracksFile(inFile, inFileName);
+    std::getline(inFile, line);
+    while (inFile.fail() == false) {
+        parseTrackletLine(line, dets);
+        uint64_t cost = trackMemoryCost(dets.size());
+        unsigned int lastBin = buckets.binOf(dets[0]);
+        binCost[lastBin] += cost;
+        for (unsigned int d = 1; d < dets.size(); d++) {
+            unsigned int bin = buckets.binOf(dets[d]);
+            if (bin != lastBin) {
+                binCost[bin] += cost;
+                lastBin = bin;
+            }
+        }
+        std::getline(inFile, line);
+    }
+    inFile.close();
+
+    buckets.bucketOfBin.resize(binCost.size());
+    uint64_t bucketCost = 0;
+    for (unsigned int bin = 0; bin < binCost.size(); bin++) {
+        if ((bin == 0) ||
+            ((bucketCost > 0) && (bucketCost + binCost[bin] > maxMemoryBytes))) {
+            buckets.numBuckets++;
+            bucketCost = 0;
+        }
+        bucketCost += binCost[bin];
+        buckets.bucketOfBin[bin] = buckets.numBuckets - 1;
+    }
+    std::vector<uint64_t>().swap(binCost);
+
+    /* write each track to the bucket of each of its detections, as
+     * (line number, number of detections, detections). */
+    for (unsigned int firstBucket = 0; firstBucket < buckets.numBuckets;
+         firstBucket += EXTERNAL_SUBSETS_MAX_OPEN_FILES) {
+        unsigned int lastBucket = std::min(buckets.numBuckets,
+                                           firstBucket + EXTERNAL_SUBSETS_MAX_OPEN_FILES);
+        std::vector<std::ofstream*> bucketFiles;
+        for (unsigned int b = firstBucket; b < lastBucket; b++) {
+            bucketFiles.push_back(new std::ofstream(bucketFileName(outFileName, b).c_str(),
+                                                    std::ios::out | std::ios::binary));
+            if (!bucketFiles.back()->is_open()) {
+                throw LSST_EXCEPT(FileException, "Failed to open " +
+                                  bucketFileName(outFileName, b) +
+                                  " - do you have write permissions?\n");
+            }
+        }
+        unsigned int lineNum = 0;
+        openTracksFile(inFile, inFileName);
+        std::getline(inFile, line);
+        while (inFile.fail() == false) {
+            parseTrackletLine(line, dets);
+            unsigned int header[2] = { lineNum, (unsigned int) dets.size() };
+            unsigned int lastWritten = buckets.numBuckets;
+            for (unsigned int d = 0; d < dets.size(); d++) {
+                unsigned int b = buckets.bucketOf(dets[d]);
+                if ((b != lastWritten) && (b >= firstBucket) && (b < lastBucket)) {
+                    std::ofstream *bucketFile = bucketFiles[b - firstBucket];
+                    bucketFile->write(reinterpret_cast<const char*>(header), sizeof(header));
+                    bucketFile->write(reinterpret_cast<const char*>(&dets[0]),
+                                      dets.size() * sizeof(unsigned int));
+                    lastWritten = b;
+                }
+            }
+            lineNum++;
+            std::getline(inFile, line);
+        }
+        inFile.close();
+        for (unsigned int b = firstBucket; b < lastBucket; b++) {
+            std::ofstream *bucketFile = bucketFiles[b - firstBucket];
+            bucketFile->close();
+            bool failed = bucketFile->fail();
+            delete bucketFile;
+            if (failed) {
+                throw LSST_EXCEPT(FileException, "Failed to write " +
+                                  bucketFileName(outFileName, b) +
+                                  " - is there space on the disk?\n");
+            }
+        }
+    }
+
+    /* remove subsets from each bucket in turn, keeping the answer for
+     * the tracks whose lowest detection is in that bucket. */
+    std::vector<bool> keep(numLines, false);
+    SubsetRemover mySR;
+    for (unsigned int b = 0; b < buckets.numBuckets; b++) {
+        std::vector<Tracklet> bucketTracks;
+        std::vector<Tracklet> bucketKept;
+        readBucket(bucketFileName(outFileName, b), bucketTracks);
+        mySR.removeSubsetsPopulateOutputVector(&bucketTracks, bucketKept,
+                                               shortCircuit, sortBeforeIntersect);
+        for (unsigned int i = 0; i < bucketKept.size(); i++) {
+            if (buckets.bucketOf(*bucketKept[i].indices.begin()) == b) {
+                keep[bucketKept[i].getId()] = true;
+            }
+        }
+        std::remove(bucketFileName(outFileName, b).c_str());
+    }
+
+    /* write out the tracks we kept, as writeTrackletsToOutFile would. */
+    std::ofstream outFile(outFileName.c_str());
+    if (!outFile.is_open()) {
+        throw LSST_EXCEPT(FileException, "Failed to open output file " +
+                          outFileName + " - do you have write permissions?\n");
+    }
+    unsigned int lineNum = 0;
+    openTracksFile(inFile, inFileName);
+    std::getline(inFile, line);
+    while ((inFile.fail() == false) && (lineNum < numLines)) {
+        if (keep[lineNum]) {
+            parseTrackletLine(line, dets);
+            for (unsigned int d = 0; d < dets.size(); d++) {
+                outFile << dets[d] << " ";
+            }
+            outFile << std::endl;
+        }
+        lineNum++;
+        std::getline(inFile, line);
+    }
+    inFile.close();
+    outFile.close();
+    if (outFile.fail()) {
+        throw LSST_EXCEPT(FileException, "Failed writing " + outFileName + "\n");
+    }
+    return buckets.numBuckets;
+}
+
+
+
+    }} // close lsst::mops
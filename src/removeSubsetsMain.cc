@@ -1,6 +1,8 @@
 // -*- LSST-C++ -*-
 /* jonathan myers */
 
+#include <cstdio>
+#include <cstdlib>
 #include <iomanip>
 
 #include <unistd.h>
@@ -8,6 +10,8 @@
 
 #include "lsst/mops/fileUtils.h"
 #include "lsst/mops/removeSubsets.h"
+#include "lsst/mops/removeDuplicates.h"
+#include "lsst/mops/removeSubsetsExternal.h"
 
 
 
@@ -20,7 +24,7 @@ namespace mops {
       time_t start = time(NULL);
 
         /* read pairs from a file, do the removal, and write the output */
-        std::string USAGE("USAGE: removeSubsets --inFile <input pairfile> --outFile <output pairfile> [--removeSubsets <TRUE/FALSE> --keepOnlyLongest <TRUE/FALSE>]");
+        std::string USAGE("USAGE: removeSubsets --inFile <input pairfile> --outFile <output pairfile> [--removeSubsets <TRUE/FALSE> --keepOnlyLongest <TRUE/FALSE> --removeDuplicates <TRUE/FALSE> --externalMemory <TRUE/FALSE> --memoryMB <n>]");
         std::ifstream inFile;
         std::ofstream outFile;
         std::vector <Tracklet>* pairsVector = new std::vector<Tracklet>;
@@ -32,6 +36,9 @@ namespace mops {
         bool keepOnlyLongestPerDet = false;
         bool shortCircuit = true;
         bool sortBeforeIntersect = false;
+        bool removeDuplicates = true;
+        bool externalMemory = false;
+        unsigned int memoryMB = 1024;
         
         static const struct option longOpts[] = {
             { "inFile", required_argument, NULL, 'i' },
@@ -40,12 +47,15 @@ namespace mops {
             { "keepOnlyLongest", required_argument, NULL, 'k'},
             { "shortCircuit", required_argument, NULL, 'c'},
             { "sortBeforeIntersect", required_argument, NULL, 's'},
+            { "removeDuplicates", required_argument, NULL, 'd'},
+            { "externalMemory", required_argument, NULL, 'e'},
+            { "memoryMB", required_argument, NULL, 'm'},
             { "help", no_argument, NULL, 'h' },
             { NULL, no_argument, NULL, 0 }
         };
 
         int longIndex = -1;
-        const char* optString = "i:o:r:k:c:s:h";
+        const char* optString = "i:o:r:k:c:s:d:e:m:h";
         int opt = getopt_long( argc, argv, optString, longOpts, &longIndex );
         while( opt != -1 ) {
             switch( opt ) {
@@ -70,6 +80,15 @@ namespace mops {
             case 's':
                 sortBeforeIntersect = guessBoolFromStringOrGiveErr(optarg, USAGE);
                 break;
+            case 'd':
+                removeDuplicates = guessBoolFromStringOrGiveErr(optarg, USAGE);
+                break;
+            case 'e':
+                externalMemory = guessBoolFromStringOrGiveErr(optarg, USAGE);
+                break;
+            case 'm':
+                memoryMB = atoi(optarg);
+                break;
                 
             case 'h':   /* fall-through is intentional */
             case '?':
@@ -88,6 +107,11 @@ namespace mops {
                               "Please specify input and output filenames.\n\n" +
                               USAGE + "\n");
         }
+        if (externalMemory && (keepOnlyLongestPerDet || !removeSubsets)) {
+            throw LSST_EXCEPT(CommandlineParseErrorException, 
+                              "--externalMemory only does removeSubsets, not keepOnlyLongest.\n\n" +
+                              USAGE + "\n");
+        }
 
 
         std::cout << "RemoveSubsets:" << std::endl;
@@ -102,12 +126,51 @@ namespace mops {
                   << std::endl;
         std::cout << "Keep only longest tracklet(s) per detection: "<< 
             boolToString(keepOnlyLongestPerDet) << std::endl;
+        std::cout << "Remove duplicates first:                     "<< 
+            boolToString(removeDuplicates) << std::endl;
+        std::cout << "Work from disk in buckets of detections:     "<< 
+            boolToString(externalMemory) << std::endl;
+
+        /* exact duplicates would be removed anyway; dropping them
+         * before reading the tracks in is much cheaper. */
+        std::string tracksFileName(inFileName);
+        if (removeSubsets && removeDuplicates) {
+            tracksFileName = std::string(outFileName) + ".unique";
+            std::cout << "Removing duplicate tracks, starting at " << curTime() << std::endl;
+            unsigned int numDuplicates = 
+                removeDuplicateTracksFromFile(inFileName, tracksFileName,
+                                              (uint64_t)memoryMB * 1024 * 1024);
+            std::cout << "Removed " << numDuplicates << " duplicate tracks." << std::endl;
+        }
+
+        if (externalMemory) {
+            std::cout << "Removing subsets from disk, starting at " << curTime() << std::endl;
+            unsigned int numBuckets = 
+                removeSubsetsFromFile(tracksFileName, outFileName,
+                                      (uint64_t)memoryMB * 1024 * 1024,
+                                      shortCircuit, sortBeforeIntersect);
+            if (tracksFileName != std::string(inFileName)) {
+                std::remove(tracksFileName.c_str());
+            }
+            delete pairsVector;
+            delete outputVector;
+            std::cout << "Used " << numBuckets << " buckets of detections." << std::endl;
+            std::cout << "Completed after " << std::fixed << std::setprecision(10) 
+                      << lsst::mops::timeElapsed(start) << " seconds." <<std::endl;
+            std::cout << "Finished successfully finished at " << curTime() << std::endl;
+            printMemUse();
+            return 0;
+        }
 
-        inFile.open(inFileName);
+        inFile.open(tracksFileName.c_str());
         outFile.open(outFileName);
 	std::cout << "Reading infile, starting at " << curTime() << std::endl;
         populatePairsVectorFromFile(inFile, *pairsVector);
 	std::cout << "Finished reading infile at " << curTime() << std::endl;
+        inFile.close();
+        if (tracksFileName != std::string(inFileName)) {
+            std::remove(tracksFileName.c_str());
+        }
         double dif = lsst::mops::timeElapsed(start);
         std::cout << "Reading input took " << std::fixed << std::setprecision(10) 
                   <<  dif  << " seconds." <<std::endl;             
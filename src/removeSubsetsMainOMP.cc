@@ -3,12 +3,15 @@
 
 #include <unistd.h>
 #include <getopt.h>
+#include <cstdio>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 
 #include "lsst/mops/common.h"
 #include "lsst/mops/removeSubsetsOMP.h"
+#include "lsst/mops/removeDuplicates.h"
 
 
 
@@ -84,7 +87,7 @@ void writeTrackletsToOutFile(
 int removeSubsetsMain(int argc, char** argv) {
 
     /* read pairs from a file, do the removal, and write the output */
-    std::string USAGE("USAGE: removeSubsets --inFile <input pairfile> --outFile <output pairfile>");
+    std::string USAGE("USAGE: removeSubsets --inFile <input pairfile> --outFile <output pairfile> [--removeDuplicates <TRUE/FALSE> --memoryMB <n>]");
     std::ifstream inFile;
     std::ofstream outFile;
     std::vector <std::set<unsigned int> >* pairsVector = 
@@ -96,18 +99,22 @@ int removeSubsetsMain(int argc, char** argv) {
     bool removeSubsets = true;
     bool shortCircuit = true;
     bool sortBeforeIntersect = false;
+    bool removeDuplicates = true;
+    unsigned int memoryMB = 1024;
     
     static const struct option longOpts[] = {
         { "inFile", required_argument, NULL, 'i' },
         { "outFile", required_argument, NULL, 'o' },
         { "shortCircuit", required_argument, NULL, 'c'},
         { "sortBeforeIntersect", required_argument, NULL, 's'},
+        { "removeDuplicates", required_argument, NULL, 'd'},
+        { "memoryMB", required_argument, NULL, 'm'},
         { "help", no_argument, NULL, 'h' },
         { NULL, no_argument, NULL, 0 }
     };
     
     int longIndex = -1;
-    const char* optString = "i:o:c:s:h";
+    const char* optString = "i:o:c:s:d:m:h";
     int opt = getopt_long( argc, argv, optString, longOpts, &longIndex );
     while( opt != -1 ) {
         switch( opt ) {
@@ -125,6 +132,12 @@ int removeSubsetsMain(int argc, char** argv) {
         case 's':
             sortBeforeIntersect = guessBoolFromStringOrGiveErr(optarg, USAGE);
             break;
+        case 'd':
+            removeDuplicates = guessBoolFromStringOrGiveErr(optarg, USAGE);
+            break;
+        case 'm':
+            memoryMB = atoi(optarg);
+            break;
             
         case 'h':   /* fall-through is intentional */
         case '?':
@@ -153,12 +166,30 @@ int removeSubsetsMain(int argc, char** argv) {
               << std::endl;
     std::cout << "Sort sets by size before set intersection:   "<< boolToString(sortBeforeIntersect)
               << std::endl;
+    std::cout << "Remove duplicates first:                     "<< boolToString(removeDuplicates)
+              << std::endl;
+
+    /* exact duplicates would be removed anyway; dropping them before
+     * reading the tracks in is much cheaper. */
+    std::string tracksFileName(inFileName);
+    if (removeDuplicates) {
+        tracksFileName = std::string(outFileName) + ".unique";
+        std::cout << "Removing duplicate tracks, starting at " << curTime() << std::endl;
+        unsigned int numDuplicates = 
+            removeDuplicateTracksFromFile(inFileName, tracksFileName,
+                                          (uint64_t)memoryMB * 1024 * 1024);
+        std::cout << "Removed " << numDuplicates << " duplicate tracks." << std::endl;
+    }
     
-    inFile.open(inFileName);
+    inFile.open(tracksFileName.c_str());
     outFile.open(outFileName);
     std::cout << "Reading infile, starting at " << curTime() << std::endl;
     populatePairsVectorFromFile(inFile, *pairsVector);
     std::cout << "Finished reading infile at " << curTime() << std::endl;
+    inFile.close();
+    if (tracksFileName != std::string(inFileName)) {
+        std::remove(tracksFileName.c_str());
+    }
     
     /* do the actual work */
     
@@ -11,12 +11,14 @@
 #include <algorithm> /* for a decent set intersection implementation...*/
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <map>
 #include <set>
 #include <time.h>
 #include <omp.h>
 
 #include "lsst/mops/removeSubsetsOMP.h"
+#include "lsst/mops/DetectionToTrackIndex.h"
 #include "lsst/mops/Exceptions.h"
 
 #define uint unsigned int
@@ -43,82 +45,46 @@ bool trackContains(unsigned int ind, const std::set<unsigned int> &t)
 
 
 void getSupersetOrIdenticalTracks(const std::set<unsigned int>* curTrack, 
-                                  std::map<unsigned int, std::set<unsigned int> > & reverseMap,
+                                  const DetectionToTrackIndex & reverseMap,
                                   bool shortCircuit,
                                   bool sortBeforeIntersect,
-                                  std::set<unsigned int> & results)
+                                  std::vector<unsigned int> & results)
 {
-
-        
+    /* the tracks using every detection of curTrack are the
+     * intersection of the tracks using each of them.  Gather the
+     * detections' track lists; we start from the shortest, as the
+     * intersection can only shrink from there.  If
+     * sortBeforeIntersect, intersect the rest in order of length too;
+     * otherwise in order of detection. */
+    std::vector<std::pair<unsigned int, unsigned int> > sizesAndSlots;
     std::set<unsigned int>::const_iterator indexIter;
-    bool quitNow = false;
-    if (!sortBeforeIntersect) 
-    {
-        // initialize results set
-        results = reverseMap[*(curTrack->begin())]; 
-
-        // if not sorting, read elements from reverse-map as needed;
-        // if we short-circuit we can avoid some memory accesses.
-        for (indexIter = (curTrack->begin())++; 
-             indexIter != curTrack->end() && (quitNow == false);
-             indexIter++) {
-            std::set<unsigned int> tmpResults;
-            const std::set<unsigned int> * detIDSet = &(reverseMap[*indexIter]);
-            std::set_intersection(results.begin(), results.end(),
-                                  detIDSet->begin(), detIDSet->end(), 
-                                  std::insert_iterator<std::set <unsigned int> >(tmpResults, tmpResults.begin()));
-            results = tmpResults;
-            
-            if (shortCircuit && (results.size() == 1)) {
-                // we are not a subset track(let); end this for loop
-                quitNow = true;
-            }
-            
-        }
+    for (indexIter = (*curTrack).begin(); 
+         indexIter != (*curTrack).end();
+         indexIter++) {
+        unsigned int slot = reverseMap.slotOf(*indexIter);
+        sizesAndSlots.push_back(std::make_pair(reverseMap.size(slot), slot));
+    }
+    if (sortBeforeIntersect) {
+        std::sort(sizesAndSlots.begin(), sizesAndSlots.end());
     }
-
-
     else {
+        std::iter_swap(sizesAndSlots.begin(), 
+                       std::min_element(sizesAndSlots.begin(), sizesAndSlots.end()));
+    }
 
-        /* we're sorting the sets read from reverseMap by size before
-         * doing intersection; so first we need to read all the
-         * elements from the reverse map, sort them by size and THEN
-         * do the intersection */
-        std::multimap<unsigned int, const std::set<unsigned int>* > reverseMapEntries;
-        for (indexIter = (curTrack->begin()); 
-             indexIter != curTrack->end();
-             indexIter++) {
-            const std::set<unsigned int>* detIDSet = &(reverseMap[*indexIter]);
-            std::pair<unsigned int, const std::set<unsigned int> * > toInsert(detIDSet->size(), detIDSet);
-            reverseMapEntries.insert(toInsert);
-        }
+    // initialize results set
+    unsigned int firstSlot = sizesAndSlots[0].second;
+    results.assign(reverseMap.begin(firstSlot), reverseMap.end(firstSlot));
 
-        /* std::multimap sorts automatically so we'll be using smallest
-           element first */
-        std::multimap<unsigned int, const std::set<unsigned int>* >::const_iterator entryIter;
-        // initialize results set
-        results = *(reverseMapEntries.begin()->second);
-
-        for (entryIter = reverseMapEntries.begin()++; 
-             entryIter != reverseMapEntries.end() && (quitNow == false);
-             entryIter++) {
-
-            std::set<unsigned int> tmpResults;
-            std::set_intersection(results.begin(), results.end(),
-                                  entryIter->second->begin(), entryIter->second->end(), 
-                                  std::insert_iterator<std::set <unsigned int> >(tmpResults, tmpResults.begin()));
-            results = tmpResults;
-            
-            if (shortCircuit && (results.size() == 1)) {
-                // we are not a subset track(let); end this for loop
-                quitNow = true;
-            }
+    bool quitNow = (shortCircuit && (results.size() == 1));
+    for (unsigned int i = 1; (i < sizesAndSlots.size()) && (quitNow == false); i++) {
+        reverseMap.intersectWith(sizesAndSlots[i].second, results);
             
+        if (shortCircuit && (results.size() == 1)) {
+            // we are not a subset track(let); end this for loop
+            quitNow = true;
         }
-           
     }
-
-
 }
 
 
@@ -135,9 +101,6 @@ void SubsetRemover::removeSubsetsPopulateOutputVector(
 {
     /* build a map which maps each detection to each tracklet which uses it. */
     
-    std::map<unsigned int, std::set<unsigned int> > reverseMap;
-    std::set<unsigned int>::iterator indicesIter;
-    
 
     int nthreads, tid;
     
@@ -151,17 +114,7 @@ void SubsetRemover::removeSubsetsPopulateOutputVector(
     }
 
     std::cout << "Building detection-to-track map, starting at " << curTime() << std::endl;
-    for (unsigned int curTrackIndex = 0; curTrackIndex < tracksVector->size(); curTrackIndex++) {
-        
-        const std::set<unsigned int> *curTrack = &(*tracksVector)[curTrackIndex];
-        
-        for (indicesIter = curTrack->begin(); 
-             indicesIter != curTrack->end();
-             indicesIter++) {
-            /* indicesIter now points to an index into the detections file (i.e. detection ID) */
-            reverseMap[*indicesIter].insert(curTrackIndex);
-        }
-    }
+    DetectionToTrackIndex reverseMap(*tracksVector);
         
     std::cout << "Finished detection-to-track map, filtering tracks starting at " << curTime() << std::endl;
 
@@ -189,7 +142,7 @@ void SubsetRemover::removeSubsetsPopulateOutputVector(
          *it is safe to assume that all tracklets have at least 1
          * detection, of course */
 
-        std::set<unsigned int> indicesIntersect;
+        std::vector<unsigned int> indicesIntersect;
         getSupersetOrIdenticalTracks(curTrack,
                                      reverseMap,
                                      shortCircuit,
@@ -210,7 +163,7 @@ void SubsetRemover::removeSubsetsPopulateOutputVector(
              * identical.  Check for supersets.*/
             bool writeThisTrack = true;
             unsigned int mySize = curTrack->size();
-            std::set<unsigned int>::iterator otherTrackIter;
+            std::vector<unsigned int>::iterator otherTrackIter;
 
             for (otherTrackIter = indicesIntersect.begin(); 
                  otherTrackIter != indicesIntersect.end();
@@ -118,10 +118,10 @@ namespace lsst {
 
 
 
-    double rmsForTracklet(const Tracklet t, const std::vector<MopsDetection> *detections, 
+    double rmsForTracklet(const Tracklet &t, const std::vector<MopsDetection> *detections, 
                           std::vector<double> *perDetSqDist) {
         std::vector<double> RASlopeAndOffset, DecSlopeAndOffset;
-        std::set<unsigned int>::iterator indicesIter;
+        std::set<unsigned int>::const_iterator indicesIter;
         std::vector<MopsDetection> trackletDets;
         std::vector<MopsDetection>::iterator detIter;
         for (indicesIter = t.indices.begin(); 